@@ -27,14 +27,41 @@
 #include <osmocom/core/logging.h>
 
 #include <osmocom/modbus/modbus_prim.h>
+#include <osmocom/modbus/modbus_bits.h>
 #include <osmocom/modbus/modbus_conn.h>
 #include <osmocom/modbus/modbus_rtu.h>
+#include <osmocom/modbus/modbus_tcp.h>
+#include <osmocom/modbus/modbus_crc16.h>
+#include <osmocom/modbus/modbus_poll.h>
+#include <osmocom/modbus/modbus_reg_store.h>
+#include <osmocom/modbus/modbus_bus_group.h>
+#include <osmocom/modbus/modbus_mt.h>
+#include <osmocom/modbus/modbus_engine.h>
 
 extern int DLMODBUS;
 extern int DLMODBUS_RTU;
 /* Overwrite with whatever number is wanted by the APP */
 unsigned int osmo_modbus_set_logging_category_offset(int offset);
 
+/* Slave address of requests sent to all slaves at once. Only write requests can
+ * be broadcast, and slaves never answer them. */
+#define OSMO_MODBUS_ADDR_BROADCAST 0
+
 enum osmo_modbus_function_code {
+	OSMO_MODBUS_FUNC_READ_COILS = 0x01,
+	OSMO_MODBUS_FUNC_READ_DISCRETE_INPUTS = 0x02,
 	OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG = 0x03,
+	OSMO_MODBUS_FUNC_WRITE_MULT_COILS = 0x0F,
+	OSMO_MODBUS_FUNC_WRITE_MULT_REG = 0x10,
+	OSMO_MODBUS_FUNC_RW_MULT_REG = 0x17,
+};
+
+/* Exception responses carry the function code of the request with this bit set */
+#define OSMO_MODBUS_FUNC_EXCEPTION_BIT 0x80
+
+enum osmo_modbus_exception_code {
+	OSMO_MODBUS_EXC_ILLEGAL_FUNCTION = 0x01,
+	OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS = 0x02,
+	OSMO_MODBUS_EXC_ILLEGAL_DATA_VALUE = 0x03,
+	OSMO_MODBUS_EXC_SLAVE_DEVICE_FAILURE = 0x04,
 };
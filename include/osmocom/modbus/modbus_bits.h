@@ -0,0 +1,52 @@
+/*! \file modbus_bits.h
+ * Osmocom modbus coil and discrete input bit helpers */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Coils and discrete inputs are carried in prims bit-packed, as on the wire:
+ * the first one in the LSB of the first byte, unused bits of the last byte set
+ * to 0. The helpers below convert a whole block from/to one byte per bit,
+ * several bits at a time. */
+
+/* Bytes needed to hold num_bits packed bits */
+#define OSMO_MODBUS_BITS_BYTES(num_bits) (((num_bits) + 7) / 8)
+
+/* Unpack num_bits from in into out[], one byte (0 or 1) per bit */
+void osmo_modbus_bits_unpack(uint8_t *out, const uint8_t *in, unsigned int num_bits);
+/* Pack num_bits bytes from in[] into out, any non-zero byte being a 1 */
+void osmo_modbus_bits_pack(uint8_t *out, const uint8_t *in, unsigned int num_bits);
+
+static inline void osmo_modbus_bits_unpack_bool(bool *out, const uint8_t *in, unsigned int num_bits)
+{
+	_Static_assert(sizeof(bool) == 1, "bool must be one byte");
+	osmo_modbus_bits_unpack((uint8_t *)out, in, num_bits);
+}
+
+static inline void osmo_modbus_bits_pack_bool(uint8_t *out, const bool *in, unsigned int num_bits)
+{
+	osmo_modbus_bits_pack(out, (const uint8_t *)in, num_bits);
+}
@@ -0,0 +1,62 @@
+/*! \file modbus_bus_group.h
+ * Osmocom modbus group of conns sharing one timer wheel */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+#include <osmocom/modbus/modbus_rtu.h>
+
+/* Group of conns (eg. one per serial port of a concentrator) whose RTU
+ * framing timers (T1.5/T3.5) and master response timers all run on one
+ * hierarchical timer wheel woken through a single timerfd, instead of one
+ * osmo_timer (or timerfd) each. The group owns its conns: freeing the group
+ * frees them too, and a conn freed on its own leaves the group. */
+struct osmo_modbus_bus_group;
+
+struct osmo_modbus_bus_group_stats {
+	unsigned int num_conns;
+	unsigned int num_connected;
+	/* Summed over the conns of the group */
+	unsigned int num_queued; /* Master requests not sent yet */
+	unsigned int num_inflight; /* Master requests awaiting a reply */
+	struct osmo_modbus_conn_pool_stats pool;
+	struct osmo_modbus_rtu_echo_stats echo;
+	struct osmo_modbus_rtu_resync_stats resync;
+	/* Shared timer wheel */
+	unsigned int timers_pending;
+	unsigned long timers_scheduled;
+	unsigned long timers_expired;
+	unsigned long timers_cascaded; /* Moved down a level of the wheel */
+	unsigned long timer_wakeups; /* Expirations of the timerfd */
+};
+
+struct osmo_modbus_bus_group *osmo_modbus_bus_group_alloc(void *ctx);
+void osmo_modbus_bus_group_free(struct osmo_modbus_bus_group *group);
+/* Add a conn not connected yet. Its timers run on the group wheel from then
+ * on, even if osmo_modbus_conn_rtu_set_timerfd() was enabled. */
+int osmo_modbus_bus_group_add(struct osmo_modbus_bus_group *group, struct osmo_modbus_conn *conn);
+void osmo_modbus_bus_group_get_stats(const struct osmo_modbus_bus_group *group,
+				     struct osmo_modbus_bus_group_stats *stats);
@@ -28,9 +28,11 @@
 #include <osmocom/modbus/modbus_prim.h>
 
 struct osmo_modbus_conn_rtu;
+struct osmo_modbus_conn_tcp;
 
 enum osmo_modbus_proto_type {
 	OSMO_MODBUS_PROTO_RTU,
+	OSMO_MODBUS_PROTO_TCP,
 };
 
 enum osmo_modbus_conn_role {
@@ -41,6 +43,22 @@ enum osmo_modbus_conn_role {
 enum osmo_modbus_conn_timeout {
 	OSMO_MODBUS_TO_TURNAROUND = 1,
 	OSMO_MODBUS_TO_NORESPONSE = 2,
+	/* Bounds of the adaptive response timeout */
+	OSMO_MODBUS_TO_NORESPONSE_MIN = 3,
+	OSMO_MODBUS_TO_NORESPONSE_MAX = 4,
+	/* Probe interval of a quarantined slave, doubled up to _MAX after each failed probe */
+	OSMO_MODBUS_TO_QUARANTINE_PROBE = 5,
+	OSMO_MODBUS_TO_QUARANTINE_PROBE_MAX = 6,
+};
+
+/* Priority classes of requests submitted by the master. Queued requests of a
+ * higher class are always sent first; within a class, slaves are served
+ * round-robin so that one flooded slave does not hold back the others. */
+enum osmo_modbus_prio {
+	OSMO_MODBUS_PRIO_HIGH,	 /* eg. control writes */
+	OSMO_MODBUS_PRIO_NORMAL, /* default */
+	OSMO_MODBUS_PRIO_LOW,	 /* eg. bulk/periodic reads */
+	_NUM_OSMO_MODBUS_PRIO
 };
 
 struct osmo_modbus_conn;
@@ -62,8 +80,67 @@ int osmo_modbus_conn_set_address(struct osmo_modbus_conn* conn, uint16_t address
 uint16_t osmo_modbus_conn_get_address(const struct osmo_modbus_conn* conn);
 void osmo_modbus_conn_set_prim_cb(struct osmo_modbus_conn* conn,
 				  osmo_modbus_prim_cb prim_cb, void *ctx);
+/* Master requests to OSMO_MODBUS_ADDR_BROADCAST are sent on their own,
+ * followed by the turnaround delay (OSMO_MODBUS_TO_TURNAROUND), and no
+ * response is delivered for them. */
 int osmo_modbus_conn_submit_prim(struct osmo_modbus_conn* conn,
 				 struct osmo_modbus_prim *prim);
+int osmo_modbus_conn_submit_prim_prio(struct osmo_modbus_conn* conn,
+				      struct osmo_modbus_prim *prim,
+				      enum osmo_modbus_prio prio);
 int osmo_modbus_conn_set_monitor_mode(struct osmo_modbus_conn* conn, bool enable);
 
+/* Messages allocated by the library can be recycled through a per-conn pool
+ * instead of going through the heap each time. Disabled (0) by default. */
+struct osmo_modbus_conn_pool_stats {
+	unsigned long prim_hits;
+	unsigned long prim_misses;
+	unsigned long frame_hits;
+	unsigned long frame_misses;
+};
+int osmo_modbus_conn_set_pool_size(struct osmo_modbus_conn *conn, unsigned int num);
+void osmo_modbus_conn_get_pool_stats(const struct osmo_modbus_conn *conn,
+				     struct osmo_modbus_conn_pool_stats *stats);
+
+/* Master: the round-trip time of each slave is tracked as a smoothed mean plus
+ * mean deviation. Once enabled, the response timeout of each request is derived
+ * from it (mean + 4 * deviation, doubled after each timeout in a row), bounded
+ * by OSMO_MODBUS_TO_NORESPONSE_MIN/MAX. OSMO_MODBUS_TO_NORESPONSE applies to
+ * slaves which never answered. A reply arriving after its request timed out is
+ * still measured, as long as it can be told apart: without Transaction Id
+ * (RTU), once another request was sent to that slave, neither reply is. Resent
+ * requests are never measured. Disabled by default. */
+struct osmo_modbus_conn_rtt_stats {
+	bool valid; /* At least one reply measured */
+	unsigned long srtt_us;
+	unsigned long rttvar_us;
+	unsigned long timeout_us; /* Used for the next request */
+	unsigned long samples;
+	unsigned long timeouts;
+};
+int osmo_modbus_conn_set_adaptive_timeout(struct osmo_modbus_conn *conn, bool enable);
+int osmo_modbus_conn_get_rtt_stats(struct osmo_modbus_conn *conn, uint16_t address,
+				   struct osmo_modbus_conn_rtt_stats *stats);
+
+/* Master: resend a request timing out up to num times (max 255) before
+ * delivering OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT. 0 (default) disables it. */
+int osmo_modbus_conn_set_retries(struct osmo_modbus_conn *conn, unsigned int num);
+/* Master: a slave timing out num_timeouts times in a row is quarantined. Its
+ * requests then fail fast with OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT, delivered
+ * from the main loop, except one probe sent every OSMO_MODBUS_TO_QUARANTINE_PROBE.
+ * Any reply from it lifts the quarantine, including a late one arriving after
+ * its request timed out, whatever else is in flight. 0 (default) disables it. */
+int osmo_modbus_conn_set_quarantine(struct osmo_modbus_conn *conn, unsigned int num_timeouts);
+struct osmo_modbus_conn_health_stats {
+	bool quarantined;
+	unsigned int consecutive_timeouts;
+	unsigned long retries; /* Requests resent */
+	unsigned long failed_fast; /* Requests failed without being sent */
+	unsigned long probes;
+	unsigned long quarantines;
+};
+int osmo_modbus_conn_get_health_stats(struct osmo_modbus_conn *conn, uint16_t address,
+				      struct osmo_modbus_conn_health_stats *stats);
+
 struct osmo_modbus_conn_rtu *osmo_modbus_conn_get_rtu(struct osmo_modbus_conn *conn);
+struct osmo_modbus_conn_tcp *osmo_modbus_conn_get_tcp(struct osmo_modbus_conn *conn);
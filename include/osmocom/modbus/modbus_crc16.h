@@ -0,0 +1,58 @@
+/*! \file modbus_crc16.h
+ * Osmocom modbus CRC-16 */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <osmocom/core/utils.h>
+
+/* Initial value of the CRC-16/MODBUS shift register */
+#define OSMO_MODBUS_CRC16_INIT 0xFFFF
+
+/*! \brief Implementations available to compute the CRC-16/MODBUS */
+enum osmo_modbus_crc16_engine {
+	OSMO_MODBUS_CRC16_ENGINE_AUTO,	 /* Pick the fastest one supported by the CPU */
+	OSMO_MODBUS_CRC16_ENGINE_SLICE8, /* Table driven, 8 bytes per iteration */
+	OSMO_MODBUS_CRC16_ENGINE_CLMUL,	 /* Carry-less multiply folding (x86 PCLMUL, ARMv8 PMULL) */
+	_NUM_OSMO_MODBUS_CRC16_ENGINE
+};
+extern const struct value_string osmo_modbus_crc16_engine_names[];
+
+int osmo_modbus_crc16_set_engine(enum osmo_modbus_crc16_engine engine);
+enum osmo_modbus_crc16_engine osmo_modbus_crc16_get_engine(void);
+
+/* Feed len bytes into the CRC shift register crc (start with
+ * OSMO_MODBUS_CRC16_INIT). Feeding a full RTU frame including its CRC
+ * leaves the register at 0. */
+uint16_t osmo_modbus_crc16_update(uint16_t crc, const uint8_t *data, size_t len);
+
+/* CRC of a buffer, with the first transmitted byte in the MSB, so that it can
+ * be appended to a frame with msgb_put_u16() */
+static inline uint16_t osmo_modbus_crc16(const uint8_t *data, size_t len)
+{
+	uint16_t crc = osmo_modbus_crc16_update(OSMO_MODBUS_CRC16_INIT, data, len);
+	return (crc << 8) | (crc >> 8);
+}
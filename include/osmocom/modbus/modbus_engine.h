@@ -0,0 +1,72 @@
+/*! \file modbus_engine.h
+ * Osmocom modbus conns spread over several threads */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+
+/* Engine running conns ("buses") on N worker threads, each with its own
+ * libosmocore select loop, optionally pinned to a CPU. Each bus lives on one
+ * worker, picked from a hash of its name or set explicitly.
+ *
+ * A bus conn is created, used and freed on its worker thread only: the setup
+ * callback runs there, and so do the conn prim_cb and all its timers. Other
+ * threads can submit prims to it through osmo_modbus_conn_submit_prim_mt() (see
+ * modbus_mt.h) if the setup callback enabled it.
+ *
+ * The control functions below are thread-safe, and wait for the worker to have
+ * processed the command, so they must not be called from a worker thread.
+ *
+ * msgbs of the workers are allocated from the global context of the worker's
+ * osmo_ctx (OTC_GLOBAL), never from the one set with msgb_talloc_ctx_init(). */
+struct osmo_modbus_engine;
+
+/* Let the bus worker be picked from the hash of its name */
+#define OSMO_MODBUS_ENGINE_WORKER_HASH -1
+
+/* Runs on the worker thread: allocate the conn from ctx, configure and connect
+ * it. Anything the conn prim_cb needs should be allocated as a child of the
+ * conn, since removing the bus frees the conn. Return NULL on failure. */
+typedef struct osmo_modbus_conn *(*osmo_modbus_engine_bus_setup_cb)(void *ctx, const char *name, void *data);
+
+struct osmo_modbus_engine *osmo_modbus_engine_alloc(void *ctx, unsigned int num_workers);
+/* Stops the workers, freeing all buses */
+void osmo_modbus_engine_free(struct osmo_modbus_engine *engine);
+unsigned int osmo_modbus_engine_num_workers(const struct osmo_modbus_engine *engine);
+/* Before osmo_modbus_engine_start(). cpu < 0: not pinned (default) */
+int osmo_modbus_engine_set_cpu(struct osmo_modbus_engine *engine, unsigned int worker, int cpu);
+int osmo_modbus_engine_start(struct osmo_modbus_engine *engine);
+
+/* Returns the worker index the bus was placed on, or a negative error.
+ * conn, if not NULL, is filled with the conn returned by setup_cb, valid
+ * until the bus is removed. */
+int osmo_modbus_engine_add_bus(struct osmo_modbus_engine *engine, const char *name, int worker,
+			       osmo_modbus_engine_bus_setup_cb setup_cb, void *data,
+			       struct osmo_modbus_conn **conn);
+int osmo_modbus_engine_remove_bus(struct osmo_modbus_engine *engine, const char *name);
+/* Worker index of the bus, -ENOENT if there is none with that name */
+int osmo_modbus_engine_bus_worker(struct osmo_modbus_engine *engine, const char *name);
+unsigned int osmo_modbus_engine_worker_num_buses(struct osmo_modbus_engine *engine, unsigned int worker);
@@ -0,0 +1,66 @@
+/*! \file modbus_mt.h
+ * Osmocom modbus submission from other threads */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+#include <osmocom/modbus/modbus_prim.h>
+
+/* The library is not thread-safe: a conn must be used from the thread running
+ * its osmo_select_main() loop. The only exception are the functions below,
+ * which let other threads submit prims to a conn and get back the responses
+ * through lock-free queues, the conn thread being woken through an eventfd. */
+
+/* Completion queue: receives the responses to master requests submitted with
+ * it, to be popped by a single consumer thread. */
+struct osmo_modbus_mt_cq;
+
+/* Conn thread, before other threads use the conn */
+int osmo_modbus_conn_mt_enable(struct osmo_modbus_conn *conn);
+/* Conn thread. Free it only once no request submitted with it is pending. */
+struct osmo_modbus_mt_cq *osmo_modbus_mt_cq_alloc(void *ctx);
+void osmo_modbus_mt_cq_free(struct osmo_modbus_mt_cq *cq);
+
+/* Any thread. prim is copied and stays owned by the caller. As the makeprim
+ * helpers allocate through talloc, which isn't thread-safe, other threads
+ * should rather fill a struct osmo_modbus_prim on their stack, with
+ * osmo_prim_init() and a NULL msg.
+ * Master requests: the response (or OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT
+ * indication) is pushed to cq along with user_data. If cq is NULL, or for
+ * broadcasts, it goes to the conn prim_cb as usual (broadcasts get none).
+ * Requests with a cq which the conn didn't answer by the time it is freed are
+ * completed with -ECANCELED. */
+int osmo_modbus_conn_submit_prim_mt(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *prim,
+				    enum osmo_modbus_prio prio, struct osmo_modbus_mt_cq *cq, void *user_data);
+
+/* Consumer thread. eventfd becoming readable when completions are queued,
+ * until all of them are popped. */
+int osmo_modbus_mt_cq_fd(const struct osmo_modbus_mt_cq *cq);
+/* Consumer thread. Pop the next completion into resp (and its user_data).
+ * Returns 0 on success, -EAGAIN if none is queued, or the negative error of a
+ * request rejected by the conn, -ECANCELED if the conn was freed before
+ * answering it (resp is not filled then). */
+int osmo_modbus_mt_cq_pop(struct osmo_modbus_mt_cq *cq, struct osmo_modbus_prim *resp, void **user_data);
@@ -0,0 +1,61 @@
+/*! \file modbus_poll.h
+ * Osmocom modbus master poll plan */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+
+/* A poll plan periodically reads holding registers from slaves on behalf of
+ * its subscribers. Subscribed ranges of the same slave and period which are
+ * adjacent, overlapping or separated by at most max_gap registers are read
+ * with a single request (of up to OSMO_MODBUS_POLL_MAX_REG registers), and
+ * the response is split back to each subscriber. */
+
+#define OSMO_MODBUS_POLL_MAX_REG 125
+
+struct osmo_modbus_poll_plan;
+struct osmo_modbus_poll_entry;
+
+/* registers holds num_reg raw (big endian) register values, or is NULL if the
+ * slave failed to answer (timeout or unexpected response). */
+typedef void (*osmo_modbus_poll_cb)(uint16_t address, uint16_t first_reg, uint16_t num_reg,
+				    const uint16_t *registers, void *ctx);
+
+struct osmo_modbus_poll_plan *osmo_modbus_poll_plan_alloc(struct osmo_modbus_conn *conn);
+void osmo_modbus_poll_plan_free(struct osmo_modbus_poll_plan *plan);
+int osmo_modbus_poll_plan_set_max_gap(struct osmo_modbus_poll_plan *plan, uint16_t max_gap);
+int osmo_modbus_poll_plan_set_prio(struct osmo_modbus_poll_plan *plan, enum osmo_modbus_prio prio);
+int osmo_modbus_poll_plan_start(struct osmo_modbus_poll_plan *plan);
+void osmo_modbus_poll_plan_stop(struct osmo_modbus_poll_plan *plan);
+/* Number of requests sent per period by the plan, summed over all periods */
+unsigned int osmo_modbus_poll_plan_get_num_requests(struct osmo_modbus_poll_plan *plan);
+
+/* Entries must not be added/removed from within an osmo_modbus_poll_cb */
+struct osmo_modbus_poll_entry *osmo_modbus_poll_plan_add(struct osmo_modbus_poll_plan *plan,
+							 uint16_t address, uint16_t first_reg,
+							 uint16_t num_reg, unsigned long period_ms,
+							 osmo_modbus_poll_cb cb, void *ctx);
+void osmo_modbus_poll_plan_del(struct osmo_modbus_poll_entry *entry);
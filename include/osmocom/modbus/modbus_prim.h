@@ -24,11 +24,23 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include <osmocom/core/prim.h>
+
+#include <osmocom/modbus/modbus_bits.h>
+
 /*! \brief Modbus primitives */
 enum osmo_modbus_prim_type {
 	OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT,
 	OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,
+	OSMO_MODBUS_PRIM_N_WRITE_MULT_REG,
+	OSMO_MODBUS_PRIM_N_RW_MULT_REG,
+	OSMO_MODBUS_PRIM_N_READ_COILS,
+	OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS,
+	OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS,
+	OSMO_MODBUS_PRIM_N_EXCEPTION,
 };
 extern const struct value_string osmo_modbus_prim_type_names[];
 
@@ -46,15 +58,138 @@ struct osmo_modbus_read_mult_hold_reg_resp_param {
 	/* user data */
 };
 
+/* Max registers written by a single request */
+#define OSMO_MODBUS_WRITE_MULT_REG_MAX 123
+#define OSMO_MODBUS_RW_MULT_REG_WRITE_MAX 121
+
+/* OSMO_MODBUS_PRIM_N_WRITE_MULT_REG */
+struct osmo_modbus_write_mult_reg_req_param {
+	uint16_t first_reg;
+	uint16_t num_reg;
+	uint16_t registers[OSMO_MODBUS_WRITE_MULT_REG_MAX];
+	/* user data */
+};
+
+struct osmo_modbus_write_mult_reg_resp_param {
+	uint16_t first_reg;
+	uint16_t num_reg;
+	/* user data */
+};
+
+/* OSMO_MODBUS_PRIM_N_RW_MULT_REG: the write is performed before the read */
+struct osmo_modbus_rw_mult_reg_req_param {
+	uint16_t read_first_reg;
+	uint16_t read_num_reg;
+	uint16_t write_first_reg;
+	uint16_t write_num_reg;
+	uint16_t registers[OSMO_MODBUS_RW_MULT_REG_WRITE_MAX]; /* Values to write */
+	/* user data */
+};
+
+struct osmo_modbus_rw_mult_reg_resp_param {
+	uint16_t num_reg;
+	uint16_t registers[125]; /* Values read */
+	/* user data */
+};
+
+/* Max bits read or written by a single request */
+#define OSMO_MODBUS_READ_BITS_MAX 2000
+#define OSMO_MODBUS_WRITE_MULT_COILS_MAX 1968
+
+/* OSMO_MODBUS_PRIM_N_READ_COILS, OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS */
+struct osmo_modbus_read_bits_req_param {
+	uint16_t first_bit;
+	uint16_t num_bits;
+	/* user data */
+};
+
+/* bits[] packed as on the wire, see modbus_bits.h. The response doesn't tell
+ * how many bits were requested, only the number of bytes. */
+struct osmo_modbus_read_bits_resp_param {
+	uint8_t byte_count;
+	uint8_t bits[OSMO_MODBUS_BITS_BYTES(OSMO_MODBUS_READ_BITS_MAX)];
+	/* user data */
+};
+
+/* OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS */
+struct osmo_modbus_write_mult_coils_req_param {
+	uint16_t first_coil;
+	uint16_t num_coils;
+	uint8_t bits[OSMO_MODBUS_BITS_BYTES(OSMO_MODBUS_WRITE_MULT_COILS_MAX)]; /* Packed values to write */
+	/* user data */
+};
+
+struct osmo_modbus_write_mult_coils_resp_param {
+	uint16_t first_coil;
+	uint16_t num_coils;
+	/* user data */
+};
+
+/* OSMO_MODBUS_PRIM_N_EXCEPTION: response only, answering a request of any of
+ * the primitives above */
+struct osmo_modbus_exception_resp_param {
+	uint8_t function_code; /* Of the request, see enum osmo_modbus_function_code */
+	uint8_t exception_code; /* See enum osmo_modbus_exception_code */
+	/* user data */
+};
+
+/* Prims allocated by the library have room for the whole struct. Apps keeping
+ * many of them (eg. thousands of queued requests) may opt in to compact prims,
+ * sized to their actual parameters, with osmo_modbus_prim_compact(): only the
+ * param struct matching their primitive may then be accessed (and registers[]
+ * up to num_reg, or through the accessors below), and they must not be copied
+ * by value. */
 struct osmo_modbus_prim {
 	struct osmo_prim_hdr oph;
 	uint16_t address;
+	uint16_t trans_id; /* Transaction Identifier (TCP), filled by the library */
 	union {
 		struct osmo_modbus_read_mult_hold_reg_req_param read_mult_hold_reg_req;
 		struct osmo_modbus_read_mult_hold_reg_resp_param read_mult_hold_reg_resp;
+		struct osmo_modbus_write_mult_reg_req_param write_mult_reg_req;
+		struct osmo_modbus_write_mult_reg_resp_param write_mult_reg_resp;
+		struct osmo_modbus_rw_mult_reg_req_param rw_mult_reg_req;
+		struct osmo_modbus_rw_mult_reg_resp_param rw_mult_reg_resp;
+		struct osmo_modbus_read_bits_req_param read_coils_req;
+		struct osmo_modbus_read_bits_resp_param read_coils_resp;
+		struct osmo_modbus_read_bits_req_param read_discrete_inputs_req;
+		struct osmo_modbus_read_bits_resp_param read_discrete_inputs_resp;
+		struct osmo_modbus_write_mult_coils_req_param write_mult_coils_req;
+		struct osmo_modbus_write_mult_coils_resp_param write_mult_coils_resp;
+		struct osmo_modbus_exception_resp_param exception_resp;
 	} u;
 };
 
 struct osmo_modbus_prim *osmo_modbus_makeprim_timeout_resp(uint16_t address);
 struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_req(uint16_t address, uint16_t first_reg, uint16_t num_reg);
 struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_resp(uint16_t address, uint8_t num_reg, uint16_t *registers);
+/* registers are raw (big endian) values, as carried in prims */
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_reg_req(uint16_t address, uint16_t first_reg, uint16_t num_reg,
+								 const uint16_t *registers);
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_reg_resp(uint16_t address, uint16_t first_reg, uint16_t num_reg);
+struct osmo_modbus_prim *osmo_modbus_makeprim_rw_mult_reg_req(uint16_t address,
+							      uint16_t read_first_reg, uint16_t read_num_reg,
+							      uint16_t write_first_reg, uint16_t write_num_reg,
+							      const uint16_t *registers);
+struct osmo_modbus_prim *osmo_modbus_makeprim_rw_mult_reg_resp(uint16_t address, uint8_t num_reg, const uint16_t *registers);
+/* bits are packed as on the wire, see modbus_bits.h */
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_coils_req(uint16_t address, uint16_t first_coil, uint16_t num_coils);
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_coils_resp(uint16_t address, uint8_t byte_count, const uint8_t *bits);
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_discrete_inputs_req(uint16_t address, uint16_t first_input,
+									uint16_t num_inputs);
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_discrete_inputs_resp(uint16_t address, uint8_t byte_count,
+									 const uint8_t *bits);
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_coils_req(uint16_t address, uint16_t first_coil,
+								   uint16_t num_coils, const uint8_t *bits);
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_coils_resp(uint16_t address, uint16_t first_coil,
+								    uint16_t num_coils);
+struct osmo_modbus_prim *osmo_modbus_makeprim_exception_resp(uint16_t address, uint8_t function_code,
+							     uint8_t exception_code);
+
+size_t osmo_modbus_prim_len(const struct osmo_modbus_prim *prim);
+struct osmo_modbus_prim *osmo_modbus_prim_compact(struct osmo_modbus_prim *prim);
+uint16_t osmo_modbus_prim_num_reg(const struct osmo_modbus_prim *prim);
+const uint16_t *osmo_modbus_prim_registers(const struct osmo_modbus_prim *prim);
+uint16_t osmo_modbus_prim_get_reg(const struct osmo_modbus_prim *prim, unsigned int idx);
+uint16_t osmo_modbus_prim_num_bits(const struct osmo_modbus_prim *prim);
+const uint8_t *osmo_modbus_prim_bits(const struct osmo_modbus_prim *prim);
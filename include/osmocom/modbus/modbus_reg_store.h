@@ -0,0 +1,48 @@
+/*! \file modbus_reg_store.h
+ * Osmocom modbus slave register store */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+
+/* Holding registers of a slave conn, kept by the library. Read and write
+ * requests fully covered by the store are answered from it without calling the
+ * app prim_cb (written values are then available through
+ * osmo_modbus_reg_store_get()). Requests reaching outside of it are still
+ * passed to the app, which must answer them (eg. with an Illegal Data Address
+ * exception), or answered with that exception if the conn has no prim_cb.
+ * Dense ranges declared with osmo_modbus_reg_store_add_range() are kept in flat
+ * arrays. Registers set outside of them are kept in a sparse index. */
+struct osmo_modbus_reg_store;
+
+struct osmo_modbus_reg_store *osmo_modbus_reg_store_alloc(struct osmo_modbus_conn *conn);
+void osmo_modbus_reg_store_free(struct osmo_modbus_reg_store *store);
+int osmo_modbus_reg_store_add_range(struct osmo_modbus_reg_store *store, uint16_t first_reg, unsigned int num_reg);
+/* Bulk update/lookup, values in host byte order */
+int osmo_modbus_reg_store_set(struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			      unsigned int num_reg, const uint16_t *values);
+int osmo_modbus_reg_store_get(const struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			      unsigned int num_reg, uint16_t *values);
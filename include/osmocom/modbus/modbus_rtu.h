@@ -32,9 +32,53 @@
 
 struct osmo_modbus_conn_rtu;
 
+/* RS-485 transceiver direction control done by the kernel serial driver (TIOCSRS485) */
+struct osmo_modbus_rtu_rs485 {
+	bool enabled;
+	bool rts_on_send; /* RTS logic level while sending (true: high), inverted after send */
+	unsigned int delay_rts_before_send; /* in milliseconds */
+	unsigned int delay_rts_after_send; /* in milliseconds */
+	bool rx_during_tx; /* Keep the receiver enabled while sending (echo is received) */
+};
+
 struct osmo_modbus_conn_rtu* osmo_modbus_conn_rtu_alloc(struct osmo_modbus_conn* conn);
 
 int osmo_modbus_conn_rtu_set_device(struct osmo_modbus_conn_rtu* rtu, const char* serial_dev);
 const char *osmo_modbus_conn_rtu_get_device(const struct osmo_modbus_conn_rtu* rtu);
 int osmo_modbus_conn_rtu_set_baudrate(struct osmo_modbus_conn_rtu* rtu, unsigned baudrate);
 unsigned osmo_modbus_conn_rtu_get_baudrate(const struct osmo_modbus_conn_rtu* rtu);
+int osmo_modbus_conn_rtu_set_early_delivery(struct osmo_modbus_conn_rtu* rtu, bool enable);
+bool osmo_modbus_conn_rtu_get_early_delivery(const struct osmo_modbus_conn_rtu* rtu);
+/* Applied at connect time, or immediately if already connected */
+int osmo_modbus_conn_rtu_set_rs485(struct osmo_modbus_conn_rtu* rtu, const struct osmo_modbus_rtu_rs485 *rs485);
+void osmo_modbus_conn_rtu_get_rs485(const struct osmo_modbus_conn_rtu* rtu, struct osmo_modbus_rtu_rs485 *rs485);
+/* Discard the echo of our own emitted frame, as received back by half-duplex
+ * adapters, before it reaches the receiver state machine */
+int osmo_modbus_conn_rtu_set_echo_suppress(struct osmo_modbus_conn_rtu* rtu, bool enable);
+bool osmo_modbus_conn_rtu_get_echo_suppress(const struct osmo_modbus_conn_rtu* rtu);
+struct osmo_modbus_rtu_echo_stats {
+	unsigned long matched; /* Emitted frames whose echo was received and discarded */
+	unsigned long mismatched; /* Emitted frames whose echo differed or never arrived */
+};
+void osmo_modbus_conn_rtu_get_echo_stats(const struct osmo_modbus_conn_rtu* rtu,
+					 struct osmo_modbus_rtu_echo_stats *stats);
+/* Slave/monitor role: when a frame fails its CRC, scan the received bytes for
+ * the start of the next valid frame (plausible address and function code plus
+ * CRC match) instead of dropping all of them, for buses where noise hides the
+ * frame boundaries */
+int osmo_modbus_conn_rtu_set_resync(struct osmo_modbus_conn_rtu* rtu, bool enable);
+bool osmo_modbus_conn_rtu_get_resync(const struct osmo_modbus_conn_rtu* rtu);
+struct osmo_modbus_rtu_resync_stats {
+	unsigned long recovered; /* Frames found by scanning after a corrupted one */
+	unsigned long bytes_dropped; /* Bytes skipped while scanning */
+};
+void osmo_modbus_conn_rtu_get_resync_stats(const struct osmo_modbus_conn_rtu* rtu,
+					   struct osmo_modbus_rtu_resync_stats *stats);
+/* Run the T1.5/T3.5 framing timers on a CLOCK_MONOTONIC timerfd, with
+ * microsecond resolution, instead of the select loop timers. Set before connect. */
+int osmo_modbus_conn_rtu_set_timerfd(struct osmo_modbus_conn_rtu* rtu, bool enable);
+bool osmo_modbus_conn_rtu_get_timerfd(const struct osmo_modbus_conn_rtu* rtu);
+/* Timestamp received chars and check the inter-char silence when T1.5 expires,
+ * instead of rearming T1.5 for each read() */
+int osmo_modbus_conn_rtu_set_lazy_silence(struct osmo_modbus_conn_rtu* rtu, bool enable);
+bool osmo_modbus_conn_rtu_get_lazy_silence(const struct osmo_modbus_conn_rtu* rtu);
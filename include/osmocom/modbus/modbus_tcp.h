@@ -0,0 +1,51 @@
+/*! \file modbus_tcp.h
+ * Osmocom modbus */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/modbus/modbus_conn.h>
+
+#define OSMO_MODBUS_TCP_DEFAULT_PORT 502
+#define OSMO_MODBUS_TCP_DEFAULT_MAX_CLIENTS 8
+
+struct osmo_modbus_conn_tcp;
+
+struct osmo_modbus_conn_tcp* osmo_modbus_conn_tcp_alloc(struct osmo_modbus_conn* conn);
+
+/* Master: slave to connect to. Slave: local address to listen on.
+ * If the slave closes the connection, the master answers the requests in
+ * flight with a timeout and keeps the queued ones until the app connects
+ * again with osmo_modbus_conn_connect(). */
+int osmo_modbus_conn_tcp_set_addr(struct osmo_modbus_conn_tcp* tcp, const char *host, uint16_t port);
+const char *osmo_modbus_conn_tcp_get_host(const struct osmo_modbus_conn_tcp* tcp);
+uint16_t osmo_modbus_conn_tcp_get_port(const struct osmo_modbus_conn_tcp* tcp);
+int osmo_modbus_conn_tcp_set_max_inflight(struct osmo_modbus_conn_tcp* tcp, unsigned int max_inflight);
+unsigned int osmo_modbus_conn_tcp_get_max_inflight(const struct osmo_modbus_conn_tcp* tcp);
+/* Slave: masters connected at once, further connections are rejected. Their
+ * requests are answered one at a time, in arrival order, each to the master
+ * which sent it. A master disconnecting can connect again. */
+int osmo_modbus_conn_tcp_set_max_clients(struct osmo_modbus_conn_tcp* tcp, unsigned int max_clients);
+unsigned int osmo_modbus_conn_tcp_get_max_clients(const struct osmo_modbus_conn_tcp* tcp);
@@ -0,0 +1,94 @@
+/*! \file bits.c
+ * modbus coil and discrete input bit packing */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+
+#include <osmocom/core/bits.h>
+
+#include <osmocom/modbus/modbus_bits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* The 8 bits of a packed byte are handled at once inside a 64 bit word, one
+ * bit per byte of the word (SWAR). SSE2, part of the x86-64 baseline, packs
+ * 16 bytes per iteration. */
+
+#define BITS_BYTE_LSB	0x0101010101010101ULL
+#define BITS_BYTE_LOW7	0x7f7f7f7f7f7f7f7fULL
+
+/* Byte i of the result is bit i of b (0 or 1) */
+static inline uint64_t bits_spread8(uint8_t b)
+{
+	/* Byte i keeps only bit i of its copy of b: 0 or 1 << i */
+	uint64_t x = (b * BITS_BYTE_LSB) & 0x8040201008040201ULL;
+	/* Move any set bit to the byte MSB, then down to its LSB */
+	return ((x + BITS_BYTE_LOW7) >> 7) & BITS_BYTE_LSB;
+}
+
+/* Bit i of the result is set if byte i of x is non-zero */
+static inline uint8_t bits_gather8(uint64_t x)
+{
+	/* MSB of each byte set if the byte is non-zero, then down to its LSB */
+	x = (((x & BITS_BYTE_LOW7) + BITS_BYTE_LOW7) | x) >> 7;
+	x &= BITS_BYTE_LSB;
+	/* Multiply shifts byte i LSB to bit 56 + i, without carries */
+	return (x * 0x0102040810204080ULL) >> 56;
+}
+
+void osmo_modbus_bits_unpack(uint8_t *out, const uint8_t *in, unsigned int num_bits)
+{
+	unsigned int i;
+
+	for (i = 0; i + 8 <= num_bits; i += 8)
+		osmo_store64le(bits_spread8(in[i / 8]), &out[i]);
+	for (; i < num_bits; i++)
+		out[i] = (in[i / 8] >> (i % 8)) & 1;
+}
+
+void osmo_modbus_bits_pack(uint8_t *out, const uint8_t *in, unsigned int num_bits)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= num_bits; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&in[i]);
+		/* Bit j set if byte j is zero */
+		unsigned int zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		osmo_store16le(~zeros, &out[i / 8]);
+	}
+#endif
+	for (; i + 8 <= num_bits; i += 8)
+		out[i / 8] = bits_gather8(osmo_load64le(&in[i]));
+	if (i == num_bits)
+		return;
+	/* Last partial byte, padded with 0 */
+	out[i / 8] = 0;
+	for (; i < num_bits; i++) {
+		if (in[i])
+			out[i / 8] |= 1 << (i % 8);
+	}
+}
@@ -0,0 +1,153 @@
+/*! \file bus_group.c
+ * Group of conns sharing one timer wheel */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/linuxlist.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_bus_group.h>
+
+#include "modbus_internal.h"
+#include "rtu_internal.h"
+
+void conn_timer_setup(struct osmo_modbus_conn *conn, struct conn_timer *timer,
+		      void (*cb)(void *data), void *data)
+{
+	osmo_timer_setup(&timer->timer, cb, data);
+	if (conn->group)
+		modbus_twheel_timer_setup(&timer->wheel_timer, &conn->group->wheel, cb, data);
+	else
+		timer->wheel_timer.wheel = NULL;
+}
+
+void conn_timer_schedule(struct conn_timer *timer, unsigned long timeout_us)
+{
+	if (timer->wheel_timer.wheel)
+		modbus_twheel_timer_schedule(&timer->wheel_timer, timeout_us);
+	else
+		osmo_timer_schedule(&timer->timer, timeout_us / 1000000, timeout_us % 1000000);
+}
+
+void conn_timer_del(struct conn_timer *timer)
+{
+	osmo_timer_del(&timer->timer);
+	modbus_twheel_timer_del(&timer->wheel_timer);
+}
+
+bool conn_timer_pending(const struct conn_timer *timer)
+{
+	if (timer->wheel_timer.wheel)
+		return modbus_twheel_timer_pending(&timer->wheel_timer);
+	return osmo_timer_pending(&timer->timer);
+}
+
+struct osmo_modbus_bus_group *osmo_modbus_bus_group_alloc(void *ctx)
+{
+	struct osmo_modbus_bus_group *group = talloc_zero(ctx, struct osmo_modbus_bus_group);
+
+	INIT_LLIST_HEAD(&group->conns);
+	if (modbus_twheel_init(&group->wheel) < 0) {
+		LOGP(DLMODBUS, LOGL_ERROR, "Failed to set up the bus group timerfd\n");
+		talloc_free(group);
+		return NULL;
+	}
+	return group;
+}
+
+void osmo_modbus_bus_group_free(struct osmo_modbus_bus_group *group)
+{
+	struct osmo_modbus_conn *conn;
+
+	while ((conn = llist_first_entry_or_null(&group->conns, struct osmo_modbus_conn, group_entry)))
+		osmo_modbus_conn_free(conn);
+	modbus_twheel_cleanup(&group->wheel);
+	talloc_free(group);
+}
+
+int osmo_modbus_bus_group_add(struct osmo_modbus_bus_group *group, struct osmo_modbus_conn *conn)
+{
+	if (conn->group)
+		return -EALREADY;
+	/* Running timers can't be moved to the wheel */
+	if (conn->proto_ops.is_connected(conn))
+		return -EISCONN;
+
+	conn->group = group;
+	llist_add_tail(&conn->group_entry, &group->conns);
+	group->num_conns++;
+	talloc_steal(group, conn);
+	return 0;
+}
+
+/* conn is being freed */
+void bus_group_remove(struct osmo_modbus_conn *conn)
+{
+	llist_del(&conn->group_entry);
+	conn->group->num_conns--;
+	conn->group = NULL;
+}
+
+void osmo_modbus_bus_group_get_stats(const struct osmo_modbus_bus_group *group,
+				     struct osmo_modbus_bus_group_stats *stats)
+{
+	const struct modbus_twheel *wheel = &group->wheel;
+	struct osmo_modbus_conn_pool_stats pool;
+	struct osmo_modbus_conn_rtu *rtu;
+	struct osmo_modbus_conn *conn;
+
+	memset(stats, 0, sizeof(*stats));
+	llist_for_each_entry(conn, &group->conns, group_entry) {
+		stats->num_conns++;
+		if (conn->proto_ops.is_connected(conn))
+			stats->num_connected++;
+		if (conn->role == OSMO_MODBUS_ROLE_MASTER) {
+			stats->num_queued += conn->master.num_queued;
+			stats->num_inflight += conn->master.num_inflight;
+		}
+
+		osmo_modbus_conn_get_pool_stats(conn, &pool);
+		stats->pool.prim_hits += pool.prim_hits;
+		stats->pool.prim_misses += pool.prim_misses;
+		stats->pool.frame_hits += pool.frame_hits;
+		stats->pool.frame_misses += pool.frame_misses;
+
+		if (conn->proto_type != OSMO_MODBUS_PROTO_RTU)
+			continue;
+		rtu = (struct osmo_modbus_conn_rtu *)conn->proto;
+		stats->echo.matched += rtu->echo_stats.matched;
+		stats->echo.mismatched += rtu->echo_stats.mismatched;
+		stats->resync.recovered += rtu->resync_stats.recovered;
+		stats->resync.bytes_dropped += rtu->resync_stats.bytes_dropped;
+	}
+
+	stats->timers_pending = wheel->num_pending;
+	stats->timers_scheduled = wheel->scheduled;
+	stats->timers_expired = wheel->expired;
+	stats->timers_cascaded = wheel->cascaded;
+	stats->timer_wakeups = wheel->wakeups;
+}
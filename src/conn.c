@@ -32,8 +32,10 @@
 #include <osmocom/modbus/modbus.h>
 #include <osmocom/modbus/modbus_prim.h>
 #include <osmocom/modbus/modbus_rtu.h>
+#include <osmocom/modbus/modbus_tcp.h>
 
 #include "modbus_internal.h"
+#include "pdu_internal.h"
 #include "conn_fsm.h"
 
 #define LOGPCONN(conn, subsys, level, fmt, args ...) \
@@ -51,6 +53,10 @@ unsigned int osmo_modbus_set_logging_category_offset(int offset)
 struct osmo_tdef g_conn_tdefs[] = {
 	{ .T=OSMO_MODBUS_TO_TURNAROUND, .default_val=100, .unit = OSMO_TDEF_MS, .desc="Turnaround Delay Expiration Timeout" },
 	{ .T=OSMO_MODBUS_TO_NORESPONSE, .default_val=200, .unit = OSMO_TDEF_MS, .desc="Response Timeout" },
+	{ .T=OSMO_MODBUS_TO_NORESPONSE_MIN, .default_val=20, .unit = OSMO_TDEF_MS, .desc="Adaptive Response Timeout lower bound" },
+	{ .T=OSMO_MODBUS_TO_NORESPONSE_MAX, .default_val=200, .unit = OSMO_TDEF_MS, .desc="Adaptive Response Timeout upper bound" },
+	{ .T=OSMO_MODBUS_TO_QUARANTINE_PROBE, .default_val=1000, .unit = OSMO_TDEF_MS, .desc="Quarantined slave probe interval" },
+	{ .T=OSMO_MODBUS_TO_QUARANTINE_PROBE_MAX, .default_val=30000, .unit = OSMO_TDEF_MS, .desc="Quarantined slave probe interval upper bound" },
 	{}
 };
 
@@ -70,11 +76,17 @@ struct osmo_modbus_conn* osmo_modbus_conn_alloc(void *tall_ctx,
 	conn->role = role;
 	conn->proto_type = type;
 	INIT_LLIST_HEAD(&conn->msg_queue);
+	INIT_LLIST_HEAD(&conn->group_entry);
+	conn->prim_pool = modbus_msgb_pool_alloc(conn, "modbus_prim", sizeof(struct osmo_modbus_prim));
+	conn->frame_pool = modbus_msgb_pool_alloc(conn, "modbus_frame", MODBUS_MSGB_SIZE);
 
 	switch (type) {
 	case OSMO_MODBUS_PROTO_RTU:
 		conn->proto = (void *)osmo_modbus_conn_rtu_alloc(conn);
 		break;
+	case OSMO_MODBUS_PROTO_TCP:
+		conn->proto = (void *)osmo_modbus_conn_tcp_alloc(conn);
+		break;
 	default:
 		goto err;
 	}
@@ -88,6 +100,9 @@ struct osmo_modbus_conn* osmo_modbus_conn_alloc(void *tall_ctx,
 
 	if (conn->role == OSMO_MODBUS_ROLE_MASTER) {
 		conn->address = 0x00;
+		INIT_LLIST_HEAD(&conn->master.slave_queues);
+		INIT_LLIST_HEAD(&conn->master.inflight);
+		conn_master_init(conn);
 		conn_master_fsm.log_subsys = DLMODBUS; /* Update after app set the correct value */
 		conn->fi = osmo_fsm_inst_alloc(&conn_master_fsm, conn, conn, LOGL_INFO, NULL);
 	} else {
@@ -106,6 +121,10 @@ err:
 
 void osmo_modbus_conn_free(struct osmo_modbus_conn* conn)
 {
+	if (conn->role == OSMO_MODBUS_ROLE_MASTER)
+		conn_master_flush(conn);
+	conn_mt_free(conn);
+
 	if (conn->proto_ops.free)
 		conn->proto_ops.free(conn);
 	conn->proto = NULL;
@@ -118,6 +137,12 @@ void osmo_modbus_conn_free(struct osmo_modbus_conn* conn)
 		msgb_free(msg);
 	}
 
+	modbus_msgb_pool_free(conn->prim_pool);
+	modbus_msgb_pool_free(conn->frame_pool);
+
+	if (conn->group)
+		bus_group_remove(conn);
+
 	talloc_free(conn);
 }
 
@@ -177,12 +202,24 @@ void osmo_modbus_conn_set_prim_cb(struct osmo_modbus_conn* conn,
 
 int osmo_modbus_conn_submit_prim(struct osmo_modbus_conn* conn,
 				 struct osmo_modbus_prim *prim)
+{
+	return osmo_modbus_conn_submit_prim_prio(conn, prim, OSMO_MODBUS_PRIO_NORMAL);
+}
+
+/* prio is only relevant for the master role, a slave answers requests in order */
+int osmo_modbus_conn_submit_prim_prio(struct osmo_modbus_conn* conn,
+				      struct osmo_modbus_prim *prim,
+				      enum osmo_modbus_prio prio)
 {
 	int rc;
 
-	LOGPCONN(conn, DLMODBUS, LOGL_INFO, "Submitting prim operation '%s' on primitive '%s'\n",
+	LOGPCONN(conn, DLMODBUS, LOGL_INFO, "Submitting prim operation '%s' on primitive '%s' (prio %d)\n",
 		 get_value_string(osmo_prim_op_names, prim->oph.operation),
-		 get_value_string(osmo_modbus_prim_type_names, prim->oph.primitive));
+		 get_value_string(osmo_modbus_prim_type_names, prim->oph.primitive), prio);
+	if (prio < 0 || prio >= _NUM_OSMO_MODBUS_PRIO) {
+		msgb_free(prim->oph.msg);
+		return -EINVAL;
+	}
 	if ((conn->role == OSMO_MODBUS_ROLE_MASTER && prim->oph.operation != PRIM_OP_REQUEST) ||
 	    (conn->role == OSMO_MODBUS_ROLE_SLAVE && prim->oph.operation != PRIM_OP_RESPONSE)) {
 		LOGPCONN(conn, DLMODBUS, LOGL_INFO, "Primitive %s not possible in role %d\n",
@@ -191,11 +228,34 @@ int osmo_modbus_conn_submit_prim(struct osmo_modbus_conn* conn,
 		return -EINVAL;
 	}
 
-	msgb_enqueue(&conn->msg_queue, prim->oph.msg);
+	if (conn->role == OSMO_MODBUS_ROLE_MASTER && prim->address == OSMO_MODBUS_ADDR_BROADCAST &&
+	    !pdu_prim_broadcast_allowed(prim)) {
+		LOGPCONN(conn, DLMODBUS, LOGL_ERROR, "Primitive '%s' can't be broadcast\n",
+			 get_value_string(osmo_modbus_prim_type_names, prim->oph.primitive));
+		msgb_free(prim->oph.msg);
+		return -EINVAL;
+	}
+
+	if (conn->role == OSMO_MODBUS_ROLE_MASTER)
+		master_sched_enqueue(conn, prim->oph.msg, prio);
+	else
+		msgb_enqueue(&conn->msg_queue, prim->oph.msg);
 	rc = osmo_fsm_inst_dispatch(conn->fi, CONN_EV_SUBMIT_PRIM, NULL);
 	return rc;
 }
 
+/* Submit a master request whose reply is consumed by cb instead of the app */
+int conn_master_submit_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim,
+			  enum osmo_modbus_prio prio, master_req_cb_t cb, void *data)
+{
+	struct master_req_cb *rcb = MASTER_REQ_CB(prim->oph.msg);
+
+	OSMO_ASSERT(conn->role == OSMO_MODBUS_ROLE_MASTER);
+	rcb->cb = cb;
+	rcb->data = data;
+	return osmo_modbus_conn_submit_prim_prio(conn, prim, prio);
+}
+
 int osmo_modbus_conn_set_monitor_mode(struct osmo_modbus_conn* conn, bool enable)
 {
 	if (conn->role == OSMO_MODBUS_ROLE_MASTER)
@@ -214,6 +274,16 @@ struct osmo_modbus_conn_rtu *osmo_modbus_conn_get_rtu(struct osmo_modbus_conn *c
 	}
 }
 
+struct osmo_modbus_conn_tcp *osmo_modbus_conn_get_tcp(struct osmo_modbus_conn *conn)
+{
+	switch (conn->proto_type) {
+	case OSMO_MODBUS_PROTO_TCP:
+		return (struct osmo_modbus_conn_tcp *)conn->proto;
+	default:
+		OSMO_ASSERT(0);
+	}
+}
+
 void osmo_modbus_conn_rx_prim(struct osmo_modbus_conn* conn, struct osmo_modbus_prim *prim)
 {
 	int rc;
@@ -223,6 +293,23 @@ void osmo_modbus_conn_rx_prim(struct osmo_modbus_conn* conn, struct osmo_modbus_
 	 	 prim->address);
 	rc = osmo_fsm_inst_dispatch(conn->fi, CONN_EV_RECV_PRIM, prim);
 	if (rc) {
-		msgb_free(prim->oph.msg);
+		modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
 	}
 }
+
+/* Keep up to num msgbs of each kind (primitives, frames) for reuse */
+int osmo_modbus_conn_set_pool_size(struct osmo_modbus_conn *conn, unsigned int num)
+{
+	modbus_msgb_pool_set_size(conn->prim_pool, num);
+	modbus_msgb_pool_set_size(conn->frame_pool, num);
+	return 0;
+}
+
+void osmo_modbus_conn_get_pool_stats(const struct osmo_modbus_conn *conn,
+				     struct osmo_modbus_conn_pool_stats *stats)
+{
+	stats->prim_hits = conn->prim_pool->hits;
+	stats->prim_misses = conn->prim_pool->misses;
+	stats->frame_hits = conn->frame_pool->hits;
+	stats->frame_misses = conn->frame_pool->misses;
+}
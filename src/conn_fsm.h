@@ -19,8 +19,15 @@ enum conn_event {
 	CONN_EV_CONNECT,
 	CONN_EV_SUBMIT_PRIM,
 	CONN_EV_RECV_PRIM,
+	CONN_EV_RESP_TIMEOUT, /* data: struct master_trans */
+	CONN_EV_DISCONNECT, /* master: proto lost the connection */
+	CONN_EV_TURNAROUND_TIMEOUT, /* master: broadcast turnaround delay expired */
 	_NUM_CONN_EV,
 };
 
 extern struct osmo_fsm conn_master_fsm;
 extern struct osmo_fsm conn_slave_fsm;
+
+struct osmo_modbus_conn;
+void conn_master_init(struct osmo_modbus_conn *conn);
+void conn_master_flush(struct osmo_modbus_conn *conn);
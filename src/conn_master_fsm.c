@@ -23,12 +23,15 @@
  */
 #include <errno.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
 #include <osmocom/core/fsm.h>
 #include <osmocom/core/utils.h>
 #include <osmocom/core/timer.h>
+#include <osmocom/core/tdef.h>
 #include <osmocom/core/logging.h>
 #include <osmocom/core/select.h>
+#include <osmocom/core/talloc.h>
 
 #include <osmocom/modbus/modbus.h>
 
@@ -41,14 +44,17 @@ static const struct value_string conn_master_event_names[] = {
 	{ CONN_EV_CONNECT, 		"Connect" },
 	{ CONN_EV_SUBMIT_PRIM,		"SubmitPrim" },
 	{ CONN_EV_RECV_PRIM,		"RxPrim" },
+	{ CONN_EV_RESP_TIMEOUT,		"RespTimeout" },
+	{ CONN_EV_DISCONNECT,		"Disconnect" },
+	{ CONN_EV_TURNAROUND_TIMEOUT,	"TurnaroundTimeout" },
 	{ 0, NULL }
 };
 
 static const struct osmo_tdef_state_timeout conn_master_fsm_timeouts[32] = {
 	[CONN_MASTER_ST_DISCONNECTED] = {},
 	[CONN_MASTER_ST_IDLE] = {},
-	[CONN_MASTER_ST_WAIT_TURNAROUND_DELAY] = { .T = OSMO_MODBUS_TO_TURNAROUND },
-	[CONN_MASTER_ST_WAIT_REPLY] = { .T = OSMO_MODBUS_TO_NORESPONSE },
+	[CONN_MASTER_ST_WAIT_TURNAROUND_DELAY] = { /* OSMO_MODBUS_TO_TURNAROUND, on turnaround_timer */ },
+	[CONN_MASTER_ST_WAIT_REPLY] = { /* OSMO_MODBUS_TO_NORESPONSE, per transaction */ },
 };
 
 /* Transition to a state, using the T timer defined in assignment_fsm_timeouts.
@@ -60,6 +66,241 @@ static const struct osmo_tdef_state_timeout conn_master_fsm_timeouts[32] = {
 				     ((struct osmo_modbus_conn*)(fi->priv))->T_defs, \
 				     -1)
 
+static void master_trans_timer_cb(void *data)
+{
+	struct master_trans *trans = (struct master_trans *)data;
+	osmo_fsm_inst_dispatch(trans->conn->fi, CONN_EV_RESP_TIMEOUT, trans);
+}
+
+static void master_trans_free(struct master_trans *trans)
+{
+	struct osmo_modbus_conn *conn = trans->conn;
+
+	conn_timer_del(&trans->timer);
+	llist_del(&trans->list);
+	conn->master.num_inflight--;
+	modbus_msgb_pool_put(conn->prim_pool, trans->req_msg);
+	talloc_free(trans);
+}
+
+/* Look up the request a received reply belongs to */
+static struct master_trans *master_trans_find(struct osmo_modbus_conn *conn,
+					      const struct osmo_modbus_prim *prim)
+{
+	struct master_trans *trans;
+
+	llist_for_each_entry(trans, &conn->master.inflight, list) {
+		if (trans->address != prim->address)
+			continue;
+		/* Without Transaction Id (RTU) there's only one request in flight */
+		if (conn->proto_ops.has_trans_id && trans->trans_id != prim->trans_id)
+			continue;
+		return trans;
+	}
+	return NULL;
+}
+
+void conn_master_flush(struct osmo_modbus_conn *conn)
+{
+	struct master_trans *trans, *trans2;
+	struct msgb *msg;
+
+	llist_for_each_entry_safe(trans, trans2, &conn->master.inflight, list)
+		master_trans_free(trans);
+	master_sched_flush(conn);
+	conn_timer_del(&conn->master.fail_timer);
+	conn_timer_del(&conn->master.turnaround_timer);
+	while ((msg = msgb_dequeue(&conn->master.failed)))
+		modbus_msgb_pool_put(conn->prim_pool, msg);
+}
+
+static void master_req_cb_drop(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *req,
+			       struct osmo_modbus_prim *resp, void *data)
+{
+	modbus_msgb_pool_put(conn->prim_pool, resp->oph.msg);
+}
+
+/* The consumer of the requests is going away: drop them if not sent yet,
+ * otherwise discard their reply once it arrives */
+void conn_master_cancel_cb(struct osmo_modbus_conn *conn, void *data)
+{
+	struct master_trans *trans;
+	struct master_req_cb *rcb;
+	struct msgb *msg, *msg2;
+
+	llist_for_each_entry(trans, &conn->master.inflight, list) {
+		rcb = MASTER_REQ_CB(trans->req_msg);
+		if (rcb->cb && rcb->data == data) {
+			rcb->cb = master_req_cb_drop;
+			rcb->data = NULL;
+		}
+	}
+	llist_for_each_entry_safe(msg, msg2, &conn->master.failed, list) {
+		if (!MASTER_REQ_CB(msg)->cb || MASTER_REQ_CB(msg)->data != data)
+			continue;
+		llist_del(&msg->list);
+		modbus_msgb_pool_put(conn->prim_pool, msg);
+	}
+	master_sched_drop(conn, data);
+}
+
+/* Pass the reply to the request in req_msg to its consumer */
+static void conn_master_deliver(struct osmo_modbus_conn *conn, struct msgb *req_msg, struct osmo_modbus_prim *prim)
+{
+	struct master_req_cb *rcb = MASTER_REQ_CB(req_msg);
+
+	if (rcb->cb)
+		rcb->cb(conn, (const struct osmo_modbus_prim *)msgb_data(req_msg), prim, rcb->data);
+	else if (conn->prim_cb)
+		conn->prim_cb(conn, prim, conn->prim_cb_ctx);
+	else
+		msgb_free(prim->oph.msg);
+}
+
+/* Finish trans and pass prim to the consumer of its request */
+static void conn_master_trans_complete(struct master_trans *trans, struct osmo_modbus_prim *prim)
+{
+	struct osmo_modbus_conn *conn = trans->conn;
+	struct msgb *req_msg = trans->req_msg;
+
+	/* Free the slot before the consumer gets the reply, so that it
+	 * can submit a new request from the callback */
+	trans->req_msg = NULL;
+	master_trans_free(trans);
+	conn_master_deliver(conn, req_msg, prim);
+	modbus_msgb_pool_put(conn->prim_pool, req_msg);
+}
+
+/* Deliver a timeout for the requests which failed fast. Consumers may submit
+ * (and fail) new requests from the callback: those wait for the next round. */
+static void conn_master_fail_timer_cb(void *data)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn *)data;
+	unsigned int num = llist_count(&conn->master.failed);
+	struct osmo_modbus_prim *req, *prim;
+	struct msgb *msg;
+
+	while (num-- > 0 && (msg = msgb_dequeue(&conn->master.failed))) {
+		req = (struct osmo_modbus_prim *)msgb_data(msg);
+		prim = modbus_makeprim_timeout_resp(conn->prim_pool, req->address);
+		conn_master_deliver(conn, msg, prim);
+		modbus_msgb_pool_put(conn->prim_pool, msg);
+	}
+}
+
+/* Fail the request in msg without sending it, along with all others queued
+ * for the same slave */
+static void conn_master_fail_slave(struct osmo_modbus_conn *conn, struct msgb *msg, uint16_t address)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+	unsigned int num = llist_count(&conn->master.failed);
+
+	if (msg)
+		msgb_enqueue(&conn->master.failed, msg);
+	master_sched_take_slave(conn, address, &conn->master.failed);
+	num = llist_count(&conn->master.failed) - num;
+	if (num == 0)
+		return;
+	if (sq)
+		sq->health.failed_fast += num;
+	LOGP(DLMODBUS, LOGL_DEBUG, "(addr=%" PRIu16 ") Slave quarantined, failing %u requests\n", address, num);
+	if (!conn_timer_pending(&conn->master.fail_timer))
+		conn_timer_schedule(&conn->master.fail_timer, 0);
+}
+
+static void conn_master_turnaround_timer_cb(void *data)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn *)data;
+	osmo_fsm_inst_dispatch(conn->fi, CONN_EV_TURNAROUND_TIMEOUT, NULL);
+}
+
+/* fail_timer and turnaround_timer are set up on connect, once the bus group
+ * (if any) is known */
+void conn_master_init(struct osmo_modbus_conn *conn)
+{
+	INIT_LLIST_HEAD(&conn->master.failed);
+}
+
+/* Send queued requests as long as the proto allows more of them in flight */
+static void conn_master_tx_pending(struct osmo_fsm_inst *fi)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+	unsigned int max_inflight = conn->proto_ops.max_inflight(conn);
+	unsigned long timeout_us;
+	struct master_trans *trans;
+	struct osmo_modbus_prim *prim;
+	struct msgb *msg;
+
+	while (conn->master.num_inflight < max_inflight && (msg = master_sched_peek(conn))) {
+		prim = (struct osmo_modbus_prim *)msgb_data(msg);
+		/* Broadcasts are sent from IDLE once nothing is in flight anymore */
+		if (prim->address == OSMO_MODBUS_ADDR_BROADCAST)
+			break;
+		master_sched_dequeue(conn);
+		if (!master_health_tx_allowed(conn, prim->address)) {
+			conn_master_fail_slave(conn, msg, prim->address);
+			continue;
+		}
+		prim->trans_id = conn->master.next_trans_id++;
+
+		trans = talloc_zero(conn, struct master_trans);
+		trans->conn = conn;
+		trans->trans_id = prim->trans_id;
+		trans->address = prim->address;
+		trans->req_msg = msg;
+		conn_timer_setup(conn, &trans->timer, master_trans_timer_cb, trans);
+		llist_add_tail(&trans->list, &conn->master.inflight);
+		conn->master.num_inflight++;
+
+		timeout_us = master_rtt_timeout_us(conn, trans->address);
+		conn_timer_schedule(&trans->timer, timeout_us);
+		osmo_clock_gettime(CLOCK_MONOTONIC, &trans->sent);
+
+		LOGPFSML(fi, LOGL_DEBUG, "Tx request addr=%" PRIu16 " trans_id=%" PRIu16 " (%u/%u in flight, timeout %luus)\n",
+			 trans->address, trans->trans_id, conn->master.num_inflight, max_inflight, timeout_us);
+		conn->proto_ops.tx_prim(conn, prim);
+	}
+
+	/* Everything queued may have failed fast */
+	if (conn->master.num_inflight == 0 && fi->state == CONN_MASTER_ST_WAIT_REPLY)
+		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
+}
+
+/* A transaction finished (reply or timeout), go on with the next ones */
+static void conn_master_trans_done(struct osmo_fsm_inst *fi)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+
+	if (conn->master.num_inflight == 0)
+		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
+	else
+		conn_master_tx_pending(fi);
+}
+
+/* The proto lost the connection: fail the requests in flight and those which
+ * failed fast, keep the queued ones for when the app connects again. Consumers
+ * may submit new requests (or connect) from their callback. */
+static void conn_master_disconnected(struct osmo_fsm_inst *fi)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+	struct master_trans *trans, *trans2;
+	struct osmo_modbus_prim *prim;
+	LLIST_HEAD(inflight);
+
+	LOGPFSML(fi, LOGL_NOTICE, "Connection lost, failing %u requests in flight\n", conn->master.num_inflight);
+	conn_master_fsm_state_chg(fi, CONN_MASTER_ST_DISCONNECTED);
+	conn_timer_del(&conn->master.turnaround_timer);
+	llist_splice_init(&conn->master.inflight, &inflight);
+	/* fail_timer is set up again on connect */
+	conn_timer_del(&conn->master.fail_timer);
+	conn_master_fail_timer_cb(conn);
+	llist_for_each_entry_safe(trans, trans2, &inflight, list) {
+		prim = modbus_makeprim_timeout_resp(conn->prim_pool, trans->address);
+		prim->trans_id = trans->trans_id;
+		conn_master_trans_complete(trans, prim);
+	}
+}
+
 static void conn_master_fsm_st_disconnected_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
 }
@@ -75,6 +316,8 @@ static void conn_master_fsm_st_disconnected(struct osmo_fsm_inst *fi, uint32_t e
 		connected = (bool*)data;
 		if ((rc = conn->proto_ops.connect(conn)) == 0) {
 			*connected = true;
+			conn_timer_setup(conn, &conn->master.fail_timer, conn_master_fail_timer_cb, conn);
+			conn_timer_setup(conn, &conn->master.turnaround_timer, conn_master_turnaround_timer_cb, conn);
 			conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
 		} else {
 			*connected = false;
@@ -83,27 +326,59 @@ static void conn_master_fsm_st_disconnected(struct osmo_fsm_inst *fi, uint32_t e
 	case CONN_EV_SUBMIT_PRIM:
 		/* Do nothing, conn enqueued the message */
 		break;
+	case CONN_EV_DISCONNECT:
+		break;
 	default:
 		OSMO_ASSERT(0);
 	}
 }
 
-static void conn_master_fsm_st_idle_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
+/* Send the next queued request: broadcasts wait for the turnaround delay,
+ * unicast requests for their reply */
+static void conn_master_tx_next(struct osmo_fsm_inst *fi)
 {
 	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
-	/* TODO: once we support broadcast messages, check msg and do that transition */
-	if (!llist_empty(&conn->msg_queue))
+	struct msgb *msg = master_sched_peek(conn);
+	struct osmo_modbus_prim *prim;
+
+	if (!msg)
+		return;
+	prim = (struct osmo_modbus_prim *)msgb_data(msg);
+	if (prim->address == OSMO_MODBUS_ADDR_BROADCAST)
+		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_WAIT_TURNAROUND_DELAY);
+	else
 		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_WAIT_REPLY);
+}
+
+static void conn_master_fsm_st_idle_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
+{
+	conn_master_tx_next(fi);
+}
 
+/* A reply matching no request in flight still tells the slave is alive, and
+ * may be a late one to learn its RTT from */
+static void conn_master_rx_unmatched(struct osmo_fsm_inst *fi, struct osmo_modbus_prim *prim)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+
+	LOGPFSML(fi, LOGL_NOTICE, "Dropping reply addr=%" PRIu16 " trans_id=%" PRIu16
+		 " not matching any request in flight\n", prim->address, prim->trans_id);
+	master_rtt_late_reply(conn, prim);
+	master_health_reply(conn, prim->address);
+	modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
 }
 
 static void conn_master_fsm_st_idle(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
-	//struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
 	switch (event) {
 	case CONN_EV_SUBMIT_PRIM:
-		/* TODO: once we support broadcast messages, check msg and do that transition */
-		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_WAIT_REPLY);
+		conn_master_tx_next(fi);
+		break;
+	case CONN_EV_RECV_PRIM:
+		conn_master_rx_unmatched(fi, (struct osmo_modbus_prim *)data);
+		break;
+	case CONN_EV_DISCONNECT:
+		conn_master_disconnected(fi);
 		break;
 	default:
 		OSMO_ASSERT(0);
@@ -112,50 +387,107 @@ static void conn_master_fsm_st_idle(struct osmo_fsm_inst *fi, uint32_t event, vo
 
 static void conn_master_fsm_st_wait_turnaround_delay_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
-	/* TODO: implement */
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+	struct osmo_modbus_prim *prim;
+	struct msgb *msg;
+
+	/* Slaves process the request meanwhile, no reply is expected */
+	msg = master_sched_dequeue(conn);
+	OSMO_ASSERT(msg);
+	prim = (struct osmo_modbus_prim *)msgb_data(msg);
+	LOGPFSML(fi, LOGL_DEBUG, "Tx broadcast request\n");
+	conn->proto_ops.tx_prim(conn, prim);
+	modbus_msgb_pool_put(conn->prim_pool, msg);
+	conn_timer_schedule(&conn->master.turnaround_timer,
+			    osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_TURNAROUND, OSMO_TDEF_MS, -1) * 1000);
 }
 
 static void conn_master_fsm_st_wait_turnaround_delay(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
-	/* TODO: implement */
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+	struct osmo_modbus_prim *prim;
+
+	switch (event) {
+	case CONN_EV_SUBMIT_PRIM:
+		/* conn enqueued the message, sent once the delay expires */
+		break;
+	case CONN_EV_RECV_PRIM:
+		prim = (struct osmo_modbus_prim *)data;
+		LOGPFSML(fi, LOGL_NOTICE, "Dropping unexpected reply addr=%" PRIu16 " to broadcast request\n",
+			 prim->address);
+		modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
+		break;
+	case CONN_EV_TURNAROUND_TIMEOUT:
+		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
+		break;
+	case CONN_EV_DISCONNECT:
+		conn_master_disconnected(fi);
+		break;
+	default:
+		OSMO_ASSERT(0);
+	}
 }
 
 static void conn_master_fsm_st_wait_reply_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
 	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
-	struct msgb *msg;
-	struct osmo_modbus_prim *prim;
 
-	if (llist_empty(&conn->msg_queue)) {
+	if (conn->master.num_queued == 0) {
 		LOGPFSML(fi, LOGL_INFO, "Write queue is empty!\n");
 		OSMO_ASSERT(0);
 	}
 
-	msg = msgb_dequeue(&conn->msg_queue);
-	prim = (struct osmo_modbus_prim *)msgb_data(msg);
-	conn->master.req_for_addr = prim->address;
-	conn->proto_ops.tx_prim(conn, prim);
-	msgb_free(msg);
+	conn_master_tx_pending(fi);
 }
 
 static void conn_master_fsm_st_wait_reply(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
 	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
 	struct osmo_modbus_prim *prim;
+	struct master_trans *trans;
+	struct msgb *msg;
+	uint16_t address;
 
 	switch (event) {
 		case CONN_EV_SUBMIT_PRIM:
-			/* Do nothing, conn enqueued the message */
+			/* conn enqueued the message, send the next one if there's room */
+			conn_master_tx_pending(fi);
 			break;
 		case CONN_EV_RECV_PRIM:
 			prim = (struct osmo_modbus_prim *)data;
-			/* TODO: check if addr is for us... */
-			/* TODO: check if msg received is a reply for our last request... */
-			if (conn->prim_cb)
-				conn->prim_cb(conn, prim, conn->prim_cb_ctx);
-			else
-				msgb_free(prim->oph.msg);
-			conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
+			trans = master_trans_find(conn, prim);
+			if (!trans) {
+				conn_master_rx_unmatched(fi, prim);
+				break;
+			}
+			master_rtt_reply(conn, trans);
+			master_health_reply(conn, trans->address);
+			conn_master_trans_complete(trans, prim);
+			conn_master_trans_done(fi);
+			break;
+		case CONN_EV_RESP_TIMEOUT:
+			trans = (struct master_trans *)data;
+			address = trans->address;
+			master_rtt_timeout(conn, trans);
+			if (master_health_timeout(conn, trans)) {
+				LOGPFSML(fi, LOGL_INFO, "Resending request addr=%" PRIu16 " trans_id=%" PRIu16 " (retry %u)\n",
+					 address, trans->trans_id, MASTER_REQ_CB(trans->req_msg)->retries);
+				msg = trans->req_msg;
+				trans->req_msg = NULL;
+				master_trans_free(trans);
+				master_sched_requeue(conn, msg);
+				conn_master_trans_done(fi);
+				break;
+			}
+			prim = modbus_makeprim_timeout_resp(conn->prim_pool, address);
+			prim->trans_id = trans->trans_id;
+			conn_master_trans_complete(trans, prim);
+			if (master_health_quarantined(conn, address))
+				conn_master_fail_slave(conn, NULL, address);
+			conn_master_trans_done(fi);
+			break;
+		case CONN_EV_DISCONNECT:
+			conn_master_disconnected(fi);
 			break;
 		default:
 			OSMO_ASSERT(0);
@@ -165,63 +497,52 @@ static void conn_master_fsm_st_wait_reply(struct osmo_fsm_inst *fi, uint32_t eve
 static const struct osmo_fsm_state conn_master_states[] = {
 	[CONN_MASTER_ST_DISCONNECTED]= {
 		.in_event_mask = X(CONN_EV_CONNECT) |
-				 X(CONN_EV_SUBMIT_PRIM),
+				 X(CONN_EV_SUBMIT_PRIM) |
+				 X(CONN_EV_DISCONNECT),
 		.out_state_mask = X(CONN_MASTER_ST_IDLE),
 		.name = "DISCONNECTED",
 		.action = conn_master_fsm_st_disconnected,
 		.onenter = conn_master_fsm_st_disconnected_onenter,
 	},
 	[CONN_MASTER_ST_IDLE] = {
-		.in_event_mask = X(CONN_EV_SUBMIT_PRIM),
+		.in_event_mask = X(CONN_EV_SUBMIT_PRIM) |
+				 X(CONN_EV_RECV_PRIM) |
+				 X(CONN_EV_DISCONNECT),
 		.out_state_mask = X(CONN_MASTER_ST_WAIT_TURNAROUND_DELAY) |
-				  X(CONN_MASTER_ST_WAIT_REPLY),
+				  X(CONN_MASTER_ST_WAIT_REPLY) |
+				  X(CONN_MASTER_ST_DISCONNECTED),
 		.name = "IDLE",
 		.action = conn_master_fsm_st_idle,
 		.onenter = conn_master_fsm_st_idle_onenter,
 	},
 	[CONN_MASTER_ST_WAIT_TURNAROUND_DELAY] = {
-		.in_event_mask = X(CONN_EV_SUBMIT_PRIM),
-		.out_state_mask = X(CONN_MASTER_ST_IDLE),
+		.in_event_mask = X(CONN_EV_SUBMIT_PRIM) |
+				 X(CONN_EV_RECV_PRIM) |
+				 X(CONN_EV_TURNAROUND_TIMEOUT) |
+				 X(CONN_EV_DISCONNECT),
+		.out_state_mask = X(CONN_MASTER_ST_IDLE) |
+				  X(CONN_MASTER_ST_DISCONNECTED),
 		.name = "WAIT_TURNAROUND_DELAY",
 		.action = conn_master_fsm_st_wait_turnaround_delay,
 		.onenter = conn_master_fsm_st_wait_turnaround_delay_onenter,
 	},
 	[CONN_MASTER_ST_WAIT_REPLY] = {
 		.in_event_mask = X(CONN_EV_SUBMIT_PRIM) |
-				 X(CONN_EV_RECV_PRIM),
-		.out_state_mask = X(CONN_MASTER_ST_IDLE),
+				 X(CONN_EV_RECV_PRIM) |
+				 X(CONN_EV_RESP_TIMEOUT) |
+				 X(CONN_EV_DISCONNECT),
+		.out_state_mask = X(CONN_MASTER_ST_IDLE) |
+				  X(CONN_MASTER_ST_DISCONNECTED),
 		.name = "WAIT_REPLY",
 		.action = conn_master_fsm_st_wait_reply,
 		.onenter = conn_master_fsm_st_wait_reply_onenter,
 	},
 };
 
-static int conn_master_fsm_timer_cb(struct osmo_fsm_inst *fi)
-{
-	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
-	struct osmo_modbus_prim *prim;
-
-	switch (fi->T) {
-	case OSMO_MODBUS_TO_TURNAROUND:
-		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
-		break;
-	case OSMO_MODBUS_TO_NORESPONSE:
-		prim = osmo_modbus_makeprim_timeout_resp(conn->master.req_for_addr);
-		if (conn->prim_cb)
-			conn->prim_cb(conn, prim, conn->prim_cb_ctx);
-		else
-			msgb_free(prim->oph.msg);
-		conn_master_fsm_state_chg(fi, CONN_MASTER_ST_IDLE);
-		break;
-	}
-	return 0;
-}
-
 struct osmo_fsm conn_master_fsm = {
 	.name = "conn_master",
 	.states = conn_master_states,
 	.num_states = ARRAY_SIZE(conn_master_states),
-	.timer_cb = conn_master_fsm_timer_cb,
 	.log_subsys = DLMODBUS_OFFSET,
 	.event_names = conn_master_event_names,
 	//.cleanup = conn_master_fsm_cleanup,
@@ -0,0 +1,299 @@
+/*! \file conn_mt.c
+ * Submission of prims to a conn from other threads */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/msgb.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_mt.h>
+
+#include "modbus_internal.h"
+#include "mpsc_queue.h"
+
+/* Items travel from the submitting thread to the conn thread through
+ * conn_mt->submit_q, then back to the consumer thread through cq->queue. They
+ * are malloc()ed, as talloc isn't thread-safe. */
+struct mt_node {
+	struct mpsc_node node;
+	struct llist_head list; /* item in conn_mt->pending while the request is in the conn */
+	enum osmo_modbus_prio prio;
+	struct osmo_modbus_mt_cq *cq;
+	void *user_data;
+	int rc;
+	size_t prim_len;
+	struct osmo_modbus_prim prim; /* request, then response */
+};
+
+struct conn_mt {
+	struct osmo_modbus_conn *conn; /* backpointer */
+	struct osmo_fd ofd; /* eventfd, written by submitting threads */
+	atomic_bool wake_pending; /* ofd already written since last drain */
+	struct mpsc_queue submit_q; /* struct mt_node */
+	struct llist_head pending; /* struct mt_node */
+};
+
+struct osmo_modbus_mt_cq {
+	int fd; /* eventfd, written by the conn thread */
+	atomic_bool wake_pending;
+	struct mpsc_queue queue; /* struct mt_node */
+};
+
+/* Only the first producer since the consumer last drained pays the syscall */
+static void mt_wake(atomic_bool *wake_pending, int fd)
+{
+	if (!atomic_exchange(wake_pending, true))
+		eventfd_write(fd, 1);
+}
+
+static void mt_complete(struct mt_node *n)
+{
+	struct osmo_modbus_mt_cq *cq = n->cq;
+
+	mpsc_push(&cq->queue, &n->node);
+	mt_wake(&cq->wake_pending, cq->fd);
+}
+
+static void mt_req_cb(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *req,
+		      struct osmo_modbus_prim *resp, void *data)
+{
+	struct mt_node *n = (struct mt_node *)data;
+	size_t len = OSMO_MIN(osmo_modbus_prim_len(resp), sizeof(n->prim));
+
+	llist_del(&n->list);
+	memcpy(&n->prim, resp, len);
+	memset((uint8_t *)&n->prim + len, 0, sizeof(n->prim) - len);
+	n->prim.oph.msg = NULL;
+	n->prim_len = len;
+	n->rc = 0;
+	modbus_msgb_pool_put(conn->prim_pool, resp->oph.msg);
+	mt_complete(n);
+}
+
+static void mt_submit(struct conn_mt *mt, struct mt_node *n)
+{
+	struct osmo_modbus_conn *conn = mt->conn;
+	struct msgb *msg = modbus_msgb_pool_get(conn->prim_pool);
+	struct osmo_modbus_prim *prim;
+	int rc;
+
+	prim = (struct osmo_modbus_prim *) msgb_put(msg, n->prim_len);
+	memcpy(prim, &n->prim, n->prim_len);
+	prim->oph.msg = msg;
+
+	/* Nothing comes back for slave responses and broadcasts */
+	if (!n->cq || conn->role != OSMO_MODBUS_ROLE_MASTER ||
+	    prim->address == OSMO_MODBUS_ADDR_BROADCAST) {
+		rc = osmo_modbus_conn_submit_prim_prio(conn, prim, n->prio);
+		if (rc != 0 && n->cq) {
+			n->rc = rc;
+			mt_complete(n);
+		} else {
+			free(n);
+		}
+		return;
+	}
+
+	llist_add_tail(&n->list, &mt->pending);
+	rc = conn_master_submit_cb(conn, prim, n->prio, mt_req_cb, n);
+	if (rc != 0) {
+		conn_master_cancel_cb(conn, n);
+		llist_del(&n->list);
+		n->rc = rc;
+		mt_complete(n);
+	}
+}
+
+static int mt_ofd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct conn_mt *mt = (struct conn_mt *)ofd->data;
+	struct mpsc_node *node;
+	eventfd_t val;
+
+	eventfd_read(ofd->fd, &val);
+	/* Cleared before draining: a producer pushing from now on wakes us again */
+	atomic_store(&mt->wake_pending, false);
+	while ((node = mpsc_pop(&mt->submit_q)))
+		mt_submit(mt, container_of(node, struct mt_node, node));
+	return 0;
+}
+
+int osmo_modbus_conn_mt_enable(struct osmo_modbus_conn *conn)
+{
+	struct conn_mt *mt;
+	int fd;
+
+	if (conn->mt)
+		return 0;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	mt = talloc_zero(conn, struct conn_mt);
+	if (!mt) {
+		close(fd);
+		return -ENOMEM;
+	}
+	mt->conn = conn;
+	atomic_init(&mt->wake_pending, false);
+	mpsc_init(&mt->submit_q);
+	INIT_LLIST_HEAD(&mt->pending);
+	osmo_fd_setup(&mt->ofd, fd, OSMO_FD_READ, mt_ofd_cb, mt, 0);
+	if (osmo_fd_register(&mt->ofd) != 0) {
+		close(fd);
+		talloc_free(mt);
+		return -EIO;
+	}
+	conn->mt = mt;
+	return 0;
+}
+
+/* Complete a request the conn will never answer */
+static void mt_cancel(struct mt_node *n)
+{
+	if (!n->cq) {
+		free(n);
+		return;
+	}
+	n->rc = -ECANCELED;
+	mt_complete(n);
+}
+
+/* Called once the master requests were flushed: pending ones will never
+ * complete, neither will those not submitted yet */
+void conn_mt_free(struct osmo_modbus_conn *conn)
+{
+	struct conn_mt *mt = conn->mt;
+	struct mpsc_node *node;
+	struct mt_node *n, *n2;
+
+	if (!mt)
+		return;
+
+	osmo_fd_unregister(&mt->ofd);
+	close(mt->ofd.fd);
+	while ((node = mpsc_pop(&mt->submit_q)))
+		mt_cancel(container_of(node, struct mt_node, node));
+	llist_for_each_entry_safe(n, n2, &mt->pending, list) {
+		llist_del(&n->list);
+		mt_cancel(n);
+	}
+	talloc_free(mt);
+	conn->mt = NULL;
+}
+
+int osmo_modbus_conn_submit_prim_mt(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *prim,
+				    enum osmo_modbus_prio prio, struct osmo_modbus_mt_cq *cq, void *user_data)
+{
+	struct conn_mt *mt = conn->mt;
+	size_t len = prim->oph.msg ? osmo_modbus_prim_len(prim) : sizeof(*prim);
+	struct mt_node *n;
+
+	if (!mt)
+		return -ENOTSUP;
+	if (len > sizeof(*prim))
+		return -EINVAL;
+
+	n = malloc(sizeof(*n));
+	if (!n)
+		return -ENOMEM;
+	memcpy(&n->prim, prim, len);
+	n->prim.oph.msg = NULL;
+	n->prim_len = len;
+	n->prio = prio;
+	n->cq = cq;
+	n->user_data = user_data;
+	n->rc = 0;
+	INIT_LLIST_HEAD(&n->list);
+
+	mpsc_push(&mt->submit_q, &n->node);
+	mt_wake(&mt->wake_pending, mt->ofd.fd);
+	return 0;
+}
+
+struct osmo_modbus_mt_cq *osmo_modbus_mt_cq_alloc(void *ctx)
+{
+	struct osmo_modbus_mt_cq *cq = talloc_zero(ctx, struct osmo_modbus_mt_cq);
+
+	if (!cq)
+		return NULL;
+	cq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cq->fd < 0) {
+		talloc_free(cq);
+		return NULL;
+	}
+	atomic_init(&cq->wake_pending, false);
+	mpsc_init(&cq->queue);
+	return cq;
+}
+
+void osmo_modbus_mt_cq_free(struct osmo_modbus_mt_cq *cq)
+{
+	struct mpsc_node *node;
+
+	while ((node = mpsc_pop(&cq->queue)))
+		free(container_of(node, struct mt_node, node));
+	close(cq->fd);
+	talloc_free(cq);
+}
+
+int osmo_modbus_mt_cq_fd(const struct osmo_modbus_mt_cq *cq)
+{
+	return cq->fd;
+}
+
+int osmo_modbus_mt_cq_pop(struct osmo_modbus_mt_cq *cq, struct osmo_modbus_prim *resp, void **user_data)
+{
+	struct mpsc_node *node = mpsc_pop(&cq->queue);
+	struct mt_node *n;
+	eventfd_t val;
+	int rc;
+
+	if (!node) {
+		/* Drained: rearm the wakeup, then catch completions pushed meanwhile */
+		eventfd_read(cq->fd, &val);
+		atomic_store(&cq->wake_pending, false);
+		node = mpsc_pop(&cq->queue);
+		if (!node)
+			return -EAGAIN;
+	}
+
+	n = container_of(node, struct mt_node, node);
+	rc = n->rc;
+	if (rc == 0)
+		memcpy(resp, &n->prim, sizeof(*resp));
+	if (user_data)
+		*user_data = n->user_data;
+	free(n);
+	return rc;
+}
@@ -28,6 +28,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include <osmocom/core/serial.h>
 #include <osmocom/core/talloc.h>
@@ -37,19 +39,24 @@
 
 #include <osmocom/modbus/modbus.h>
 #include <osmocom/modbus/modbus_rtu.h>
+#include <osmocom/modbus/modbus_crc16.h>
 
 #include "modbus_internal.h"
 #include "rtu_internal.h"
+#include "pdu_internal.h"
 #include "rtu_transmit_fsm.h"
+#include "rtu_serial.h"
 
 #define RTU_DEFAULT_BAUDRATE 9600
+/* Room for several back-to-back frames, as read() may return more than one */
+#define RTU_RX_BUF_SIZE (4 * MODBUS_MSGB_SIZE)
 
 #define LOGPRTU(rtu, subsys, level, fmt, args ...) \
 	LOGP(subsys, level, "(addr=%" PRIu16 ",dev=%s) " fmt, (rtu)->conn->address, (rtu)->dev_path, ## args)
 
-static struct msgb *modbus_rtu_msgb_alloc(void)
+static struct msgb *modbus_rtu_msgb_alloc(struct osmo_modbus_conn_rtu* rtu)
 {
-	return msgb_alloc(MODBUS_MSGB_SIZE, "");
+	return modbus_msgb_pool_get(rtu->conn->frame_pool);
 }
 
 struct osmo_tdef g_rtu_tdefs[] = {
@@ -58,180 +65,247 @@ struct osmo_tdef g_rtu_tdefs[] = {
 	{}
 };
 
+/* Address (1Byte) + Function Code (1Byte) */
+#define RTU_HDR_LEN 2
+#define RTU_CRC_LEN 2
 
-/* High-Order Byte Table */
-static const uint8_t table_crc_hi[] = {
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-	0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-	0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-	0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-	0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-	0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
-	0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
-	0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
-	0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
-	0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
-};
+struct msgb* prim2rtu(struct osmo_modbus_conn_rtu* rtu, struct osmo_modbus_prim *prim)
+{
+	struct msgb *msg = modbus_rtu_msgb_alloc(rtu);
+	int rc;
 
-/* Low-Order Byte Table  */
-static const uint8_t table_crc_lo[] = {
-	0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
-	0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
-	0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
-	0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
-	0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
-	0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
-	0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
-	0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
-	0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
-	0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
-	0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
-	0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
-	0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
-	0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
-	0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
-	0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
-	0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
-	0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
-	0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
-	0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
-	0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
-	0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
-	0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
-	0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
-	0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
-	0x43, 0x83, 0x41, 0x81, 0x80, 0x40
-};
+	msgb_put_u8(msg, (uint8_t)prim->address);
+	rc = pdu_encode(prim, msg);
+	OSMO_ASSERT(rc == 0);
+	msgb_put_u16(msg, osmo_modbus_crc16(msgb_data(msg), msgb_length(msg)));
+	return msg;
+}
 
-/* CRC Generation Function */
-uint16_t crc16(uint8_t *data, uint16_t data_len)
+/* data holds one full frame whose CRC was already validated while receiving it
+ * (see rtu_read()), so it is decoded in one pass from its length alone.
+ * Returns size used if succeeded, returns -ENODATA if data missing to parse message */
+int rtu2prim(struct osmo_modbus_conn_rtu* rtu, const uint8_t *data, size_t len, struct osmo_modbus_prim **prim)
 {
-	uint8_t crc_hi = 0xFF; /* Initialized high CRC byte */
-	uint8_t crc_lo = 0xFF; /* Initialized low CRC byte */
-	unsigned int idx; /* will index into CRC lookup */
+	int rc;
 
-	/* pass through message buffer */
-	while (data_len--) {
-		idx = crc_hi ^ *data++; /* calculate the CRC  */
-		crc_hi = crc_lo ^ table_crc_hi[idx];
-		crc_lo = table_crc_lo[idx];
+	if (len < RTU_HDR_LEN + RTU_CRC_LEN) {
+		return -ENODATA;
 	}
 
-	return (crc_hi << 8 | crc_lo);
+	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_INFO, "Received function code 0x%02x: %s\n", data[1], osmo_hexdump(data, len));
+	rc = pdu_decode(rtu->conn, data[0], &data[1], len - 1 - RTU_CRC_LEN, prim);
+	if (rc < 0)
+		return rc;
+	return len;
 }
 
-struct msgb* prim2rtu(struct osmo_modbus_prim *prim)
+/* Predict the total length of the frame being received in rx_msg from its
+ * function code (and byte count, if any), based on which form (request or
+ * response) we expect to receive in our role.
+ * Returns -ENODATA if not enough bytes were received yet to tell, -EINVAL if
+ * the length cannot be predicted. */
+int rtu_rx_expected_len(const struct osmo_modbus_conn_rtu* rtu)
 {
-	struct msgb *msg = modbus_rtu_msgb_alloc();
-	uint8_t *code;
-	size_t len;
+	const uint8_t *data = msgb_data(rtu->rx_msg);
+	size_t len = msgb_length(rtu->rx_msg);
+	int rc;
 
-	msgb_put_u8(msg, (uint8_t)prim->address);
-	code = msgb_put(msg, 1); /* fll later */
-	switch (OSMO_PRIM_HDR(&prim->oph)) {
-	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_REQUEST):
-		*code = OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG;
-		msgb_put_u16(msg, prim->u.read_mult_hold_reg_req.first_reg);
-		msgb_put_u16(msg, prim->u.read_mult_hold_reg_req.num_reg);
-		break;
-	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_RESPONSE):
-		*code = OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG;
-		msgb_put_u8(msg, prim->u.read_mult_hold_reg_resp.num_reg * 2);
-		len = prim->u.read_mult_hold_reg_resp.num_reg * sizeof(uint16_t);
-		memcpy(msgb_put(msg, len),
-		       prim->u.read_mult_hold_reg_resp.registers, len);
-		break;
-	default:
-		OSMO_ASSERT(0);
+	if (len < RTU_HDR_LEN)
+		return -ENODATA;
+
+	rc = pdu_expected_len(rtu->conn, &data[1], len - 1);
+	if (rc < 0)
+		return rc;
+	return 1 + rc + RTU_CRC_LEN;
+}
+
+/* Length of the full frame with valid CRC at the start of rx_msg, 0 if there's
+ * none (yet). If its length can't be predicted because several forms are
+ * expected (monitor mode), each candidate length is tried against the CRC. */
+int rtu_rx_frame_len(const struct osmo_modbus_conn_rtu* rtu)
+{
+	const uint8_t *data = msgb_data(rtu->rx_msg);
+	size_t len = msgb_length(rtu->rx_msg);
+	int lens[_NUM_PDU_FORM];
+	int exp_len, num, i;
+
+	exp_len = rtu_rx_expected_len(rtu);
+	if (exp_len > 0)
+		return (rtu->rx_crc == 0 && rtu->rx_crc_len == exp_len) ? exp_len : 0;
+	if (exp_len != -EINVAL || len < RTU_HDR_LEN)
+		return 0;
+
+	num = pdu_candidate_lens(rtu->conn, &data[1], len - 1, lens);
+	for (i = 0; i < num; i++) {
+		exp_len = 1 + lens[i] + RTU_CRC_LEN;
+		if (exp_len <= len && osmo_modbus_crc16_update(OSMO_MODBUS_CRC16_INIT, data, exp_len) == 0)
+			return exp_len;
 	}
-	msgb_put_u16(msg, crc16(msgb_data(msg), msgb_length(msg)));
-	return msg;
+	return 0;
 }
 
-/* Address (1Byte) + Function Code (1Byte) */
-#define RTU_HDR_LEN 2
-#define RTU_CRC_LEN 2
+/* Length of the current frame in rx_msg: up to its predicted length if known,
+ * any bytes after it belong to the next frame. Otherwise all of rx_msg. */
+int rtu_rx_cur_frame_len(const struct osmo_modbus_conn_rtu* rtu)
+{
+	int exp_len = rtu_rx_expected_len(rtu);
+	int len = msgb_length(rtu->rx_msg);
 
-/* Returns size used if succeeded, returns -ENODATA if data missing to parse message */
-int rtu2prim(struct osmo_modbus_conn_rtu* rtu, struct msgb* msg, struct osmo_modbus_prim **prim)
+	return (exp_len > 0 && exp_len < len) ? exp_len : len;
+}
+
+/* Whether rx_msg starts with a full frame with valid CRC */
+bool rtu_rx_frame_complete(const struct osmo_modbus_conn_rtu* rtu)
 {
-	uint8_t *data = msgb_data(msg);
-	size_t len = msgb_length(msg);
-	uint8_t address;
-	uint8_t exp_len_nocrc;
-	uint16_t exp_crc;
-	uint8_t byte_count;
-	enum osmo_modbus_function_code code;
+	return rtu_rx_frame_len(rtu) > 0;
+}
 
-	if (len < RTU_HDR_LEN) {
-		return -ENODATA;
-	}
+/* Feed the bytes of the current frame received so far to rx_crc */
+void rtu_rx_update_crc(struct osmo_modbus_conn_rtu* rtu)
+{
+	int frame_len = rtu_rx_cur_frame_len(rtu);
 
-	address = data[0];
-	code = (enum osmo_modbus_function_code)data[1];
-
-	switch (code) {
-	case OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG:
-		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_INFO, "Received OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG: %s\n", osmo_hexdump(data, len));
-		if (len < RTU_HDR_LEN + 4)
-			return -ENODATA;
-		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Received total %zu bytes: %s\n", len, osmo_hexdump(data, len));
-		/* Let's first try to decode Response */
-		byte_count = data[RTU_HDR_LEN];
-		exp_len_nocrc = RTU_HDR_LEN + 1 + byte_count;
-		if (len >= (exp_len_nocrc + RTU_CRC_LEN)) {
-			exp_crc = crc16(data, exp_len_nocrc);
-			osmo_store16be(exp_crc, &exp_crc);
-			if (memcmp(&exp_crc, &data[exp_len_nocrc], RTU_CRC_LEN) == 0) {
-				/* Its a response: */
-				uint16_t * registers = (uint16_t*)&data[RTU_HDR_LEN + 1]; /* FIXME: copy to temp buffer to fix misalignment */
-				*prim = osmo_modbus_makeprim_mult_hold_reg_resp(address, byte_count/2, registers);
-				return exp_len_nocrc + RTU_CRC_LEN;
-			}
-		}
-		/* try to decode Request */
-		exp_len_nocrc = RTU_HDR_LEN + 2 + 2;
-		if (len >= exp_len_nocrc + RTU_CRC_LEN) {
-			exp_crc = crc16(data, exp_len_nocrc);
-			osmo_store16be(exp_crc, &exp_crc);
-			if (memcmp(&exp_crc, &data[exp_len_nocrc], RTU_CRC_LEN) == 0) {
-				/* Its a response: */
-				uint16_t first_reg, num_reg;
-				first_reg = osmo_load16be(&data[RTU_HDR_LEN]);
-				num_reg = osmo_load16be(&data[RTU_HDR_LEN + 2]);
-				*prim = osmo_modbus_makeprim_mult_hold_reg_req(address, first_reg, num_reg);
-				return exp_len_nocrc + RTU_CRC_LEN;
+	if (frame_len <= rtu->rx_crc_len)
+		return;
+	rtu->rx_crc = osmo_modbus_crc16_update(rtu->rx_crc, msgb_data(rtu->rx_msg) + rtu->rx_crc_len,
+					       frame_len - rtu->rx_crc_len);
+	rtu->rx_crc_len = frame_len;
+}
+
+/* Drop the first len bytes (the current frame) from rx_msg, the next frame
+ * then starts at msgb_data(). No data is moved. */
+void rtu_rx_consume(struct osmo_modbus_conn_rtu* rtu, unsigned int len)
+{
+	msgb_pull(rtu->rx_msg, len);
+	rtu->rx_crc = OSMO_MODBUS_CRC16_INIT;
+	rtu->rx_crc_len = 0;
+	if (msgb_length(rtu->rx_msg) == 0)
+		msgb_reset(rtu->rx_msg);
+	else
+		rtu_rx_update_crc(rtu);
+}
+
+/* Serial line spec 2.2: 0 is broadcast, 1..247 individual slave addresses */
+#define RTU_ADDR_MAX 247
+
+/* After a frame failed its CRC, look for the start of the next one in rx_msg
+ * instead of dropping everything: a plausible address and supported function
+ * code followed by a frame of a candidate length with valid CRC. The bytes
+ * before it are dropped. If none is found, bytes from the first plausible
+ * start whose frame isn't fully received yet are kept, everything otherwise.
+ * Returns the number of bytes dropped. */
+int rtu_rx_resync(struct osmo_modbus_conn_rtu* rtu)
+{
+	const uint8_t *data = msgb_data(rtu->rx_msg);
+	size_t len = msgb_length(rtu->rx_msg);
+	int lens[_NUM_PDU_FORM];
+	int partial = -1;
+	int off, num, i, frame_len;
+
+	for (off = 1; off + RTU_HDR_LEN <= len; off++) {
+		if (data[off] > RTU_ADDR_MAX || !pdu_func_descs[data[off + 1]].name)
+			continue;
+		num = pdu_candidate_lens(rtu->conn, &data[off + 1], len - off - 1, lens);
+		if (num == 0 && partial < 0)
+			partial = off;
+		for (i = 0; i < num; i++) {
+			frame_len = 1 + lens[i] + RTU_CRC_LEN;
+			if (off + frame_len > len) {
+				if (partial < 0)
+					partial = off;
+				continue;
 			}
+			if (osmo_modbus_crc16_update(OSMO_MODBUS_CRC16_INIT, &data[off], frame_len) == 0)
+				goto found;
 		}
-		/* Either CRC error or we miss data... */
-		return -ENODATA;
-	default:
-		return -EINVAL;
 	}
+	off = partial >= 0 ? partial : len;
+	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_NOTICE, "Resync: no valid frame found, dropping %d bytes\n", off);
+	rtu->resync_stats.bytes_dropped += off;
+	rtu_rx_consume(rtu, off);
+	return off;
+
+found:
+	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_NOTICE, "Resync: frame found after dropping %d bytes\n", off);
+	rtu->resync_stats.bytes_dropped += off;
+	rtu->resync_stats.recovered++;
+	rtu_rx_consume(rtu, off);
+	return off;
 }
 
-int rtu_read(struct osmo_modbus_conn_rtu* rtu)
+/* Move the pending bytes back to the start of rx_msg to make room for read().
+ * Only happens when frames were consumed near the end of the buffer, and
+ * moves at most the frames not yet consumed. */
+static void rtu_rx_compact(struct osmo_modbus_conn_rtu* rtu)
+{
+	struct msgb *msg = rtu->rx_msg;
+	unsigned int len = msgb_length(msg);
+
+	if (msg->data == msg->_data)
+		return;
+	memmove(msg->_data, msg->data, len);
+	msg->head = msg->data = msg->_data;
+	msg->tail = msg->data + len;
+}
+
+static void rtu_echo_done(struct osmo_modbus_conn_rtu* rtu, bool matched)
+{
+	if (matched)
+		rtu->echo_stats.matched++;
+	else
+		rtu->echo_stats.mismatched++;
+	modbus_msgb_pool_put(rtu->conn->frame_pool, rtu->echo_msg);
+	rtu->echo_msg = NULL;
+}
+
+/* Match the len bytes just appended to rx_msg at *offset against the echo of
+ * the last emitted frame. Echo bytes are held at the start of rx_msg until the
+ * whole echo is matched, then dropped. On mismatch, the held bytes are handed
+ * over to the receiver as regular data.
+ * Returns the number of bytes left to process at *offset, 0 if all were echo. */
+static int rtu_rx_echo(struct osmo_modbus_conn_rtu* rtu, int *offset, int len)
 {
 	uint8_t *buf = msgb_data(rtu->rx_msg);
-	int offset = msgb_length(rtu->rx_msg);
+	const uint8_t *echo = msgb_data(rtu->echo_msg);
+	int echo_len = msgb_length(rtu->echo_msg);
+	int cmp_len = OSMO_MIN(len, echo_len - *offset);
+	int remain;
+
+	if (cmp_len <= 0 || memcmp(buf + *offset, echo + *offset, cmp_len) != 0) {
+		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_NOTICE, "Received data doesn't match the echo of the emitted frame\n");
+		rtu_echo_done(rtu, false);
+		remain = *offset + len;
+		*offset = 0;
+		return remain;
+	}
+
+	if (*offset + len < echo_len)
+		return 0;
+
+	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Discarded echo of the emitted frame\n");
+	rtu_echo_done(rtu, true);
+	remain = *offset + len - echo_len;
+	msgb_pull(rtu->rx_msg, echo_len);
+	*offset = 0;
+	return remain;
+}
+
+int rtu_read(struct osmo_modbus_conn_rtu* rtu)
+{
+	uint8_t *buf;
+	int offset;
 	int rc;
 
+	if (msgb_tailroom(rtu->rx_msg) < MODBUS_MSGB_SIZE)
+		rtu_rx_compact(rtu);
+	if (msgb_tailroom(rtu->rx_msg) == 0) {
+		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Rx buffer full without any frame boundary, dropping %d bytes\n",
+			msgb_length(rtu->rx_msg));
+		rtu_rx_reset(rtu);
+	}
+	buf = msgb_data(rtu->rx_msg);
+	offset = msgb_length(rtu->rx_msg);
+
 	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Read cb (buf=%d)\n", msgb_tailroom(rtu->rx_msg));
 	rc = read(rtu->ofd.fd, buf + offset, msgb_tailroom(rtu->rx_msg));
 	if (rc < 0) {
@@ -243,7 +317,21 @@ int rtu_read(struct osmo_modbus_conn_rtu* rtu)
 	}
 	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Received %d bytes: %s\n", rc, osmo_hexdump(buf + offset, rc));
 	msgb_put(rtu->rx_msg, rc);
-	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Received total %d bytes: %s\n", rc, osmo_hexdump(buf, msgb_length(rtu->rx_msg)));
+	if (rtu->echo_msg) {
+		rc = rtu_rx_echo(rtu, &offset, rc);
+		if (rc == 0)
+			return 0;
+	}
+	/* Keep the CRC up to date so the frame is validated as soon as its last byte arrives */
+	rtu_rx_update_crc(rtu);
+	LOGPRTU(rtu, DLMODBUS_RTU, LOGL_DEBUG, "Received total %d bytes: %s\n", rc, osmo_hexdump(msgb_data(rtu->rx_msg), msgb_length(rtu->rx_msg)));
+	if (rtu->lazy_silence) {
+		osmo_clock_gettime(CLOCK_MONOTONIC, &rtu->rx_last_ts);
+		/* Mid-frame: the T1.5 timer already armed will check the
+		 * silence against rx_last_ts when it expires */
+		if (rtu->fi->state == RTU_TRANSMIT_ST_RECEPTION && !rtu->early_delivery)
+			return 0;
+	}
 	osmo_fsm_inst_dispatch(rtu->fi, RTU_TRANSMIT_EV_CHAR_RECEIVED, NULL);
 	return 0;
 }
@@ -271,7 +359,17 @@ int rtu_write(struct osmo_modbus_conn_rtu* rtu)
 	} else if (rc != msgb_length(msg)) {
 		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Wrote only %d / %d bytes!\n", rc, msgb_length(msg));
 	}
-	msgb_free(msg);
+
+	if (rtu->echo_suppress && rc == msgb_length(msg)) {
+		/* Previous echo never arrived completely */
+		if (rtu->echo_msg)
+			rtu_echo_done(rtu, false);
+		/* We own the bus while emitting, anything buffered so far is stale */
+		rtu_rx_reset(rtu);
+		rtu->echo_msg = msg;
+		return 0;
+	}
+	modbus_msgb_pool_put(rtu->conn->frame_pool, msg);
 	return 0;
 }
 
@@ -303,29 +401,106 @@ err_badfd:
 	return rc;
 }
 
+static int rtu_apply_rs485(struct osmo_modbus_conn_rtu* rtu, int fd)
+{
+	struct serial_rs485 rs485;
+
+	memset(&rs485, 0, sizeof(rs485));
+	if (rtu->rs485.enabled) {
+		rs485.flags = SER_RS485_ENABLED;
+		rs485.flags |= rtu->rs485.rts_on_send ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND;
+		if (rtu->rs485.rx_during_tx)
+			rs485.flags |= SER_RS485_RX_DURING_TX;
+		rs485.delay_rts_before_send = rtu->rs485.delay_rts_before_send;
+		rs485.delay_rts_after_send = rtu->rs485.delay_rts_after_send;
+	}
+
+	if (ioctl(fd, TIOCSRS485, &rs485) < 0) {
+		/* Plain RS-232 ports don't support the ioctl, nothing to disable there */
+		if (!rtu->rs485.enabled)
+			return 0;
+		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "ioctl(TIOCSRS485) failed: %s\n", strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/* Apply baudrate to the serial line, going through termios2 if it has no speed_t */
+static int rtu_serial_set_baudrate(struct osmo_modbus_conn_rtu* rtu, int fd, unsigned baudrate)
+{
+	speed_t speed;
+	int rc;
+
+	if (osmo_serial_speed_t(baudrate, &speed) == 0)
+		return osmo_serial_set_baudrate(fd, speed);
+
+	rc = rtu_serial_set_custom_baudrate(fd, baudrate);
+	if (rc < 0)
+		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Failed to set custom baudrate %u: %s\n",
+			baudrate, strerror(-rc));
+	return rc;
+}
+
+static void rtu_timerfd_close(struct osmo_modbus_conn_rtu* rtu)
+{
+	if (rtu->timer_ofd.fd < 0)
+		return;
+	osmo_fd_unregister(&rtu->timer_ofd);
+	close(rtu->timer_ofd.fd);
+	rtu->timer_ofd.fd = -1;
+}
+
 static int osmo_modbus_conn_rtu_connect(struct osmo_modbus_conn* conn)
 {
 	struct osmo_modbus_conn_rtu* rtu = (struct osmo_modbus_conn_rtu*) conn->proto;
 	speed_t speed;
+	bool custom_baudrate;
 	int fd;
 	int flags;
+	int rc;
 
 	if (!rtu->dev_path || rtu->dev_path[0] == '\0')
 		return -EINVAL;
 
-	if (osmo_serial_speed_t(rtu->baudrate, &speed) < 0) {
-		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Failed to get speed_t from baudrate\n");
+	/* Non standard baudrates are set through termios2 once the port is open */
+	custom_baudrate = osmo_serial_speed_t(rtu->baudrate, &speed) < 0;
+	if (custom_baudrate)
+		speed = B9600;
+
+	/* The bus group wheel, if any, takes precedence over the timerfd */
+	if (conn->group) {
+		if (!rtu->wheel_timer.wheel)
+			modbus_twheel_timer_setup(&rtu->wheel_timer, &conn->group->wheel,
+						  rtu_transmit_fsm_wheel_cb, rtu);
+	} else if (rtu->use_timerfd && rtu->timer_ofd.fd < 0 &&
+		   osmo_timerfd_setup(&rtu->timer_ofd, rtu_transmit_fsm_timerfd_cb, rtu) < 0) {
+		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Failed to set up the timerfd\n");
 		return -EINVAL;
 	}
 
 	fd = osmo_serial_init(rtu->dev_path, speed);
-	if (fd < 0)
-		return fd;
+	if (fd < 0) {
+		rc = fd;
+		goto err_timerfd;
+	}
+
+	if (custom_baudrate) {
+		rc = rtu_serial_set_baudrate(rtu, fd, rtu->baudrate);
+		if (rc < 0)
+			goto err_close;
+	}
+
+	if (rtu->rs485.enabled) {
+		rc = rtu_apply_rs485(rtu, fd);
+		if (rc < 0)
+			goto err_close;
+	}
 
 	osmo_fd_setup(&rtu->ofd, fd, OSMO_FD_READ, rtu_ofd_cb, rtu, 0);
 	if (osmo_fd_register(&rtu->ofd) != 0) {
 		LOGPRTU(rtu, DLMODBUS_RTU, LOGL_ERROR, "Failed to register the serial\n");
-		return -EINVAL;
+		rc = -EINVAL;
+		goto err_close;
 	}
 
 	/* Set serial socket to non-blocking mode of operation */
@@ -334,6 +509,13 @@ static int osmo_modbus_conn_rtu_connect(struct osmo_modbus_conn* conn)
 	fcntl(rtu->ofd.fd, F_SETFL, flags);
 
 	return osmo_fsm_inst_dispatch(rtu->fi, RTU_TRANSMIT_EV_START, NULL);
+
+err_close:
+	close(fd);
+	rtu->ofd.fd = -1;
+err_timerfd:
+	rtu_timerfd_close(rtu);
+	return rc;
 }
 
 static bool osmo_modbus_conn_rtu_is_connected(struct osmo_modbus_conn* conn)
@@ -348,16 +530,22 @@ static int osmo_modbus_conn_rtu_tx_prim(struct osmo_modbus_conn* conn, struct os
 	int rc;
 
 	OSMO_ASSERT(!rtu->tx_msg);
-	rtu->tx_msg = prim2rtu(prim);
+	rtu->tx_msg = prim2rtu(rtu, prim);
 
 	rc = osmo_fsm_inst_dispatch(rtu->fi, RTU_TRANSMIT_EV_DEMAND_OF_EMISSION, NULL);
 	if (rc < 0) {
-		msgb_free(rtu->tx_msg);
+		modbus_msgb_pool_put(conn->frame_pool, rtu->tx_msg);
 		rtu->tx_msg = NULL;
 	}
 	return rc;
 }
 
+static unsigned int osmo_modbus_conn_rtu_max_inflight(struct osmo_modbus_conn* conn)
+{
+	/* Serial line: one request at a time */
+	return 1;
+}
+
 static void osmo_modbus_conn_rtu_free(struct osmo_modbus_conn* conn)
 {
 	struct osmo_modbus_conn_rtu* rtu = (struct osmo_modbus_conn_rtu*) conn->proto;
@@ -365,13 +553,18 @@ static void osmo_modbus_conn_rtu_free(struct osmo_modbus_conn* conn)
 	osmo_fsm_inst_free(rtu->fi);
 	rtu->fi = NULL;
 
+	modbus_twheel_timer_del(&rtu->wheel_timer);
+	rtu_timerfd_close(rtu);
+
 	if (rtu->ofd.fd >= 0) {
 		osmo_fd_unregister(&rtu->ofd);
 		close(rtu->ofd.fd);
 		rtu->ofd.fd = -1;
 	}
 
-	msgb_free(rtu->tx_msg);
+	modbus_msgb_pool_put(conn->frame_pool, rtu->tx_msg);
+	modbus_msgb_pool_put(conn->frame_pool, rtu->echo_msg);
+	msgb_free(rtu->rx_msg);
 
 	talloc_free(rtu);
 }
@@ -379,8 +572,9 @@ static void osmo_modbus_conn_rtu_free(struct osmo_modbus_conn* conn)
 static void recalc_baudrate_timers(struct osmo_modbus_conn_rtu* rtu)
 {
 	if (rtu->baudrate <= 19200) {
-		osmo_tdef_set(rtu->T_defs, 15, rtu_chars2bits(1500000) / rtu->baudrate, OSMO_TDEF_US);
-		osmo_tdef_set(rtu->T_defs, 35, rtu_chars2bits(3500000) / rtu->baudrate, OSMO_TDEF_US);
+		/* Round up, timers must never expire before the silence really elapsed */
+		osmo_tdef_set(rtu->T_defs, 15, (rtu_chars2bits(1500000) + rtu->baudrate - 1) / rtu->baudrate, OSMO_TDEF_US);
+		osmo_tdef_set(rtu->T_defs, 35, (rtu_chars2bits(3500000) + rtu->baudrate - 1) / rtu->baudrate, OSMO_TDEF_US);
 	} else {
 		/* 2.5.1.1 MODBUS Message RTU Framing: Fixed values used for higher baudrates */
 		osmo_tdef_set(rtu->T_defs, 15, 750, OSMO_TDEF_US);
@@ -401,7 +595,9 @@ struct osmo_modbus_conn_rtu* osmo_modbus_conn_rtu_alloc(struct osmo_modbus_conn*
 	rtu->conn = conn;
 	rtu->baudrate = 9600;
 	rtu->ofd.fd = -1;
-	rtu->rx_msg = modbus_rtu_msgb_alloc();
+	rtu->timer_ofd.fd = -1;
+	rtu->rx_msg = msgb_alloc_c(rtu, RTU_RX_BUF_SIZE, "rtu_rx");
+	rtu->rx_crc = OSMO_MODBUS_CRC16_INIT;
 	rtu->T_defs = talloc_zero_size(rtu, sizeof(g_rtu_tdefs));
 	memcpy(rtu->T_defs, g_rtu_tdefs, sizeof(g_rtu_tdefs));
 	osmo_tdefs_reset(rtu->T_defs);
@@ -413,7 +609,9 @@ struct osmo_modbus_conn_rtu* osmo_modbus_conn_rtu_alloc(struct osmo_modbus_conn*
 	conn->proto_ops.connect = osmo_modbus_conn_rtu_connect;
 	conn->proto_ops.is_connected = osmo_modbus_conn_rtu_is_connected;
 	conn->proto_ops.tx_prim = osmo_modbus_conn_rtu_tx_prim;
+	conn->proto_ops.max_inflight = osmo_modbus_conn_rtu_max_inflight;
 	conn->proto_ops.free = osmo_modbus_conn_rtu_free;
+	conn->proto_ops.has_trans_id = false;
 
 	return rtu;
 }
@@ -430,15 +628,22 @@ const char *osmo_modbus_conn_rtu_get_device(const struct osmo_modbus_conn_rtu* r
 	return rtu->dev_path;
 }
 
+/* Any baudrate is accepted, those without a standard speed_t are set through
+ * termios2 BOTHER. If connected, the line is reconfigured first and T1.5/T3.5
+ * are only updated once it succeeded, so they always match the line speed. */
 int osmo_modbus_conn_rtu_set_baudrate(struct osmo_modbus_conn_rtu* rtu, unsigned baudrate)
 {
-	speed_t speed;
-	if (osmo_serial_speed_t(baudrate, &speed) < 0)
+	int rc;
+
+	if (baudrate == 0)
 		return -EINVAL;
 
+	if (osmo_modbus_conn_rtu_is_connected(rtu->conn)) {
+		rc = rtu_serial_set_baudrate(rtu, rtu->ofd.fd, baudrate);
+		if (rc < 0)
+			return rc;
+	}
 	rtu->baudrate = baudrate;
-	if (osmo_modbus_conn_rtu_is_connected(rtu->conn))
-		return osmo_serial_set_baudrate(rtu->ofd.fd, speed);
 	recalc_baudrate_timers(rtu);
 	update_fi_name(rtu);
 	return 0;
@@ -448,3 +653,96 @@ unsigned osmo_modbus_conn_rtu_get_baudrate(const struct osmo_modbus_conn_rtu* rt
 {
 	return rtu->baudrate;
 }
+
+/* Deliver a received frame to upper layers as soon as its predicted length is
+ * reached and its CRC matches, instead of waiting for the T1.5 + T3.5 silence.
+ * The T3.5 silence is still honoured before any further emission. */
+int osmo_modbus_conn_rtu_set_early_delivery(struct osmo_modbus_conn_rtu* rtu, bool enable)
+{
+	rtu->early_delivery = enable;
+	return 0;
+}
+
+bool osmo_modbus_conn_rtu_get_early_delivery(const struct osmo_modbus_conn_rtu* rtu)
+{
+	return rtu->early_delivery;
+}
+
+int osmo_modbus_conn_rtu_set_rs485(struct osmo_modbus_conn_rtu* rtu, const struct osmo_modbus_rtu_rs485 *rs485)
+{
+	rtu->rs485 = *rs485;
+	if (osmo_modbus_conn_rtu_is_connected(rtu->conn))
+		return rtu_apply_rs485(rtu, rtu->ofd.fd);
+	return 0;
+}
+
+void osmo_modbus_conn_rtu_get_rs485(const struct osmo_modbus_conn_rtu* rtu, struct osmo_modbus_rtu_rs485 *rs485)
+{
+	*rs485 = rtu->rs485;
+}
+
+int osmo_modbus_conn_rtu_set_echo_suppress(struct osmo_modbus_conn_rtu* rtu, bool enable)
+{
+	rtu->echo_suppress = enable;
+	if (!enable && rtu->echo_msg) {
+		modbus_msgb_pool_put(rtu->conn->frame_pool, rtu->echo_msg);
+		rtu->echo_msg = NULL;
+	}
+	return 0;
+}
+
+bool osmo_modbus_conn_rtu_get_echo_suppress(const struct osmo_modbus_conn_rtu* rtu)
+{
+	return rtu->echo_suppress;
+}
+
+void osmo_modbus_conn_rtu_get_echo_stats(const struct osmo_modbus_conn_rtu* rtu,
+					 struct osmo_modbus_rtu_echo_stats *stats)
+{
+	*stats = rtu->echo_stats;
+}
+
+/* Only for roles receiving all traffic on the bus (slave, monitor) */
+int osmo_modbus_conn_rtu_set_resync(struct osmo_modbus_conn_rtu* rtu, bool enable)
+{
+	if (enable && rtu->conn->role != OSMO_MODBUS_ROLE_SLAVE)
+		return -ENOTSUP;
+	rtu->resync = enable;
+	return 0;
+}
+
+bool osmo_modbus_conn_rtu_get_resync(const struct osmo_modbus_conn_rtu* rtu)
+{
+	return rtu->resync;
+}
+
+void osmo_modbus_conn_rtu_get_resync_stats(const struct osmo_modbus_conn_rtu* rtu,
+					   struct osmo_modbus_rtu_resync_stats *stats)
+{
+	*stats = rtu->resync_stats;
+}
+
+/* Must be set before connecting */
+int osmo_modbus_conn_rtu_set_timerfd(struct osmo_modbus_conn_rtu* rtu, bool enable)
+{
+	if (rtu->ofd.fd >= 0)
+		return -EBUSY;
+	rtu->use_timerfd = enable;
+	return 0;
+}
+
+bool osmo_modbus_conn_rtu_get_timerfd(const struct osmo_modbus_conn_rtu* rtu)
+{
+	return rtu->use_timerfd;
+}
+
+int osmo_modbus_conn_rtu_set_lazy_silence(struct osmo_modbus_conn_rtu* rtu, bool enable)
+{
+	rtu->lazy_silence = enable;
+	return 0;
+}
+
+bool osmo_modbus_conn_rtu_get_lazy_silence(const struct osmo_modbus_conn_rtu* rtu)
+{
+	return rtu->lazy_silence;
+}
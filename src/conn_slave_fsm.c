@@ -35,6 +35,7 @@
 
 #include "modbus_internal.h"
 #include "conn_fsm.h"
+#include "pdu_internal.h"
 
 #define X(x)	(1 << (x))
 
@@ -77,13 +78,115 @@ static void conn_slave_fsm_st_idle_onenter(struct osmo_fsm_inst *fi, uint32_t pr
 {
 }
 
+/* Answer a request from the register store, if it holds all the registers
+ * accessed. Requests it doesn't cover are left to the app prim_cb, or answered
+ * with an Illegal Data Address exception if there's none. Writes to the
+ * broadcast address update the store without any answer. Returns true if
+ * answered (prim is consumed). */
+static bool conn_slave_answer_from_store(struct osmo_fsm_inst *fi, struct osmo_modbus_prim *prim)
+{
+	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
+	struct osmo_modbus_reg_store *store = conn->slave.reg_store;
+	struct osmo_modbus_read_mult_hold_reg_req_param *req;
+	struct osmo_modbus_write_mult_reg_req_param *wreq;
+	struct osmo_modbus_rw_mult_reg_req_param *rwreq;
+	struct osmo_modbus_prim *resp = NULL;
+	uint16_t registers[125];
+	uint8_t exception = 0;
+
+	if (!store)
+		return false;
+
+	switch (OSMO_PRIM_HDR(&prim->oph)) {
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_REQUEST):
+		req = &prim->u.read_mult_hold_reg_req;
+		/* Quantities were checked when decoded, up to 125 registers */
+		if (reg_store_read_raw(store, req->first_reg, req->num_reg, registers) < 0) {
+			exception = OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS;
+			break;
+		}
+		LOGPFSML(fi, LOGL_DEBUG, "Answering read of %" PRIu16 " registers from 0x%04x from the register store\n",
+			 req->num_reg, req->first_reg);
+		resp = modbus_makeprim_mult_hold_reg_resp(conn->prim_pool, conn->address, req->num_reg,
+							   (const uint8_t *)registers);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_REG, PRIM_OP_REQUEST):
+		wreq = &prim->u.write_mult_reg_req;
+		if (reg_store_write_raw(store, wreq->first_reg, wreq->num_reg, wreq->registers) < 0) {
+			exception = OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS;
+			break;
+		}
+		LOGPFSML(fi, LOGL_DEBUG, "Wrote %" PRIu16 " registers from 0x%04x to the register store\n",
+			 wreq->num_reg, wreq->first_reg);
+		resp = modbus_makeprim_write_mult_reg_resp(conn->prim_pool, conn->address,
+							   wreq->first_reg, wreq->num_reg);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_REQUEST):
+		rwreq = &prim->u.rw_mult_reg_req;
+		/* The write is performed before the read, check both are covered first */
+		if (reg_store_read_raw(store, rwreq->read_first_reg, rwreq->read_num_reg, registers) < 0 ||
+		    reg_store_write_raw(store, rwreq->write_first_reg, rwreq->write_num_reg, rwreq->registers) < 0) {
+			exception = OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS;
+			break;
+		}
+		reg_store_read_raw(store, rwreq->read_first_reg, rwreq->read_num_reg, registers);
+		LOGPFSML(fi, LOGL_DEBUG, "Answering read/write of %" PRIu16 "/%" PRIu16 " registers from the register store\n",
+			 rwreq->read_num_reg, rwreq->write_num_reg);
+		resp = modbus_makeprim_rw_mult_reg_resp(conn->prim_pool, conn->address, rwreq->read_num_reg,
+							 (const uint8_t *)registers);
+		break;
+	default:
+		return false;
+	}
+
+	if (exception == OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS && conn->prim_cb)
+		return false;
+
+	if (prim->address == OSMO_MODBUS_ADDR_BROADCAST) {
+		if (resp)
+			modbus_msgb_pool_put(conn->prim_pool, resp->oph.msg);
+		modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
+		return true;
+	}
+	if (exception) {
+		LOGPFSML(fi, LOGL_INFO, "Answering %s request with exception 0x%02x\n",
+			 get_value_string(osmo_modbus_prim_type_names, prim->oph.primitive), exception);
+		resp = modbus_makeprim_exception_resp(conn->prim_pool, conn->address,
+						      pdu_prim_func_code(prim), exception);
+	}
+	resp->trans_id = prim->trans_id;
+	conn->proto_ops.tx_prim(conn, resp);
+	modbus_msgb_pool_put(conn->prim_pool, resp->oph.msg);
+	modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
+	return true;
+}
+
 static void conn_slave_fsm_st_idle(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
 	struct osmo_modbus_conn *conn = (struct osmo_modbus_conn*)fi->priv;
 	struct osmo_modbus_prim *prim;
+	struct msgb *msg;
 	switch (event) {
+	case CONN_EV_SUBMIT_PRIM:
+		/* eg. answering a broadcast request */
+		msg = msgb_dequeue(&conn->msg_queue);
+		LOGPFSML(fi, LOGL_NOTICE, "No request pending an answer, dropping response\n");
+		modbus_msgb_pool_put(conn->prim_pool, msg);
+		break;
 	case CONN_EV_RECV_PRIM:
 		prim = (struct osmo_modbus_prim *)data;
+		if ((conn->address == prim->address || prim->address == OSMO_MODBUS_ADDR_BROADCAST) &&
+		    conn_slave_answer_from_store(fi, prim))
+			return;
+		if (prim->address == OSMO_MODBUS_ADDR_BROADCAST && prim->oph.operation == PRIM_OP_REQUEST) {
+			/* Processed by upper layers, but never answered */
+			LOGPFSML(fi, LOGL_DEBUG, "Broadcast request, no response will be sent\n");
+			if (conn->prim_cb)
+				conn->prim_cb(conn, prim, conn->prim_cb_ctx);
+			else
+				modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
+			return;
+		}
 		/* check if addr is for us... */
 		if (!conn->prim_cb || conn->address != prim->address) {
 			LOGPFSML(fi, LOGL_DEBUG, "primitive not for us (addr=%" PRIu16 "), ignoring\n",
@@ -94,9 +197,10 @@ static void conn_slave_fsm_st_idle(struct osmo_fsm_inst *fi, uint32_t event, voi
 			if (conn->prim_cb && conn->slave.monitor)
 				conn->prim_cb(conn, prim, conn->prim_cb_ctx);
 			else
-				msgb_free(prim->oph.msg);
+				modbus_msgb_pool_put(conn->prim_pool, prim->oph.msg);
 			return;
 		}
+		conn->slave.req_trans_id = prim->trans_id;
 		conn_slave_fsm_state_chg(fi, CONN_SLAVE_ST_CHECK_REQUEST);
 		/* Ideally this should go into st_check_request_onenter but then
 		 * we need to store the prim pointer somewhere... */
@@ -126,8 +230,10 @@ static void conn_slave_fsm_st_check_request(struct osmo_fsm_inst *fi, uint32_t e
 
 		msg = msgb_dequeue(&conn->msg_queue);
 		prim = (struct osmo_modbus_prim *)msgb_data(msg);
+		/* Answer with the Transaction Id of the request */
+		prim->trans_id = conn->slave.req_trans_id;
 		conn->proto_ops.tx_prim(conn, prim);
-		msgb_free(msg);
+		modbus_msgb_pool_put(conn->prim_pool, msg);
 		conn_slave_fsm_state_chg(fi, CONN_SLAVE_ST_IDLE);
 		break;
 	default:
@@ -144,7 +250,8 @@ static const struct osmo_fsm_state conn_slave_states[] = {
 		.onenter = conn_slave_fsm_st_disconnected_onenter,
 	},
 	[CONN_SLAVE_ST_IDLE] = {
-		.in_event_mask = X(CONN_EV_RECV_PRIM),
+		.in_event_mask = X(CONN_EV_RECV_PRIM) |
+				 X(CONN_EV_SUBMIT_PRIM),
 		.out_state_mask = X(CONN_SLAVE_ST_CHECK_REQUEST),
 		.name = "IDLE",
 		.action = conn_slave_fsm_st_idle,
@@ -0,0 +1,493 @@
+/*! \file conn_tcp.c
+ * modbus connection TCP specifics */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* https://www.modbus.org/docs/Modbus_Messaging_Implementation_Guide_V1_0b.pdf */
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <osmocom/core/socket.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/bits.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_tcp.h>
+
+#include "modbus_internal.h"
+#include "tcp_internal.h"
+#include "pdu_internal.h"
+#include "conn_fsm.h"
+
+#define TCP_RX_MSGB_SIZE (2 * MBAP_MAX_ADU_LEN)
+
+#define LOGPTCP(tcp, subsys, level, fmt, args ...) \
+	LOGP(subsys, level, "(addr=%" PRIu16 ",tcp=%s:%" PRIu16 ") " fmt, \
+	     (tcp)->conn->address, (tcp)->host ? : "*", (tcp)->port, ## args)
+
+struct msgb* prim2mbap(struct osmo_modbus_conn_tcp* tcp, struct osmo_modbus_prim *prim)
+{
+	struct msgb *msg = modbus_msgb_pool_get(tcp->conn->frame_pool);
+	uint8_t *len_field;
+	int rc;
+
+	msgb_put_u16(msg, prim->trans_id);
+	msgb_put_u16(msg, 0); /* Protocol Id: Modbus */
+	len_field = msgb_put(msg, 2);
+	msgb_put_u8(msg, (uint8_t)prim->address);
+	rc = pdu_encode(prim, msg);
+	OSMO_ASSERT(rc == 0);
+	/* Length counts Unit Id + PDU */
+	osmo_store16be(msgb_length(msg) - 6, len_field);
+	return msg;
+}
+
+/* data holds exactly one ADU, as delimited by its MBAP Length field */
+int mbap2prim(struct osmo_modbus_conn_tcp* tcp, const uint8_t *data, size_t len, struct osmo_modbus_prim **prim)
+{
+	int rc;
+
+	LOGPTCP(tcp, DLMODBUS, LOGL_INFO, "Received function code 0x%02x: %s\n",
+		data[MBAP_HDR_LEN], osmo_hexdump(data, len));
+	rc = pdu_decode(tcp->conn, data[6], &data[MBAP_HDR_LEN], len - MBAP_HDR_LEN, prim);
+	if (rc < 0)
+		return rc;
+	(*prim)->trans_id = osmo_load16be(&data[0]);
+	return 0;
+}
+
+static void tcp_peer_init(struct osmo_modbus_conn_tcp* tcp, struct tcp_peer *peer)
+{
+	peer->tcp = tcp;
+	peer->ofd.fd = -1;
+	peer->rx_msg = msgb_alloc_c(tcp, TCP_RX_MSGB_SIZE, "mbap_rx");
+	INIT_LLIST_HEAD(&peer->tx_queue);
+}
+
+static void tcp_peer_close(struct tcp_peer *peer)
+{
+	struct osmo_modbus_conn_tcp *tcp = peer->tcp;
+	struct msgb *msg;
+
+	if (peer->ofd.fd >= 0) {
+		osmo_fd_unregister(&peer->ofd);
+		close(peer->ofd.fd);
+		peer->ofd.fd = -1;
+	}
+	msgb_trim(peer->rx_msg, 0);
+	while ((msg = msgb_dequeue(&peer->tx_queue)))
+		modbus_msgb_pool_put(tcp->conn->frame_pool, msg);
+}
+
+/* slave: forget a master which went away, along with its pending requests */
+static void tcp_client_free(struct tcp_peer *peer)
+{
+	struct osmo_modbus_conn_tcp *tcp = peer->tcp;
+	struct msgb *msg, *msg2;
+
+	tcp_peer_close(peer);
+	llist_for_each_entry_safe(msg, msg2, &tcp->rx_queue, list) {
+		if (TCP_RX_PEER(msg) != peer)
+			continue;
+		llist_del(&msg->list);
+		modbus_msgb_pool_put(tcp->conn->prim_pool, msg);
+	}
+	/* The answer to its request in progress will be dropped */
+	if (tcp->req_peer == peer)
+		tcp->req_peer = NULL;
+	llist_del(&peer->list);
+	tcp->num_clients--;
+	msgb_free(peer->rx_msg);
+	talloc_free(peer);
+}
+
+/* Hand queued requests over to the slave FSM, which handles one at a time */
+static void tcp_slave_rx_deliver(struct osmo_modbus_conn_tcp* tcp)
+{
+	struct osmo_modbus_conn *conn = tcp->conn;
+	struct msgb *msg;
+
+	while (conn->fi->state == CONN_SLAVE_ST_IDLE && (msg = msgb_dequeue(&tcp->rx_queue))) {
+		tcp->req_peer = TCP_RX_PEER(msg);
+		osmo_modbus_conn_rx_prim(conn, (struct osmo_modbus_prim *)msgb_data(msg));
+	}
+}
+
+static void tcp_rx_timer_cb(void *data)
+{
+	tcp_slave_rx_deliver((struct osmo_modbus_conn_tcp*)data);
+}
+
+/* Split the stream in rx_msg into ADUs and deliver them.
+ * Returns -EBADMSG if the stream can't be parsed anymore. */
+static int tcp_rx_parse(struct tcp_peer *peer)
+{
+	struct osmo_modbus_conn_tcp *tcp = peer->tcp;
+	uint8_t *data = msgb_data(peer->rx_msg);
+	size_t len = msgb_length(peer->rx_msg);
+	size_t off = 0, adu_len;
+	uint16_t mbap_len;
+	struct osmo_modbus_prim *prim;
+	int rc;
+
+	while (len - off >= MBAP_HDR_LEN) {
+		mbap_len = osmo_load16be(&data[off + 4]);
+		if (osmo_load16be(&data[off + 2]) != 0 || mbap_len < 2 ||
+		    6 + mbap_len > MBAP_MAX_ADU_LEN) {
+			LOGPTCP(tcp, DLMODBUS, LOGL_ERROR, "Invalid MBAP header: %s\n",
+				osmo_hexdump(&data[off], MBAP_HDR_LEN));
+			return -EBADMSG;
+		}
+		adu_len = 6 + mbap_len;
+		if (len - off < adu_len)
+			break;
+
+		rc = mbap2prim(tcp, &data[off], adu_len, &prim);
+		off += adu_len;
+		if (rc < 0) {
+			LOGPTCP(tcp, DLMODBUS, LOGL_NOTICE, "Failed to decode ADU (%d), dropping\n", rc);
+			continue;
+		}
+		if (tcp->conn->role == OSMO_MODBUS_ROLE_SLAVE) {
+			TCP_RX_PEER(prim->oph.msg) = peer;
+			msgb_enqueue(&tcp->rx_queue, prim->oph.msg);
+			tcp_slave_rx_deliver(tcp);
+		} else {
+			osmo_modbus_conn_rx_prim(tcp->conn, prim);
+		}
+	}
+
+	if (off > 0) {
+		memmove(data, &data[off], len - off);
+		msgb_trim(peer->rx_msg, len - off);
+	}
+	return 0;
+}
+
+static int tcp_read(struct tcp_peer *peer)
+{
+	struct osmo_modbus_conn_tcp *tcp = peer->tcp;
+	int rc;
+
+	rc = read(peer->ofd.fd, msgb_data(peer->rx_msg) + msgb_length(peer->rx_msg), msgb_tailroom(peer->rx_msg));
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		LOGPTCP(tcp, DLMODBUS, LOGL_ERROR, "read() failed %d: %s\n", rc, strerror(errno));
+		return -EBADF;
+	} else if (rc == 0) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_NOTICE, "Connection closed by peer\n");
+		return -EBADF;
+	}
+	LOGPTCP(tcp, DLMODBUS, LOGL_DEBUG, "Received %d bytes: %s\n", rc,
+		osmo_hexdump(msgb_data(peer->rx_msg) + msgb_length(peer->rx_msg), rc));
+	msgb_put(peer->rx_msg, rc);
+
+	if (tcp_rx_parse(peer) < 0)
+		return -EBADF;
+	return 0;
+}
+
+static int tcp_write(struct tcp_peer *peer)
+{
+	struct osmo_modbus_conn_tcp *tcp = peer->tcp;
+	struct msgb *msg;
+	int rc;
+
+	while ((msg = msgb_dequeue(&peer->tx_queue))) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_INFO, "Writing: %s\n", msgb_hexdump(msg));
+		rc = write(peer->ofd.fd, msgb_data(msg), msgb_length(msg));
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				llist_add(&msg->list, &peer->tx_queue);
+				return 0;
+			}
+			LOGPTCP(tcp, DLMODBUS, LOGL_ERROR, "write() failed %d: %s\n", rc, strerror(errno));
+			modbus_msgb_pool_put(tcp->conn->frame_pool, msg);
+			return -EBADF;
+		}
+		if (rc < msgb_length(msg)) {
+			/* Socket buffer full, send the rest once writable again */
+			msgb_pull(msg, rc);
+			llist_add(&msg->list, &peer->tx_queue);
+			return 0;
+		}
+		modbus_msgb_pool_put(tcp->conn->frame_pool, msg);
+	}
+
+	peer->ofd.when &= ~OSMO_FD_WRITE;
+	return 0;
+}
+
+static int tcp_data_ofd_cb(struct osmo_fd *ofd, unsigned int flags)
+{
+	struct tcp_peer *peer = (struct tcp_peer *)ofd->data;
+	int rc = 0;
+
+	if (flags & OSMO_FD_READ) {
+		rc = tcp_read(peer);
+		if (rc == -EBADF)
+			goto err_badfd;
+	}
+
+	if (flags & OSMO_FD_WRITE) {
+		rc = tcp_write(peer);
+		if (rc == -EBADF)
+			goto err_badfd;
+	}
+	return 0;
+
+err_badfd:
+	/* A slave keeps listening for masters connecting again. A master fails
+	 * the requests in flight and waits for the app to connect again. */
+	if (peer->tcp->conn->role == OSMO_MODBUS_ROLE_SLAVE) {
+		tcp_client_free(peer);
+	} else {
+		tcp_peer_close(peer);
+		osmo_fsm_inst_dispatch(peer->tcp->conn->fi, CONN_EV_DISCONNECT, NULL);
+	}
+	return 0;
+}
+
+static int tcp_setup_data_ofd(struct tcp_peer *peer, int fd)
+{
+	int flags;
+
+	/* Set socket to non-blocking mode of operation */
+	flags = fcntl(fd, F_GETFL);
+	flags |= O_NONBLOCK;
+	fcntl(fd, F_SETFL, flags);
+
+	osmo_fd_setup(&peer->ofd, fd, OSMO_FD_READ, tcp_data_ofd_cb, peer, 0);
+	if (osmo_fd_register(&peer->ofd) != 0) {
+		LOGPTCP(peer->tcp, DLMODBUS, LOGL_ERROR, "Failed to register the socket\n");
+		close(fd);
+		peer->ofd.fd = -1;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int tcp_listen_ofd_cb(struct osmo_fd *ofd, unsigned int flags)
+{
+	struct osmo_modbus_conn_tcp *tcp = (struct osmo_modbus_conn_tcp*)ofd->data;
+	struct tcp_peer *peer;
+	int fd;
+
+	if (!(flags & OSMO_FD_READ))
+		return 0;
+
+	fd = accept(ofd->fd, NULL, NULL);
+	if (fd < 0) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_ERROR, "accept() failed: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if (tcp->num_clients >= tcp->max_clients) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_NOTICE, "Rejecting connection from %s, already serving %u masters\n",
+			osmo_sock_get_name2(fd), tcp->num_clients);
+		close(fd);
+		return 0;
+	}
+
+	LOGPTCP(tcp, DLMODBUS, LOGL_INFO, "Accepted connection %s\n", osmo_sock_get_name2(fd));
+	peer = talloc_zero(tcp, struct tcp_peer);
+	tcp_peer_init(tcp, peer);
+	llist_add_tail(&peer->list, &tcp->clients);
+	tcp->num_clients++;
+	if (tcp_setup_data_ofd(peer, fd) < 0)
+		tcp_client_free(peer);
+	return 0;
+}
+
+static int osmo_modbus_conn_tcp_connect(struct osmo_modbus_conn* conn)
+{
+	struct osmo_modbus_conn_tcp* tcp = (struct osmo_modbus_conn_tcp*) conn->proto;
+	int fd;
+	int flags;
+
+	if (conn->role == OSMO_MODBUS_ROLE_MASTER) {
+		if (!tcp->host || tcp->host[0] == '\0')
+			return -EINVAL;
+		fd = osmo_sock_init(AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, tcp->host, tcp->port,
+				    OSMO_SOCK_F_CONNECT | OSMO_SOCK_F_NONBLOCK);
+		if (fd < 0)
+			return fd;
+		return tcp_setup_data_ofd(&tcp->server, fd);
+	}
+
+	fd = osmo_sock_init(AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, tcp->host, tcp->port,
+			    OSMO_SOCK_F_BIND);
+	if (fd < 0)
+		return fd;
+
+	flags = fcntl(fd, F_GETFL);
+	flags |= O_NONBLOCK;
+	fcntl(fd, F_SETFL, flags);
+
+	osmo_fd_setup(&tcp->ofd, fd, OSMO_FD_READ, tcp_listen_ofd_cb, tcp, 0);
+	if (osmo_fd_register(&tcp->ofd) != 0) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_ERROR, "Failed to register the listen socket\n");
+		close(fd);
+		tcp->ofd.fd = -1;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static bool osmo_modbus_conn_tcp_is_connected(struct osmo_modbus_conn* conn)
+{
+	struct osmo_modbus_conn_tcp* tcp = (struct osmo_modbus_conn_tcp*) conn->proto;
+
+	/* A slave is connected as long as it listens */
+	if (conn->role == OSMO_MODBUS_ROLE_SLAVE)
+		return tcp->ofd.fd >= 0;
+	return tcp->server.ofd.fd >= 0;
+}
+
+static int osmo_modbus_conn_tcp_tx_prim(struct osmo_modbus_conn* conn, struct osmo_modbus_prim *prim)
+{
+	struct osmo_modbus_conn_tcp* tcp = (struct osmo_modbus_conn_tcp*) conn->proto;
+	struct tcp_peer *peer;
+
+	if (conn->role == OSMO_MODBUS_ROLE_SLAVE) {
+		peer = tcp->req_peer;
+		/* A slave answered the request it was handling, go on with the next one */
+		if (!llist_empty(&tcp->rx_queue))
+			osmo_timer_schedule(&tcp->rx_timer, 0, 0);
+	} else {
+		peer = &tcp->server;
+	}
+
+	if (!peer || peer->ofd.fd < 0) {
+		LOGPTCP(tcp, DLMODBUS, LOGL_NOTICE, "Not connected, dropping tx primitive\n");
+		return -ENOTCONN;
+	}
+
+	msgb_enqueue(&peer->tx_queue, prim2mbap(tcp, prim));
+	peer->ofd.when |= OSMO_FD_WRITE;
+	return 0;
+}
+
+static unsigned int osmo_modbus_conn_tcp_max_inflight(struct osmo_modbus_conn* conn)
+{
+	struct osmo_modbus_conn_tcp* tcp = (struct osmo_modbus_conn_tcp*) conn->proto;
+	return tcp->max_inflight;
+}
+
+static void osmo_modbus_conn_tcp_free(struct osmo_modbus_conn* conn)
+{
+	struct osmo_modbus_conn_tcp* tcp = (struct osmo_modbus_conn_tcp*) conn->proto;
+	struct tcp_peer *peer, *peer2;
+	struct msgb *msg;
+
+	osmo_timer_del(&tcp->rx_timer);
+	llist_for_each_entry_safe(peer, peer2, &tcp->clients, list)
+		tcp_client_free(peer);
+	while ((msg = msgb_dequeue(&tcp->rx_queue)))
+		modbus_msgb_pool_put(conn->prim_pool, msg);
+	tcp_peer_close(&tcp->server);
+
+	if (tcp->ofd.fd >= 0) {
+		osmo_fd_unregister(&tcp->ofd);
+		close(tcp->ofd.fd);
+		tcp->ofd.fd = -1;
+	}
+
+	msgb_free(tcp->server.rx_msg);
+
+	talloc_free(tcp);
+}
+
+struct osmo_modbus_conn_tcp* osmo_modbus_conn_tcp_alloc(struct osmo_modbus_conn* conn)
+{
+	struct osmo_modbus_conn_tcp* tcp = talloc_zero(conn, struct osmo_modbus_conn_tcp);
+	tcp->conn = conn;
+	tcp->port = OSMO_MODBUS_TCP_DEFAULT_PORT;
+	tcp->max_inflight = 1;
+	tcp->max_clients = OSMO_MODBUS_TCP_DEFAULT_MAX_CLIENTS;
+	tcp->ofd.fd = -1;
+	tcp_peer_init(tcp, &tcp->server);
+	INIT_LLIST_HEAD(&tcp->clients);
+	INIT_LLIST_HEAD(&tcp->rx_queue);
+	osmo_timer_setup(&tcp->rx_timer, tcp_rx_timer_cb, tcp);
+
+	conn->proto_ops.connect = osmo_modbus_conn_tcp_connect;
+	conn->proto_ops.is_connected = osmo_modbus_conn_tcp_is_connected;
+	conn->proto_ops.tx_prim = osmo_modbus_conn_tcp_tx_prim;
+	conn->proto_ops.max_inflight = osmo_modbus_conn_tcp_max_inflight;
+	conn->proto_ops.free = osmo_modbus_conn_tcp_free;
+	conn->proto_ops.has_trans_id = true;
+
+	return tcp;
+}
+
+int osmo_modbus_conn_tcp_set_addr(struct osmo_modbus_conn_tcp* tcp, const char *host, uint16_t port)
+{
+	osmo_talloc_replace_string(tcp, &tcp->host, host);
+	tcp->port = port;
+	return 0;
+}
+
+const char *osmo_modbus_conn_tcp_get_host(const struct osmo_modbus_conn_tcp* tcp)
+{
+	return tcp->host;
+}
+
+uint16_t osmo_modbus_conn_tcp_get_port(const struct osmo_modbus_conn_tcp* tcp)
+{
+	return tcp->port;
+}
+
+int osmo_modbus_conn_tcp_set_max_inflight(struct osmo_modbus_conn_tcp* tcp, unsigned int max_inflight)
+{
+	if (max_inflight == 0)
+		return -EINVAL;
+	tcp->max_inflight = max_inflight;
+	return 0;
+}
+
+unsigned int osmo_modbus_conn_tcp_get_max_inflight(const struct osmo_modbus_conn_tcp* tcp)
+{
+	return tcp->max_inflight;
+}
+
+int osmo_modbus_conn_tcp_set_max_clients(struct osmo_modbus_conn_tcp* tcp, unsigned int max_clients)
+{
+	if (max_clients == 0)
+		return -EINVAL;
+	tcp->max_clients = max_clients;
+	return 0;
+}
+
+unsigned int osmo_modbus_conn_tcp_get_max_clients(const struct osmo_modbus_conn_tcp* tcp)
+{
+	return tcp->max_clients;
+}
@@ -0,0 +1,327 @@
+/*! \file crc16.c
+ * CRC-16/MODBUS: slicing-by-8 and carry-less multiply implementations */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* CRC-16/MODBUS: poly x^16 + x^15 + x^2 + 1 (0x8005), reflected (0xA001),
+ * init 0xFFFF, no final xor. The shift register is kept in its reflected form,
+ * hence its LSB is the first byte to be transmitted. */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <osmocom/core/utils.h>
+
+#include <osmocom/modbus/modbus_crc16.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CRC16_CLMUL 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC16_CLMUL 1
+#endif
+
+#define CRC16_POLY_REFLECTED 0xA001
+#define CRC16_POLY_NORMAL 0x18005
+
+const struct value_string osmo_modbus_crc16_engine_names[] = {
+	{ OSMO_MODBUS_CRC16_ENGINE_AUTO,	"auto" },
+	{ OSMO_MODBUS_CRC16_ENGINE_SLICE8,	"slice8" },
+	{ OSMO_MODBUS_CRC16_ENGINE_CLMUL,	"clmul" },
+	{ 0, NULL }
+};
+
+typedef uint16_t (*crc16_update_fn)(uint16_t crc, const uint8_t *data, size_t len);
+
+/* crc_table[0] is the classic byte-at-a-time table, crc_table[k][b] is the
+ * contribution of byte b followed by k zero bytes. */
+static uint16_t crc_table[8][256];
+
+static enum osmo_modbus_crc16_engine crc16_engine;
+static crc16_update_fn crc16_update_impl;
+
+static inline uint16_t crc16_byte(uint16_t crc, uint8_t byte)
+{
+	return (crc >> 8) ^ crc_table[0][(crc ^ byte) & 0xff];
+}
+
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *data, size_t len)
+{
+	while (len >= 8) {
+		crc = crc_table[7][(crc ^ data[0]) & 0xff] ^
+		      crc_table[6][(crc >> 8) ^ data[1]] ^
+		      crc_table[5][data[2]] ^
+		      crc_table[4][data[3]] ^
+		      crc_table[3][data[4]] ^
+		      crc_table[2][data[5]] ^
+		      crc_table[1][data[6]] ^
+		      crc_table[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc16_byte(crc, *data++);
+	return crc;
+}
+
+#ifdef HAVE_CRC16_CLMUL
+/* Below this length the setup of the folding path doesn't pay off */
+#define CRC16_CLMUL_MIN_LEN 32
+
+/* Folding constants. Data is loaded as 128 bit little-endian vectors, which in
+ * the reflected domain puts the highest degree coefficient of a block in bit 0.
+ * Folding an accumulator A = L*x^64 + H forward by D bits is done as
+ * L*(x^(D+64) mod P) + H*(x^D mod P); since the 64x64 bit carry-less product
+ * of two reflected operands comes out shifted by one bit, the constants
+ * actually stored are x^(D+63) mod P and x^(D-1) mod P, reflected into 64 bit. */
+struct crc16_fold_k {
+	uint64_t lo; /* applied to the low (higher degree) half of the accumulator */
+	uint64_t hi; /* applied to the high (lower degree) half of the accumulator */
+};
+static struct crc16_fold_k crc_fold_k128, crc_fold_k256, crc_fold_k384, crc_fold_k512;
+
+/* x^n mod P, in reflected 64 bit form */
+static uint64_t crc16_xpow_mod_reflected(unsigned int n)
+{
+	uint32_t rem = 1;
+	uint64_t out = 0;
+	unsigned int i;
+
+	while (n--) {
+		rem <<= 1;
+		if (rem & 0x10000)
+			rem ^= CRC16_POLY_NORMAL;
+	}
+	for (i = 0; i < 16; i++) {
+		if (rem & (1 << i))
+			out |= (uint64_t)1 << (63 - i);
+	}
+	return out;
+}
+
+static void crc16_fold_k_init(struct crc16_fold_k *k, unsigned int dist_bits)
+{
+	k->lo = crc16_xpow_mod_reflected(dist_bits + 63);
+	k->hi = crc16_xpow_mod_reflected(dist_bits - 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define CRC16_CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+
+CRC16_CLMUL_TARGET
+static inline __m128i crc16_fold(__m128i acc, const struct crc16_fold_k *k)
+{
+	__m128i kv = _mm_set_epi64x((long long)k->hi, (long long)k->lo);
+	return _mm_xor_si128(_mm_clmulepi64_si128(acc, kv, 0x00),
+			     _mm_clmulepi64_si128(acc, kv, 0x11));
+}
+
+CRC16_CLMUL_TARGET
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+	__m128i a0, a1, a2, a3;
+	uint8_t tmp[16];
+
+	if (len < CRC16_CLMUL_MIN_LEN)
+		return crc16_slice8(crc, data, len);
+
+	/* Preset the shift register by xoring it into the first 2 bytes */
+	a0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)data), _mm_cvtsi32_si128(crc));
+	data += 16;
+	len -= 16;
+
+	if (len >= 64) {
+		a1 = _mm_loadu_si128((const __m128i *)(data + 0));
+		a2 = _mm_loadu_si128((const __m128i *)(data + 16));
+		a3 = _mm_loadu_si128((const __m128i *)(data + 32));
+		data += 48;
+		len -= 48;
+		while (len >= 64) {
+			a0 = _mm_xor_si128(crc16_fold(a0, &crc_fold_k512), _mm_loadu_si128((const __m128i *)(data + 0)));
+			a1 = _mm_xor_si128(crc16_fold(a1, &crc_fold_k512), _mm_loadu_si128((const __m128i *)(data + 16)));
+			a2 = _mm_xor_si128(crc16_fold(a2, &crc_fold_k512), _mm_loadu_si128((const __m128i *)(data + 32)));
+			a3 = _mm_xor_si128(crc16_fold(a3, &crc_fold_k512), _mm_loadu_si128((const __m128i *)(data + 48)));
+			data += 64;
+			len -= 64;
+		}
+		a0 = _mm_xor_si128(_mm_xor_si128(crc16_fold(a0, &crc_fold_k384),
+						  crc16_fold(a1, &crc_fold_k256)),
+				   _mm_xor_si128(crc16_fold(a2, &crc_fold_k128), a3));
+	}
+
+	while (len >= 16) {
+		a0 = _mm_xor_si128(crc16_fold(a0, &crc_fold_k128), _mm_loadu_si128((const __m128i *)data));
+		data += 16;
+		len -= 16;
+	}
+
+	/* The accumulator is congruent to the data folded so far; reduce it
+	 * with the table and then go on with the remaining tail */
+	_mm_storeu_si128((__m128i *)tmp, a0);
+	crc = crc16_slice8(0, tmp, sizeof(tmp));
+	return crc16_slice8(crc, data, len);
+}
+
+static bool crc16_clmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul");
+}
+
+#elif defined(__aarch64__)
+
+#define CRC16_CLMUL_TARGET __attribute__((target("+crypto")))
+
+CRC16_CLMUL_TARGET
+static inline uint64x2_t crc16_fold(uint64x2_t acc, const struct crc16_fold_k *k)
+{
+	poly128_t lo = vmull_p64((poly64_t)vgetq_lane_u64(acc, 0), (poly64_t)k->lo);
+	poly128_t hi = vmull_p64((poly64_t)vgetq_lane_u64(acc, 1), (poly64_t)k->hi);
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+CRC16_CLMUL_TARGET
+static inline uint64x2_t crc16_load(const uint8_t *data)
+{
+	return vreinterpretq_u64_u8(vld1q_u8(data));
+}
+
+CRC16_CLMUL_TARGET
+static uint16_t crc16_clmul(uint16_t crc, const uint8_t *data, size_t len)
+{
+	uint64x2_t a0, a1, a2, a3;
+	uint8_t tmp[16];
+
+	if (len < CRC16_CLMUL_MIN_LEN)
+		return crc16_slice8(crc, data, len);
+
+	/* Preset the shift register by xoring it into the first 2 bytes */
+	a0 = veorq_u64(crc16_load(data), vsetq_lane_u64((uint64_t)crc, vdupq_n_u64(0), 0));
+	data += 16;
+	len -= 16;
+
+	if (len >= 64) {
+		a1 = crc16_load(data + 0);
+		a2 = crc16_load(data + 16);
+		a3 = crc16_load(data + 32);
+		data += 48;
+		len -= 48;
+		while (len >= 64) {
+			a0 = veorq_u64(crc16_fold(a0, &crc_fold_k512), crc16_load(data + 0));
+			a1 = veorq_u64(crc16_fold(a1, &crc_fold_k512), crc16_load(data + 16));
+			a2 = veorq_u64(crc16_fold(a2, &crc_fold_k512), crc16_load(data + 32));
+			a3 = veorq_u64(crc16_fold(a3, &crc_fold_k512), crc16_load(data + 48));
+			data += 64;
+			len -= 64;
+		}
+		a0 = veorq_u64(veorq_u64(crc16_fold(a0, &crc_fold_k384),
+					 crc16_fold(a1, &crc_fold_k256)),
+			       veorq_u64(crc16_fold(a2, &crc_fold_k128), a3));
+	}
+
+	while (len >= 16) {
+		a0 = veorq_u64(crc16_fold(a0, &crc_fold_k128), crc16_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	vst1q_u8(tmp, vreinterpretq_u8_u64(a0));
+	crc = crc16_slice8(0, tmp, sizeof(tmp));
+	return crc16_slice8(crc, data, len);
+}
+
+static bool crc16_clmul_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+}
+
+#endif
+#endif /* HAVE_CRC16_CLMUL */
+
+int osmo_modbus_crc16_set_engine(enum osmo_modbus_crc16_engine engine)
+{
+	switch (engine) {
+	case OSMO_MODBUS_CRC16_ENGINE_AUTO:
+#ifdef HAVE_CRC16_CLMUL
+		if (crc16_clmul_supported())
+			return osmo_modbus_crc16_set_engine(OSMO_MODBUS_CRC16_ENGINE_CLMUL);
+#endif
+		return osmo_modbus_crc16_set_engine(OSMO_MODBUS_CRC16_ENGINE_SLICE8);
+	case OSMO_MODBUS_CRC16_ENGINE_SLICE8:
+		crc16_update_impl = crc16_slice8;
+		break;
+	case OSMO_MODBUS_CRC16_ENGINE_CLMUL:
+#ifdef HAVE_CRC16_CLMUL
+		if (!crc16_clmul_supported())
+			return -ENOTSUP;
+		crc16_update_impl = crc16_clmul;
+		break;
+#else
+		return -ENOTSUP;
+#endif
+	default:
+		return -EINVAL;
+	}
+	crc16_engine = engine;
+	return 0;
+}
+
+enum osmo_modbus_crc16_engine osmo_modbus_crc16_get_engine(void)
+{
+	return crc16_engine;
+}
+
+uint16_t osmo_modbus_crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	return crc16_update_impl(crc, data, len);
+}
+
+static __attribute__((constructor)) void crc16_init(void)
+{
+	unsigned int i, k;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC16_POLY_REFLECTED : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	for (k = 1; k < ARRAY_SIZE(crc_table); k++) {
+		for (i = 0; i < 256; i++)
+			crc_table[k][i] = crc16_byte(crc_table[k - 1][i], 0);
+	}
+
+#ifdef HAVE_CRC16_CLMUL
+	crc16_fold_k_init(&crc_fold_k128, 128);
+	crc16_fold_k_init(&crc_fold_k256, 256);
+	crc16_fold_k_init(&crc_fold_k384, 384);
+	crc16_fold_k_init(&crc_fold_k512, 512);
+#endif
+
+	osmo_modbus_crc16_set_engine(OSMO_MODBUS_CRC16_ENGINE_AUTO);
+}
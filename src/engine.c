@@ -0,0 +1,463 @@
+/*! \file engine.c
+ * Conns spread over several worker threads, each running a select loop */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/context.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/utils.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_engine.h>
+
+#include "modbus_internal.h"
+#include "mpsc_queue.h"
+
+enum engine_cmd_type {
+	ENGINE_CMD_ADD_BUS,
+	ENGINE_CMD_REMOVE_BUS,
+	ENGINE_CMD_STOP,
+};
+
+/* Sent by a control thread to a worker, which waits for it to be done */
+struct engine_cmd {
+	struct mpsc_node node;
+	enum engine_cmd_type type;
+	struct engine_bus *bus;
+	int rc;
+	bool done; /* protected by engine->lock */
+};
+
+struct engine_bus {
+	struct llist_head list; /* item in engine->buses, protected by engine->lock */
+	struct llist_head worker_entry; /* item in worker->buses, worker thread only */
+	char *name;
+	unsigned int worker;
+	bool ready; /* Set up by its worker, protected by engine->lock */
+	osmo_modbus_engine_bus_setup_cb setup_cb;
+	void *data;
+	struct osmo_modbus_conn *conn; /* Set by the worker thread */
+};
+
+struct engine_worker {
+	struct osmo_modbus_engine *engine; /* backpointer */
+	unsigned int idx;
+	int cpu; /* < 0: not pinned */
+	pthread_t thread;
+	bool started;
+	struct osmo_fd ofd; /* eventfd, written by control threads */
+	atomic_bool wake_pending;
+	struct mpsc_queue cmd_q; /* struct engine_cmd */
+	struct llist_head buses; /* struct engine_bus, worker thread only */
+	bool stop; /* worker thread only */
+	unsigned int num_buses; /* protected by engine->lock */
+};
+
+struct osmo_modbus_engine {
+	unsigned int num_workers;
+	struct engine_worker *workers;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t cmd_done;
+	/* osmo_fsm keeps a global list of instances per FSM: conns are only
+	 * allocated and freed by workers holding this lock */
+	pthread_mutex_t fsm_lock;
+	struct llist_head buses; /* struct engine_bus, protected by lock */
+};
+
+static __thread struct engine_worker *engine_current_worker;
+
+/* FNV-1a, spreading bus names evenly over the workers */
+static uint32_t engine_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct engine_bus *engine_bus_find(struct osmo_modbus_engine *engine, const char *name)
+{
+	struct engine_bus *bus;
+
+	llist_for_each_entry(bus, &engine->buses, list) {
+		if (strcmp(bus->name, name) == 0)
+			return bus;
+	}
+	return NULL;
+}
+
+static void engine_bus_free(struct engine_bus *bus)
+{
+	free(bus->name);
+	free(bus);
+}
+
+/* Worker thread */
+static void engine_bus_teardown(struct engine_bus *bus)
+{
+	llist_del(&bus->worker_entry);
+	osmo_modbus_conn_free(bus->conn);
+	bus->conn = NULL;
+}
+
+/* Worker thread. cmd belongs to the control thread, which may release it as
+ * soon as it is done. */
+static void engine_worker_cmd(struct engine_worker *w, struct engine_cmd *cmd)
+{
+	struct osmo_modbus_engine *engine = w->engine;
+	struct engine_bus *bus = cmd->bus, *tmp;
+	int rc = 0;
+
+	pthread_mutex_lock(&engine->fsm_lock);
+	switch (cmd->type) {
+	case ENGINE_CMD_ADD_BUS:
+		bus->conn = bus->setup_cb(OTC_GLOBAL, bus->name, bus->data);
+		if (bus->conn)
+			llist_add_tail(&bus->worker_entry, &w->buses);
+		else
+			rc = -EIO;
+		break;
+	case ENGINE_CMD_REMOVE_BUS:
+		engine_bus_teardown(bus);
+		break;
+	case ENGINE_CMD_STOP:
+		llist_for_each_entry_safe(bus, tmp, &w->buses, worker_entry)
+			engine_bus_teardown(bus);
+		w->stop = true;
+		break;
+	}
+	pthread_mutex_unlock(&engine->fsm_lock);
+
+	pthread_mutex_lock(&engine->lock);
+	cmd->rc = rc;
+	cmd->done = true;
+	pthread_cond_broadcast(&engine->cmd_done);
+	pthread_mutex_unlock(&engine->lock);
+}
+
+static int engine_worker_ofd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct engine_worker *w = (struct engine_worker *)ofd->data;
+	struct mpsc_node *node;
+	eventfd_t val;
+
+	eventfd_read(ofd->fd, &val);
+	atomic_store(&w->wake_pending, false);
+	while ((node = mpsc_pop(&w->cmd_q)))
+		engine_worker_cmd(w, container_of(node, struct engine_cmd, node));
+	return 0;
+}
+
+static void *engine_worker_main(void *arg)
+{
+	struct engine_worker *w = (struct engine_worker *)arg;
+	char name[16];
+
+	snprintf(name, sizeof(name), "modbus-w%u", w->idx);
+	pthread_setname_np(pthread_self(), name);
+	engine_current_worker = w;
+
+	/* Select loop and timers are per thread, so is their talloc context */
+	OSMO_ASSERT(osmo_ctx_init(name) == 0);
+	OSMO_ASSERT(osmo_fd_register(&w->ofd) == 0);
+
+	while (!w->stop)
+		osmo_select_main_ctx(0);
+
+	osmo_fd_unregister(&w->ofd);
+	talloc_free(osmo_ctx);
+	osmo_ctx = NULL;
+	return NULL;
+}
+
+/* Called with engine->lock held */
+static int engine_cmd_run(struct engine_worker *w, struct engine_cmd *cmd)
+{
+	struct osmo_modbus_engine *engine = w->engine;
+
+	mpsc_push(&w->cmd_q, &cmd->node);
+	if (!atomic_exchange(&w->wake_pending, true))
+		eventfd_write(w->ofd.fd, 1);
+	while (!cmd->done)
+		pthread_cond_wait(&engine->cmd_done, &engine->lock);
+	return cmd->rc;
+}
+
+static void engine_stop(struct osmo_modbus_engine *engine)
+{
+	struct engine_cmd cmd;
+	unsigned int i;
+
+	for (i = 0; i < engine->num_workers; i++) {
+		struct engine_worker *w = &engine->workers[i];
+
+		if (!w->started)
+			continue;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.type = ENGINE_CMD_STOP;
+		pthread_mutex_lock(&engine->lock);
+		engine_cmd_run(w, &cmd);
+		pthread_mutex_unlock(&engine->lock);
+		pthread_join(w->thread, NULL);
+		w->started = false;
+	}
+	engine->started = false;
+}
+
+struct osmo_modbus_engine *osmo_modbus_engine_alloc(void *ctx, unsigned int num_workers)
+{
+	struct osmo_modbus_engine *engine;
+	unsigned int i;
+	int fd;
+
+	if (num_workers == 0)
+		return NULL;
+
+	engine = talloc_zero(ctx, struct osmo_modbus_engine);
+	if (!engine)
+		return NULL;
+	engine->workers = talloc_zero_array(engine, struct engine_worker, num_workers);
+	if (!engine->workers)
+		goto err;
+	pthread_mutex_init(&engine->lock, NULL);
+	pthread_cond_init(&engine->cmd_done, NULL);
+	pthread_mutex_init(&engine->fsm_lock, NULL);
+	INIT_LLIST_HEAD(&engine->buses);
+
+	for (i = 0; i < num_workers; i++) {
+		struct engine_worker *w = &engine->workers[i];
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			goto err_fds;
+		w->engine = engine;
+		w->idx = i;
+		w->cpu = -1;
+		osmo_fd_setup(&w->ofd, fd, OSMO_FD_READ, engine_worker_ofd_cb, w, 0);
+		atomic_init(&w->wake_pending, false);
+		mpsc_init(&w->cmd_q);
+		INIT_LLIST_HEAD(&w->buses);
+		engine->num_workers++;
+	}
+	return engine;
+
+err_fds:
+	for (i = 0; i < engine->num_workers; i++)
+		close(engine->workers[i].ofd.fd);
+	pthread_mutex_destroy(&engine->lock);
+	pthread_cond_destroy(&engine->cmd_done);
+	pthread_mutex_destroy(&engine->fsm_lock);
+err:
+	talloc_free(engine);
+	return NULL;
+}
+
+void osmo_modbus_engine_free(struct osmo_modbus_engine *engine)
+{
+	struct engine_bus *bus, *tmp;
+	unsigned int i;
+
+	engine_stop(engine);
+
+	llist_for_each_entry_safe(bus, tmp, &engine->buses, list) {
+		llist_del(&bus->list);
+		engine_bus_free(bus);
+	}
+	for (i = 0; i < engine->num_workers; i++)
+		close(engine->workers[i].ofd.fd);
+	pthread_mutex_destroy(&engine->lock);
+	pthread_cond_destroy(&engine->cmd_done);
+	pthread_mutex_destroy(&engine->fsm_lock);
+	talloc_free(engine);
+}
+
+unsigned int osmo_modbus_engine_num_workers(const struct osmo_modbus_engine *engine)
+{
+	return engine->num_workers;
+}
+
+int osmo_modbus_engine_set_cpu(struct osmo_modbus_engine *engine, unsigned int worker, int cpu)
+{
+	if (worker >= engine->num_workers || cpu >= CPU_SETSIZE)
+		return -EINVAL;
+	if (engine->started)
+		return -EBUSY;
+	engine->workers[worker].cpu = cpu;
+	return 0;
+}
+
+int osmo_modbus_engine_start(struct osmo_modbus_engine *engine)
+{
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	unsigned int i;
+	int rc;
+
+	if (engine->started)
+		return -EALREADY;
+
+	for (i = 0; i < engine->num_workers; i++) {
+		struct engine_worker *w = &engine->workers[i];
+
+		pthread_attr_init(&attr);
+		if (w->cpu >= 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(w->cpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		w->stop = false;
+		rc = pthread_create(&w->thread, &attr, engine_worker_main, w);
+		pthread_attr_destroy(&attr);
+		if (rc != 0) {
+			LOGP(DLMODBUS, LOGL_ERROR, "Failed to start engine worker %u: %s\n", i, strerror(rc));
+			engine_stop(engine);
+			return -rc;
+		}
+		w->started = true;
+	}
+	engine->started = true;
+	return 0;
+}
+
+int osmo_modbus_engine_add_bus(struct osmo_modbus_engine *engine, const char *name, int worker,
+			       osmo_modbus_engine_bus_setup_cb setup_cb, void *data,
+			       struct osmo_modbus_conn **conn)
+{
+	struct engine_cmd cmd = { .type = ENGINE_CMD_ADD_BUS };
+	struct engine_bus *bus;
+	int rc;
+
+	if (engine_current_worker && engine_current_worker->engine == engine)
+		return -EDEADLK;
+	if (!name || !setup_cb || worker < OSMO_MODBUS_ENGINE_WORKER_HASH || worker >= (int)engine->num_workers)
+		return -EINVAL;
+	if (worker == OSMO_MODBUS_ENGINE_WORKER_HASH)
+		worker = engine_hash(name) % engine->num_workers;
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		return -ENOMEM;
+	bus->name = strdup(name);
+	if (!bus->name) {
+		free(bus);
+		return -ENOMEM;
+	}
+	bus->worker = worker;
+	bus->setup_cb = setup_cb;
+	bus->data = data;
+	INIT_LLIST_HEAD(&bus->worker_entry);
+
+	pthread_mutex_lock(&engine->lock);
+	if (!engine->started) {
+		rc = -ENOTCONN;
+		goto out_free;
+	}
+	if (engine_bus_find(engine, name)) {
+		rc = -EEXIST;
+		goto out_free;
+	}
+	/* Listed right away to reserve the name, but not ready until set up */
+	llist_add_tail(&bus->list, &engine->buses);
+	cmd.bus = bus;
+	rc = engine_cmd_run(&engine->workers[worker], &cmd);
+	if (rc < 0) {
+		llist_del(&bus->list);
+		goto out_free;
+	}
+	bus->ready = true;
+	engine->workers[worker].num_buses++;
+	if (conn)
+		*conn = bus->conn;
+	pthread_mutex_unlock(&engine->lock);
+	return worker;
+
+out_free:
+	pthread_mutex_unlock(&engine->lock);
+	engine_bus_free(bus);
+	return rc;
+}
+
+int osmo_modbus_engine_remove_bus(struct osmo_modbus_engine *engine, const char *name)
+{
+	struct engine_cmd cmd = { .type = ENGINE_CMD_REMOVE_BUS };
+	struct engine_bus *bus;
+
+	if (engine_current_worker && engine_current_worker->engine == engine)
+		return -EDEADLK;
+
+	pthread_mutex_lock(&engine->lock);
+	bus = engine_bus_find(engine, name);
+	if (!bus || !bus->ready) {
+		pthread_mutex_unlock(&engine->lock);
+		return -ENOENT;
+	}
+	llist_del(&bus->list);
+	cmd.bus = bus;
+	engine_cmd_run(&engine->workers[bus->worker], &cmd);
+	engine->workers[bus->worker].num_buses--;
+	pthread_mutex_unlock(&engine->lock);
+
+	engine_bus_free(bus);
+	return 0;
+}
+
+int osmo_modbus_engine_bus_worker(struct osmo_modbus_engine *engine, const char *name)
+{
+	struct engine_bus *bus;
+	int rc = -ENOENT;
+
+	pthread_mutex_lock(&engine->lock);
+	bus = engine_bus_find(engine, name);
+	if (bus && bus->ready)
+		rc = bus->worker;
+	pthread_mutex_unlock(&engine->lock);
+	return rc;
+}
+
+unsigned int osmo_modbus_engine_worker_num_buses(struct osmo_modbus_engine *engine, unsigned int worker)
+{
+	unsigned int num;
+
+	if (worker >= engine->num_workers)
+		return 0;
+	pthread_mutex_lock(&engine->lock);
+	num = engine->workers[worker].num_buses;
+	pthread_mutex_unlock(&engine->lock);
+	return num;
+}
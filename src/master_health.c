@@ -0,0 +1,172 @@
+/*! \file master_health.c
+ * Request retries and quarantine of slaves not answering */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <osmocom/core/timer.h>
+#include <osmocom/core/tdef.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+
+#include <osmocom/modbus/modbus.h>
+
+#include "modbus_internal.h"
+
+static void master_health_schedule_probe(struct master_health *h)
+{
+	struct timespec interval = {
+		.tv_sec = h->probe_interval_ms / 1000,
+		.tv_nsec = (h->probe_interval_ms % 1000) * 1000000,
+	};
+	struct timespec now;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecadd(&now, &interval, &h->next_probe);
+}
+
+/* May a request to address be sent now? Requests to a quarantined slave
+ * aren't, except one probe per probe interval. */
+bool master_health_tx_allowed(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+	struct master_health *h;
+	struct timespec now;
+
+	if (!sq || !sq->health.quarantined)
+		return true;
+	h = &sq->health;
+	if (h->probing)
+		return false;
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespeccmp(&now, &h->next_probe, <))
+		return false;
+
+	LOGP(DLMODBUS, LOGL_INFO, "(addr=%" PRIu16 ") Probing quarantined slave\n", address);
+	h->probing = true;
+	h->probes++;
+	return true;
+}
+
+/* address answered, be it in time or not */
+void master_health_reply(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+
+	if (!sq)
+		return;
+	if (sq->health.quarantined)
+		LOGP(DLMODBUS, LOGL_NOTICE, "(addr=%" PRIu16 ") Slave answered, leaving quarantine\n", address);
+	sq->health.consecutive_timeouts = 0;
+	sq->health.quarantined = false;
+	sq->health.probing = false;
+}
+
+/* Account the timeout of trans. Returns true if its request is to be resent. */
+bool master_health_timeout(struct osmo_modbus_conn *conn, const struct master_trans *trans)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, trans->address);
+	struct master_req_cb *rcb = MASTER_REQ_CB(trans->req_msg);
+	struct master_health *h;
+	unsigned long max_ms;
+
+	if (!sq)
+		return false;
+	h = &sq->health;
+	h->consecutive_timeouts++;
+
+	if (h->probing) {
+		/* Still not answering: probe less and less often */
+		max_ms = osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_QUARANTINE_PROBE_MAX, OSMO_TDEF_MS, -1);
+		h->probing = false;
+		h->probe_interval_ms = OSMO_MIN(h->probe_interval_ms * 2, max_ms);
+		master_health_schedule_probe(h);
+		return false;
+	}
+	/* eg. another request in flight when it entered quarantine */
+	if (h->quarantined)
+		return false;
+
+	if (conn->master.quarantine_threshold &&
+	    h->consecutive_timeouts >= conn->master.quarantine_threshold) {
+		LOGP(DLMODBUS, LOGL_NOTICE, "(addr=%" PRIu16 ") %u timeouts in a row, quarantining slave\n",
+		     trans->address, h->consecutive_timeouts);
+		h->quarantined = true;
+		h->quarantines++;
+		h->probe_interval_ms = osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_QUARANTINE_PROBE, OSMO_TDEF_MS, -1);
+		master_health_schedule_probe(h);
+		return false;
+	}
+
+	if (rcb->retries < conn->master.max_retries) {
+		rcb->retries++;
+		h->retries++;
+		return true;
+	}
+	return false;
+}
+
+bool master_health_quarantined(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+
+	return sq && sq->health.quarantined;
+}
+
+int osmo_modbus_conn_set_retries(struct osmo_modbus_conn *conn, unsigned int num)
+{
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER || num > UINT8_MAX)
+		return -EINVAL;
+	conn->master.max_retries = num;
+	return 0;
+}
+
+int osmo_modbus_conn_set_quarantine(struct osmo_modbus_conn *conn, unsigned int num_timeouts)
+{
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER)
+		return -EINVAL;
+	conn->master.quarantine_threshold = num_timeouts;
+	return 0;
+}
+
+int osmo_modbus_conn_get_health_stats(struct osmo_modbus_conn *conn, uint16_t address,
+				      struct osmo_modbus_conn_health_stats *stats)
+{
+	struct master_slave_queue *sq;
+
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER)
+		return -EINVAL;
+	sq = master_sched_slave_find(conn, address);
+	if (!sq)
+		return -ENOENT;
+
+	stats->quarantined = sq->health.quarantined;
+	stats->consecutive_timeouts = sq->health.consecutive_timeouts;
+	stats->retries = sq->health.retries;
+	stats->failed_fast = sq->health.failed_fast;
+	stats->probes = sq->health.probes;
+	stats->quarantines = sq->health.quarantines;
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*! \file master_rtt.c
+ * Per-slave round-trip time estimation and adaptive response timeouts */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include <osmocom/core/timer.h>
+#include <osmocom/core/tdef.h>
+#include <osmocom/core/logging.h>
+
+#include <osmocom/modbus/modbus.h>
+
+#include "modbus_internal.h"
+
+/* The timeout doubles at most this many times in a row (bounded by
+ * OSMO_MODBUS_TO_NORESPONSE_MAX anyway) */
+#define MASTER_RTT_BACKOFF_MAX 8
+
+static uint32_t master_rtt_elapsed_us(const struct timespec *since)
+{
+	struct timespec now, diff;
+	uint64_t us;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, since, &diff);
+	us = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+	return us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static void master_rtt_sample(struct master_rtt *rtt, uint16_t address, uint32_t r_us)
+{
+	int64_t delta, err;
+
+	if (!rtt->valid) {
+		rtt->srtt_us = r_us;
+		rtt->rttvar_us = r_us / 2;
+		rtt->valid = true;
+	} else {
+		/* rttvar += (|err| - rttvar) / 4, srtt += err / 8 */
+		err = (int64_t)r_us - rtt->srtt_us;
+		delta = ((err < 0 ? -err : err) - (int64_t)rtt->rttvar_us) / 4;
+		rtt->rttvar_us = (int64_t)rtt->rttvar_us + delta;
+		rtt->srtt_us = (int64_t)rtt->srtt_us + err / 8;
+	}
+	rtt->backoff = 0;
+	rtt->late_pending = false;
+	rtt->samples++;
+	LOGP(DLMODBUS, LOGL_DEBUG, "(addr=%" PRIu16 ") RTT %" PRIu32 "us: srtt=%" PRIu32 "us rttvar=%" PRIu32 "us\n",
+	     address, r_us, rtt->srtt_us, rtt->rttvar_us);
+}
+
+/* Response timeout of the next request sent to address */
+unsigned long master_rtt_timeout_us(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq;
+	unsigned long min_us, max_us;
+	uint64_t timeout_us;
+
+	sq = master_sched_slave_find(conn, address);
+	if (!conn->master.adaptive_timeout || !sq || !sq->rtt.valid)
+		return osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_NORESPONSE, OSMO_TDEF_MS, -1) * 1000;
+
+	min_us = osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_NORESPONSE_MIN, OSMO_TDEF_MS, -1) * 1000;
+	max_us = osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_NORESPONSE_MAX, OSMO_TDEF_MS, -1) * 1000;
+	timeout_us = ((uint64_t)sq->rtt.srtt_us + 4 * (uint64_t)sq->rtt.rttvar_us) << sq->rtt.backoff;
+	if (timeout_us < min_us)
+		timeout_us = min_us;
+	if (timeout_us > max_us)
+		timeout_us = max_us;
+	return timeout_us;
+}
+
+void master_rtt_reply(struct osmo_modbus_conn *conn, const struct master_trans *trans)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, trans->address);
+
+	if (!sq)
+		return;
+	/* Without Transaction Id (RTU), the late reply to the request which
+	 * timed out can't be told from the reply to this one, sent after it */
+	if (!conn->proto_ops.has_trans_id && sq->rtt.late_pending) {
+		sq->rtt.late_pending = false;
+		return;
+	}
+	/* A resent request can't tell which of its transmissions was answered
+	 * (Karn's algorithm) */
+	if (MASTER_REQ_CB(trans->req_msg)->retries == 0)
+		master_rtt_sample(&sq->rtt, trans->address, master_rtt_elapsed_us(&trans->sent));
+}
+
+/* No sample is taken, the slave may just be slower than the current
+ * estimate: back off until it answers in time again, and remember the request
+ * to learn from its reply if it still comes. */
+void master_rtt_timeout(struct osmo_modbus_conn *conn, const struct master_trans *trans)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, trans->address);
+
+	if (!sq)
+		return;
+	sq->rtt.timeouts++;
+	if (sq->rtt.backoff < MASTER_RTT_BACKOFF_MAX)
+		sq->rtt.backoff++;
+	sq->rtt.late_pending = true;
+	sq->rtt.late_trans_id = trans->trans_id;
+	sq->rtt.late_sent = trans->sent;
+}
+
+/* prim matched no request in flight (possibly with none in flight at all): it
+ * may be the late reply to the last request of that slave which timed out */
+void master_rtt_late_reply(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *prim)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, prim->address);
+	unsigned long max_us;
+	uint32_t r_us;
+
+	if (!sq || !sq->rtt.late_pending)
+		return;
+	if (conn->proto_ops.has_trans_id && prim->trans_id != sq->rtt.late_trans_id)
+		return;
+
+	r_us = master_rtt_elapsed_us(&sq->rtt.late_sent);
+	max_us = osmo_tdef_get(conn->T_defs, OSMO_MODBUS_TO_NORESPONSE_MAX, OSMO_TDEF_MS, -1) * 1000;
+	sq->rtt.late_pending = false;
+	/* Beyond the max timeout it wouldn't be waited for anyway */
+	if (r_us <= max_us)
+		master_rtt_sample(&sq->rtt, prim->address, r_us);
+}
+
+int osmo_modbus_conn_set_adaptive_timeout(struct osmo_modbus_conn *conn, bool enable)
+{
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER)
+		return -EINVAL;
+	conn->master.adaptive_timeout = enable;
+	return 0;
+}
+
+int osmo_modbus_conn_get_rtt_stats(struct osmo_modbus_conn *conn, uint16_t address,
+				   struct osmo_modbus_conn_rtt_stats *stats)
+{
+	struct master_slave_queue *sq;
+
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER)
+		return -EINVAL;
+	sq = master_sched_slave_find(conn, address);
+	if (!sq)
+		return -ENOENT;
+
+	stats->valid = sq->rtt.valid;
+	stats->srtt_us = sq->rtt.srtt_us;
+	stats->rttvar_us = sq->rtt.rttvar_us;
+	stats->timeout_us = master_rtt_timeout_us(conn, address);
+	stats->samples = sq->rtt.samples;
+	stats->timeouts = sq->rtt.timeouts;
+	return 0;
+}
@@ -0,0 +1,179 @@
+/*! \file master_sched.c
+ * Scheduling of requests queued by a modbus master */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <errno.h>
+
+#include <inttypes.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/linuxlist.h>
+
+#include <osmocom/modbus/modbus.h>
+
+#include "modbus_internal.h"
+
+struct master_slave_queue *master_sched_slave_find(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq;
+
+	llist_for_each_entry(sq, &conn->master.slave_queues, list) {
+		if (sq->address == address)
+			return sq;
+	}
+	return NULL;
+}
+
+static struct master_slave_queue *master_slave_queue_get(struct osmo_modbus_conn *conn, uint16_t address)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+	unsigned int i;
+
+	if (sq)
+		return sq;
+
+	sq = talloc_zero(conn, struct master_slave_queue);
+	sq->address = address;
+	for (i = 0; i < ARRAY_SIZE(sq->lane); i++)
+		INIT_LLIST_HEAD(&sq->lane[i]);
+	llist_add_tail(&sq->list, &conn->master.slave_queues);
+	return sq;
+}
+
+void master_sched_enqueue(struct osmo_modbus_conn *conn, struct msgb *msg, enum osmo_modbus_prio prio)
+{
+	struct osmo_modbus_prim *prim = (struct osmo_modbus_prim *)msgb_data(msg);
+	struct master_slave_queue *sq = master_slave_queue_get(conn, prim->address);
+
+	MASTER_REQ_CB(msg)->prio = prio;
+	msgb_enqueue(&sq->lane[prio], msg);
+	conn->master.num_queued++;
+}
+
+/* Put back a request which was dequeued, ahead of the others of its slave */
+void master_sched_requeue(struct osmo_modbus_conn *conn, struct msgb *msg)
+{
+	struct osmo_modbus_prim *prim = (struct osmo_modbus_prim *)msgb_data(msg);
+	struct master_slave_queue *sq = master_slave_queue_get(conn, prim->address);
+
+	llist_add(&msg->list, &sq->lane[MASTER_REQ_CB(msg)->prio]);
+	conn->master.num_queued++;
+}
+
+/* Move all requests queued for address to out, highest priority first */
+void master_sched_take_slave(struct osmo_modbus_conn *conn, uint16_t address, struct llist_head *out)
+{
+	struct master_slave_queue *sq = master_sched_slave_find(conn, address);
+	struct msgb *msg;
+	unsigned int i;
+
+	if (!sq)
+		return;
+	for (i = 0; i < ARRAY_SIZE(sq->lane); i++) {
+		while ((msg = msgb_dequeue(&sq->lane[i]))) {
+			msgb_enqueue(out, msg);
+			conn->master.num_queued--;
+		}
+	}
+}
+
+/* Find the next request to send: the highest priority class with anything
+ * queued wins. Within it, the first slave in the list having a request is
+ * served. */
+static struct master_slave_queue *master_sched_next(struct osmo_modbus_conn *conn, unsigned int *prio)
+{
+	struct master_slave_queue *sq;
+
+	for (*prio = 0; *prio < _NUM_OSMO_MODBUS_PRIO; (*prio)++) {
+		llist_for_each_entry(sq, &conn->master.slave_queues, list) {
+			if (!llist_empty(&sq->lane[*prio]))
+				return sq;
+		}
+	}
+	OSMO_ASSERT(0);
+}
+
+/* Next request to be returned by master_sched_dequeue(), left queued */
+struct msgb *master_sched_peek(struct osmo_modbus_conn *conn)
+{
+	struct master_slave_queue *sq;
+	unsigned int prio;
+
+	if (conn->master.num_queued == 0)
+		return NULL;
+	sq = master_sched_next(conn, &prio);
+	return llist_first_entry(&sq->lane[prio], struct msgb, list);
+}
+
+/* Pick the next request to send, its slave is then moved to the end of the
+ * list (round-robin). */
+struct msgb *master_sched_dequeue(struct osmo_modbus_conn *conn)
+{
+	struct master_slave_queue *sq;
+	unsigned int prio;
+
+	if (conn->master.num_queued == 0)
+		return NULL;
+
+	sq = master_sched_next(conn, &prio);
+	llist_move_tail(&sq->list, &conn->master.slave_queues);
+	conn->master.num_queued--;
+	return msgb_dequeue(&sq->lane[prio]);
+}
+
+void master_sched_flush(struct osmo_modbus_conn *conn)
+{
+	struct master_slave_queue *sq, *sq2;
+	struct msgb *msg;
+	unsigned int i;
+
+	llist_for_each_entry_safe(sq, sq2, &conn->master.slave_queues, list) {
+		for (i = 0; i < ARRAY_SIZE(sq->lane); i++) {
+			while ((msg = msgb_dequeue(&sq->lane[i])))
+				modbus_msgb_pool_put(conn->prim_pool, msg);
+		}
+		llist_del(&sq->list);
+		talloc_free(sq);
+	}
+	conn->master.num_queued = 0;
+}
+
+/* Drop queued requests whose reply was meant for the internal consumer cb_data */
+void master_sched_drop(struct osmo_modbus_conn *conn, void *cb_data)
+{
+	struct master_slave_queue *sq;
+	struct msgb *msg, *msg2;
+	unsigned int i;
+
+	llist_for_each_entry(sq, &conn->master.slave_queues, list) {
+		for (i = 0; i < ARRAY_SIZE(sq->lane); i++) {
+			llist_for_each_entry_safe(msg, msg2, &sq->lane[i], list) {
+				if (!MASTER_REQ_CB(msg)->cb || MASTER_REQ_CB(msg)->data != cb_data)
+					continue;
+				llist_del(&msg->list);
+				modbus_msgb_pool_put(conn->prim_pool, msg);
+				conn->master.num_queued--;
+			}
+		}
+	}
+}
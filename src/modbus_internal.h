@@ -1,33 +1,64 @@
 #pragma once
 
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/timer.h>
+
 #include <osmocom/modbus/modbus.h>
 
-#define MODBUS_MSGB_SIZE 256
+#include "msgb_pool.h"
+#include "timer_wheel.h"
+
+/* Max ADU: RTU 256 bytes, TCP 260 bytes */
+#define MODBUS_MSGB_SIZE 260
 
 enum {
 	DLMODBUS_OFFSET,
 	DLMODBUS_RTU_OFFSET,
 };
 
+/* Timer of a conn: runs on the group wheel if the conn is in a bus group,
+ * on the osmo_timer list otherwise */
+struct conn_timer {
+	struct osmo_timer_list timer;
+	struct modbus_twheel_timer wheel_timer;
+};
+
 struct osmo_modbus_conn {
 	enum osmo_modbus_conn_role role;
 	enum osmo_modbus_proto_type proto_type;
 	uint16_t address;
 	osmo_modbus_prim_cb prim_cb;
 	void *prim_cb_ctx;
-	struct llist_head msg_queue;
+	struct llist_head msg_queue; /* slave: responses submitted by the app */
 
 	/* role: master or slave */
 	union {
 		struct {
-			uint16_t req_for_addr; /* Address of request tgt in progress */
+			struct llist_head slave_queues; /* struct master_slave_queue, requests not sent yet */
+			unsigned int num_queued;
+			struct llist_head inflight; /* struct master_trans, requests sent awaiting a reply */
+			unsigned int num_inflight;
+			uint16_t next_trans_id;
+			bool adaptive_timeout; /* Response timeout from the slave RTT */
+			unsigned int max_retries; /* Resends of a request timing out */
+			unsigned int quarantine_threshold; /* Consecutive timeouts, 0: disabled */
+			struct llist_head failed; /* struct msgb, requests failed fast awaiting delivery */
+			struct conn_timer fail_timer; /* Delivers them from the main loop */
+			struct conn_timer turnaround_timer; /* Ends WAIT_TURNAROUND_DELAY */
 		} master;
 		struct {
 			bool monitor; /* Is monitor mode enabled ? */
+			uint16_t req_trans_id; /* Transaction Id of request being answered */
+			struct osmo_modbus_reg_store *reg_store; /* NULL if none attached */
 		} slave;
 	};
 	struct osmo_tdef *T_defs;
 	struct osmo_fsm_inst *fi;
+	struct modbus_msgb_pool *prim_pool; /* struct osmo_modbus_prim */
+	struct modbus_msgb_pool *frame_pool; /* ADUs of MODBUS_MSGB_SIZE */
+	struct osmo_modbus_bus_group *group; /* NULL if none */
+	struct llist_head group_entry; /* item in group->conns */
+	struct conn_mt *mt; /* NULL unless osmo_modbus_conn_mt_enable() */
 
 	/* proto private data + specific operations */
 	void *proto;
@@ -35,8 +66,146 @@ struct osmo_modbus_conn {
 		int (*connect)(struct osmo_modbus_conn* conn);
 		bool (*is_connected)(struct osmo_modbus_conn* conn);
 		int (*tx_prim)(struct osmo_modbus_conn* conn, struct osmo_modbus_prim *prim);
+		/* Max requests the master may have awaiting a reply at once */
+		unsigned int (*max_inflight)(struct osmo_modbus_conn* conn);
 		void (*free)(struct osmo_modbus_conn* conn);
+		bool has_trans_id; /* Replies carry the Transaction Id of their request */
 	} proto_ops;
 };
 
+struct osmo_modbus_bus_group {
+	struct llist_head conns; /* struct osmo_modbus_conn */
+	unsigned int num_conns;
+	struct modbus_twheel wheel;
+};
+
+void conn_timer_setup(struct osmo_modbus_conn *conn, struct conn_timer *timer,
+		      void (*cb)(void *data), void *data);
+void conn_timer_schedule(struct conn_timer *timer, unsigned long timeout_us);
+void conn_timer_del(struct conn_timer *timer);
+bool conn_timer_pending(const struct conn_timer *timer);
+void bus_group_remove(struct osmo_modbus_conn *conn);
+
+void conn_mt_free(struct osmo_modbus_conn *conn);
+
+/* A request sent by the master, awaiting its reply */
+struct master_trans {
+	struct llist_head list; /* item in conn->master.inflight */
+	struct osmo_modbus_conn *conn; /* backpointer */
+	uint16_t trans_id;
+	uint16_t address;
+	struct msgb *req_msg; /* request sent, see MASTER_REQ_CB() */
+	struct conn_timer timer; /* OSMO_MODBUS_TO_NORESPONSE */
+	struct timespec sent; /* CLOCK_MONOTONIC */
+};
+
+/* Library-internal consumer of the reply to a master request. resp (reply or
+ * timeout) is owned by the callback. */
+typedef void (*master_req_cb_t)(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *req,
+				struct osmo_modbus_prim *resp, void *data);
+struct master_req_cb {
+	master_req_cb_t cb; /* NULL: reply goes to conn->prim_cb */
+	void *data;
+	uint8_t prio; /* enum osmo_modbus_prio, set when queued */
+	uint8_t retries; /* Times resent after a timeout */
+};
+/* Stored in the control buffer of the request msgb */
+#define MASTER_REQ_CB(msg) ((struct master_req_cb *)&(msg)->cb[0])
+
+int conn_master_submit_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim,
+			  enum osmo_modbus_prio prio, master_req_cb_t cb, void *data);
+void conn_master_cancel_cb(struct osmo_modbus_conn *conn, void *data);
+
+/* Round-trip time estimator of a slave: smoothed mean and mean deviation
+ * (Jacobson/Karels, as in RFC 6298) */
+struct master_rtt {
+	bool valid; /* At least one sample */
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	uint8_t backoff; /* Consecutive timeouts, each doubling the timeout */
+	unsigned long samples;
+	unsigned long timeouts;
+	/* Last request that timed out: its reply may still arrive late */
+	bool late_pending;
+	uint16_t late_trans_id;
+	struct timespec late_sent;
+};
+
+/* Liveness of a slave, see osmo_modbus_conn_set_quarantine() */
+struct master_health {
+	unsigned int consecutive_timeouts;
+	bool quarantined;
+	bool probing; /* Probe request in flight */
+	unsigned long probe_interval_ms;
+	struct timespec next_probe; /* CLOCK_MONOTONIC */
+	unsigned long retries;
+	unsigned long failed_fast;
+	unsigned long probes;
+	unsigned long quarantines;
+};
+
+/* Requests queued by the master for one slave address, one FIFO per priority,
+ * plus what is known about the slave. Kept until the conn is freed. */
+struct master_slave_queue {
+	struct llist_head list; /* item in conn->master.slave_queues */
+	uint16_t address;
+	struct llist_head lane[_NUM_OSMO_MODBUS_PRIO]; /* struct msgb */
+	struct master_rtt rtt;
+	struct master_health health;
+};
+
+void master_sched_enqueue(struct osmo_modbus_conn *conn, struct msgb *msg, enum osmo_modbus_prio prio);
+struct msgb *master_sched_peek(struct osmo_modbus_conn *conn);
+struct msgb *master_sched_dequeue(struct osmo_modbus_conn *conn);
+void master_sched_flush(struct osmo_modbus_conn *conn);
+void master_sched_drop(struct osmo_modbus_conn *conn, void *cb_data);
+void master_sched_requeue(struct osmo_modbus_conn *conn, struct msgb *msg);
+void master_sched_take_slave(struct osmo_modbus_conn *conn, uint16_t address, struct llist_head *out);
+struct master_slave_queue *master_sched_slave_find(struct osmo_modbus_conn *conn, uint16_t address);
+
+unsigned long master_rtt_timeout_us(struct osmo_modbus_conn *conn, uint16_t address);
+void master_rtt_reply(struct osmo_modbus_conn *conn, const struct master_trans *trans);
+void master_rtt_timeout(struct osmo_modbus_conn *conn, const struct master_trans *trans);
+void master_rtt_late_reply(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *prim);
+
+bool master_health_tx_allowed(struct osmo_modbus_conn *conn, uint16_t address);
+void master_health_reply(struct osmo_modbus_conn *conn, uint16_t address);
+bool master_health_timeout(struct osmo_modbus_conn *conn, const struct master_trans *trans);
+bool master_health_quarantined(struct osmo_modbus_conn *conn, uint16_t address);
+
+int reg_store_read_raw(const struct osmo_modbus_reg_store *store, uint16_t first_reg,
+		       unsigned int num_reg, uint16_t *registers);
+int reg_store_write_raw(struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			unsigned int num_reg, const uint16_t *registers);
+
+/* pool can be NULL to allocate from the heap. Register values are raw (big
+ * endian) bytes, as found in PDUs: they are copied, never accessed in place. */
+struct osmo_modbus_prim *modbus_makeprim_timeout_resp(struct modbus_msgb_pool *pool, uint16_t address);
+struct osmo_modbus_prim *modbus_makeprim_mult_hold_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							   uint16_t first_reg, uint16_t num_reg);
+struct osmo_modbus_prim *modbus_makeprim_mult_hold_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							    uint8_t num_reg, const uint8_t *registers);
+struct osmo_modbus_prim *modbus_makeprim_write_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							    uint16_t first_reg, uint16_t num_reg,
+							    const uint8_t *registers);
+struct osmo_modbus_prim *modbus_makeprim_write_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							     uint16_t first_reg, uint16_t num_reg);
+struct osmo_modbus_prim *modbus_makeprim_rw_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							 uint16_t read_first_reg, uint16_t read_num_reg,
+							 uint16_t write_first_reg, uint16_t write_num_reg,
+							 const uint8_t *registers);
+struct osmo_modbus_prim *modbus_makeprim_rw_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							  uint8_t num_reg, const uint8_t *registers);
+struct osmo_modbus_prim *modbus_makeprim_read_bits_req(struct modbus_msgb_pool *pool, unsigned int primitive,
+						       uint16_t address, uint16_t first_bit, uint16_t num_bits);
+struct osmo_modbus_prim *modbus_makeprim_read_bits_resp(struct modbus_msgb_pool *pool, unsigned int primitive,
+							uint16_t address, uint8_t byte_count, const uint8_t *bits);
+struct osmo_modbus_prim *modbus_makeprim_write_mult_coils_req(struct modbus_msgb_pool *pool, uint16_t address,
+							      uint16_t first_coil, uint16_t num_coils,
+							      const uint8_t *bits);
+struct osmo_modbus_prim *modbus_makeprim_write_mult_coils_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							       uint16_t first_coil, uint16_t num_coils);
+struct osmo_modbus_prim *modbus_makeprim_exception_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							 uint8_t function_code, uint8_t exception_code);
+
 void osmo_modbus_conn_rx_prim(struct osmo_modbus_conn* conn, struct osmo_modbus_prim *prim);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/* Intrusive lock-free multi-producer single-consumer queue (D. Vyukov).
+ * mpsc_push() may be called from any thread, mpsc_pop() only from the
+ * consumer one. A pop racing with a push may miss the item being pushed and
+ * return NULL: producers wake the consumer once their push is done, so that
+ * it gets the item on its next round. */
+struct mpsc_node {
+	_Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+	_Atomic(struct mpsc_node *) head; /* Last pushed, producers side */
+	struct mpsc_node *tail; /* Next to pop, consumer side */
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc_queue *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange(&q->head, node);
+	/* Between the exchange and this store, the queue is cut in two */
+	atomic_store(&prev->next, node);
+}
+
+static inline struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = atomic_load(&tail->next);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = atomic_load(&next->next);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	/* tail is the last item, unless a push is in progress */
+	if (tail != atomic_load(&q->head))
+		return NULL;
+	/* Put the stub back behind it, so that tail can be handed out */
+	mpsc_push(q, &q->stub);
+	next = atomic_load(&tail->next);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
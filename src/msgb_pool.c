@@ -0,0 +1,97 @@
+/*! \file msgb_pool.c
+ * Pool of recycled msgbs */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <errno.h>
+
+#include <string.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/context.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/linuxlist.h>
+
+#include "msgb_pool.h"
+
+struct modbus_msgb_pool *modbus_msgb_pool_alloc(void *ctx, const char *name, uint16_t msg_size)
+{
+	struct modbus_msgb_pool *pool = talloc_zero(ctx, struct modbus_msgb_pool);
+
+	pool->name = name;
+	pool->msg_size = msg_size;
+	INIT_LLIST_HEAD(&pool->free_list);
+	return pool;
+}
+
+void modbus_msgb_pool_free(struct modbus_msgb_pool *pool)
+{
+	modbus_msgb_pool_set_size(pool, 0);
+	talloc_free(pool);
+}
+
+/* Keep up to max_free msgbs, preallocating them */
+void modbus_msgb_pool_set_size(struct modbus_msgb_pool *pool, unsigned int max_free)
+{
+	struct msgb *msg;
+
+	pool->max_free = max_free;
+	while (pool->num_free > max_free) {
+		msg = msgb_dequeue(&pool->free_list);
+		msgb_free(msg);
+		pool->num_free--;
+	}
+	while (pool->num_free < max_free) {
+		msg = msgb_alloc_c(OTC_GLOBAL, pool->msg_size, pool->name);
+		msgb_enqueue(&pool->free_list, msg);
+		pool->num_free++;
+	}
+}
+
+struct msgb *modbus_msgb_pool_get(struct modbus_msgb_pool *pool)
+{
+	struct msgb *msg = msgb_dequeue(&pool->free_list);
+
+	if (!msg) {
+		pool->misses++;
+		return msgb_alloc_c(OTC_GLOBAL, pool->msg_size, pool->name);
+	}
+
+	pool->hits++;
+	pool->num_free--;
+	msgb_reset(msg);
+	msg->dst = NULL;
+	memset(msg->cb, 0, sizeof(msg->cb));
+	return msg;
+}
+
+/* Release msg, which is recycled if it fits in the pool */
+void modbus_msgb_pool_put(struct modbus_msgb_pool *pool, struct msgb *msg)
+{
+	if (!msg)
+		return;
+	if (msg->data_len != pool->msg_size || pool->num_free >= pool->max_free) {
+		msgb_free(msg);
+		return;
+	}
+	msgb_enqueue(&pool->free_list, msg);
+	pool->num_free++;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/linuxlist.h>
+
+/* Freelist of equally sized msgbs, to avoid going through the allocator for
+ * each message in the hot path. msgbs taken from the pool are regular ones: if
+ * they end up being freed with msgb_free() (eg. by the app) they are simply
+ * not recycled. */
+struct modbus_msgb_pool {
+	const char *name;
+	uint16_t msg_size;
+	unsigned int max_free; /* Max msgbs kept in free_list, 0 disables pooling */
+	unsigned int num_free;
+	struct llist_head free_list;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+struct modbus_msgb_pool *modbus_msgb_pool_alloc(void *ctx, const char *name, uint16_t msg_size);
+void modbus_msgb_pool_free(struct modbus_msgb_pool *pool);
+void modbus_msgb_pool_set_size(struct modbus_msgb_pool *pool, unsigned int max_free);
+struct msgb *modbus_msgb_pool_get(struct modbus_msgb_pool *pool);
+void modbus_msgb_pool_put(struct modbus_msgb_pool *pool, struct msgb *msg);
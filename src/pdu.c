@@ -0,0 +1,541 @@
+/*! \file pdu.c
+ * modbus PDU (function code + data) encoding and decoding */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* https://www.modbus.org/docs/Modbus_Application_Protocol_V1_1b3.pdf */
+
+#include <errno.h>
+#include <string.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/bits.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_prim.h>
+
+#include "modbus_internal.h"
+#include "pdu_internal.h"
+
+#define X(x)	(1 << (x))
+
+/* 0x01 Read Coils, 0x02 Read Discrete Inputs */
+static unsigned int read_bits_primitive(uint8_t func_code)
+{
+	if (func_code == OSMO_MODBUS_FUNC_READ_COILS)
+		return OSMO_MODBUS_PRIM_N_READ_COILS;
+	return OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS;
+}
+
+static int decode_read_bits_req(struct modbus_msgb_pool *pool, uint16_t address,
+				const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_bit = osmo_load16be(&pdu[1]);
+	uint16_t num_bits = osmo_load16be(&pdu[3]);
+	if (num_bits < 1 || num_bits > OSMO_MODBUS_READ_BITS_MAX)
+		return -EINVAL;
+	*prim = modbus_makeprim_read_bits_req(pool, read_bits_primitive(pdu[0]), address, first_bit, num_bits);
+	return 0;
+}
+
+static void encode_read_bits_req(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	msgb_put_u16(msg, prim->u.read_coils_req.first_bit);
+	msgb_put_u16(msg, prim->u.read_coils_req.num_bits);
+}
+
+static int decode_read_bits_resp(struct modbus_msgb_pool *pool, uint16_t address,
+				 const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint8_t byte_count = pdu[1];
+	if (byte_count < 1 || byte_count > OSMO_MODBUS_BITS_BYTES(OSMO_MODBUS_READ_BITS_MAX))
+		return -EINVAL;
+	*prim = modbus_makeprim_read_bits_resp(pool, read_bits_primitive(pdu[0]), address, byte_count, &pdu[2]);
+	return 0;
+}
+
+static void encode_read_bits_resp(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	uint8_t byte_count = prim->u.read_coils_resp.byte_count;
+	msgb_put_u8(msg, byte_count);
+	memcpy(msgb_put(msg, byte_count), prim->u.read_coils_resp.bits, byte_count);
+}
+
+/* 0x03 Read Holding Registers */
+static int decode_read_mult_hold_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+					 const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_reg = osmo_load16be(&pdu[1]);
+	uint16_t num_reg = osmo_load16be(&pdu[3]);
+	if (num_reg < 1 || num_reg > 125)
+		return -EINVAL;
+	*prim = modbus_makeprim_mult_hold_reg_req(pool, address, first_reg, num_reg);
+	return 0;
+}
+
+static void encode_read_mult_hold_reg_req(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	msgb_put_u16(msg, prim->u.read_mult_hold_reg_req.first_reg);
+	msgb_put_u16(msg, prim->u.read_mult_hold_reg_req.num_reg);
+}
+
+static int decode_read_mult_hold_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+					  const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint8_t byte_count = pdu[1];
+	/* At most 125 registers, more wouldn't even fit in the prim */
+	if (byte_count % 2 || byte_count > 250)
+		return -EINVAL;
+	*prim = modbus_makeprim_mult_hold_reg_resp(pool, address, byte_count / 2, &pdu[2]);
+	return 0;
+}
+
+static void encode_read_mult_hold_reg_resp(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	size_t len = prim->u.read_mult_hold_reg_resp.num_reg * sizeof(uint16_t);
+	msgb_put_u8(msg, len);
+	memcpy(msgb_put(msg, len), prim->u.read_mult_hold_reg_resp.registers, len);
+}
+
+/* 0x0F Write Multiple Coils */
+static int decode_write_mult_coils_req(struct modbus_msgb_pool *pool, uint16_t address,
+				       const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_coil = osmo_load16be(&pdu[1]);
+	uint16_t num_coils = osmo_load16be(&pdu[3]);
+	uint8_t byte_count = pdu[5];
+	if (num_coils < 1 || num_coils > OSMO_MODBUS_WRITE_MULT_COILS_MAX ||
+	    byte_count != OSMO_MODBUS_BITS_BYTES(num_coils))
+		return -EINVAL;
+	*prim = modbus_makeprim_write_mult_coils_req(pool, address, first_coil, num_coils, &pdu[6]);
+	return 0;
+}
+
+static void encode_write_mult_coils_req(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	uint8_t byte_count = OSMO_MODBUS_BITS_BYTES(prim->u.write_mult_coils_req.num_coils);
+	msgb_put_u16(msg, prim->u.write_mult_coils_req.first_coil);
+	msgb_put_u16(msg, prim->u.write_mult_coils_req.num_coils);
+	msgb_put_u8(msg, byte_count);
+	memcpy(msgb_put(msg, byte_count), prim->u.write_mult_coils_req.bits, byte_count);
+}
+
+static int decode_write_mult_coils_resp(struct modbus_msgb_pool *pool, uint16_t address,
+					const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_coil = osmo_load16be(&pdu[1]);
+	uint16_t num_coils = osmo_load16be(&pdu[3]);
+	*prim = modbus_makeprim_write_mult_coils_resp(pool, address, first_coil, num_coils);
+	return 0;
+}
+
+static void encode_write_mult_coils_resp(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	msgb_put_u16(msg, prim->u.write_mult_coils_resp.first_coil);
+	msgb_put_u16(msg, prim->u.write_mult_coils_resp.num_coils);
+}
+
+/* 0x10 Write Multiple Registers */
+static int decode_write_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+				     const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_reg = osmo_load16be(&pdu[1]);
+	uint16_t num_reg = osmo_load16be(&pdu[3]);
+	uint8_t byte_count = pdu[5];
+	if (num_reg < 1 || num_reg > OSMO_MODBUS_WRITE_MULT_REG_MAX || byte_count != num_reg * 2)
+		return -EINVAL;
+	*prim = modbus_makeprim_write_mult_reg_req(pool, address, first_reg, num_reg, &pdu[6]);
+	return 0;
+}
+
+static void encode_write_mult_reg_req(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	size_t len = prim->u.write_mult_reg_req.num_reg * sizeof(uint16_t);
+	msgb_put_u16(msg, prim->u.write_mult_reg_req.first_reg);
+	msgb_put_u16(msg, prim->u.write_mult_reg_req.num_reg);
+	msgb_put_u8(msg, len);
+	memcpy(msgb_put(msg, len), prim->u.write_mult_reg_req.registers, len);
+}
+
+static int decode_write_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+				      const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t first_reg = osmo_load16be(&pdu[1]);
+	uint16_t num_reg = osmo_load16be(&pdu[3]);
+	*prim = modbus_makeprim_write_mult_reg_resp(pool, address, first_reg, num_reg);
+	return 0;
+}
+
+static void encode_write_mult_reg_resp(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	msgb_put_u16(msg, prim->u.write_mult_reg_resp.first_reg);
+	msgb_put_u16(msg, prim->u.write_mult_reg_resp.num_reg);
+}
+
+/* 0x17 Read/Write Multiple registers */
+static int decode_rw_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+				  const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint16_t read_first_reg = osmo_load16be(&pdu[1]);
+	uint16_t read_num_reg = osmo_load16be(&pdu[3]);
+	uint16_t write_first_reg = osmo_load16be(&pdu[5]);
+	uint16_t write_num_reg = osmo_load16be(&pdu[7]);
+	uint8_t byte_count = pdu[9];
+	if (read_num_reg < 1 || read_num_reg > 125 ||
+	    write_num_reg < 1 || write_num_reg > OSMO_MODBUS_RW_MULT_REG_WRITE_MAX ||
+	    byte_count != write_num_reg * 2)
+		return -EINVAL;
+	*prim = modbus_makeprim_rw_mult_reg_req(pool, address, read_first_reg, read_num_reg,
+						write_first_reg, write_num_reg, &pdu[10]);
+	return 0;
+}
+
+static void encode_rw_mult_reg_req(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	size_t len = prim->u.rw_mult_reg_req.write_num_reg * sizeof(uint16_t);
+	msgb_put_u16(msg, prim->u.rw_mult_reg_req.read_first_reg);
+	msgb_put_u16(msg, prim->u.rw_mult_reg_req.read_num_reg);
+	msgb_put_u16(msg, prim->u.rw_mult_reg_req.write_first_reg);
+	msgb_put_u16(msg, prim->u.rw_mult_reg_req.write_num_reg);
+	msgb_put_u8(msg, len);
+	memcpy(msgb_put(msg, len), prim->u.rw_mult_reg_req.registers, len);
+}
+
+static int decode_rw_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+				   const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	uint8_t byte_count = pdu[1];
+	if (byte_count % 2 || byte_count > 250)
+		return -EINVAL;
+	*prim = modbus_makeprim_rw_mult_reg_resp(pool, address, byte_count / 2, &pdu[2]);
+	return 0;
+}
+
+static void encode_rw_mult_reg_resp(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	size_t len = prim->u.rw_mult_reg_resp.num_reg * sizeof(uint16_t);
+	msgb_put_u8(msg, len);
+	memcpy(msgb_put(msg, len), prim->u.rw_mult_reg_resp.registers, len);
+}
+
+const struct pdu_func_desc pdu_func_descs[256] = {
+	[OSMO_MODBUS_FUNC_READ_COILS] = {
+		.name = "Read Coils",
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_FIXED(5),
+				.decode = decode_read_bits_req,
+				.encode = encode_read_bits_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_BYTE_COUNT(1),
+				.decode = decode_read_bits_resp,
+				.encode = encode_read_bits_resp,
+			},
+		},
+	},
+	[OSMO_MODBUS_FUNC_READ_DISCRETE_INPUTS] = {
+		.name = "Read Discrete Inputs",
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_FIXED(5),
+				.decode = decode_read_bits_req,
+				.encode = encode_read_bits_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_BYTE_COUNT(1),
+				.decode = decode_read_bits_resp,
+				.encode = encode_read_bits_resp,
+			},
+		},
+	},
+	[OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG] = {
+		.name = "Read Holding Registers",
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_FIXED(5),
+				.decode = decode_read_mult_hold_reg_req,
+				.encode = encode_read_mult_hold_reg_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_BYTE_COUNT(1),
+				.decode = decode_read_mult_hold_reg_resp,
+				.encode = encode_read_mult_hold_reg_resp,
+			},
+		},
+	},
+	[OSMO_MODBUS_FUNC_WRITE_MULT_COILS] = {
+		.name = "Write Multiple Coils",
+		.broadcast = true,
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_BYTE_COUNT(5),
+				.decode = decode_write_mult_coils_req,
+				.encode = encode_write_mult_coils_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_FIXED(5),
+				.decode = decode_write_mult_coils_resp,
+				.encode = encode_write_mult_coils_resp,
+			},
+		},
+	},
+	[OSMO_MODBUS_FUNC_WRITE_MULT_REG] = {
+		.name = "Write Multiple Registers",
+		.broadcast = true,
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_BYTE_COUNT(5),
+				.decode = decode_write_mult_reg_req,
+				.encode = encode_write_mult_reg_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_FIXED(5),
+				.decode = decode_write_mult_reg_resp,
+				.encode = encode_write_mult_reg_resp,
+			},
+		},
+	},
+	[OSMO_MODBUS_FUNC_RW_MULT_REG] = {
+		.name = "Read/Write Multiple registers",
+		.form = {
+			[PDU_FORM_REQUEST] = {
+				.len = PDU_LEN_BYTE_COUNT(9),
+				.decode = decode_rw_mult_reg_req,
+				.encode = encode_rw_mult_reg_req,
+			},
+			[PDU_FORM_RESPONSE] = {
+				.len = PDU_LEN_BYTE_COUNT(1),
+				.decode = decode_rw_mult_reg_resp,
+				.encode = encode_rw_mult_reg_resp,
+			},
+		},
+	},
+};
+
+/* Function code used by each primitive type */
+static const uint8_t prim_func_code[] = {
+	[OSMO_MODBUS_PRIM_N_MULT_HOLD_REG] = OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG,
+	[OSMO_MODBUS_PRIM_N_WRITE_MULT_REG] = OSMO_MODBUS_FUNC_WRITE_MULT_REG,
+	[OSMO_MODBUS_PRIM_N_RW_MULT_REG] = OSMO_MODBUS_FUNC_RW_MULT_REG,
+	[OSMO_MODBUS_PRIM_N_READ_COILS] = OSMO_MODBUS_FUNC_READ_COILS,
+	[OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS] = OSMO_MODBUS_FUNC_READ_DISCRETE_INPUTS,
+	[OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS] = OSMO_MODBUS_FUNC_WRITE_MULT_COILS,
+};
+
+/* Which PDU forms are expected to be received in the conn's role */
+uint32_t pdu_forms_for_conn(const struct osmo_modbus_conn *conn)
+{
+	if (conn->role == OSMO_MODBUS_ROLE_MASTER)
+		return X(PDU_FORM_RESPONSE);
+	if (conn->slave.monitor)
+		return X(PDU_FORM_REQUEST) | X(PDU_FORM_RESPONSE);
+	return X(PDU_FORM_REQUEST);
+}
+
+static int pdu_form_len(const struct pdu_form_desc *fd, const uint8_t *pdu, size_t len)
+{
+	if (fd->len.fixed_len)
+		return fd->len.fixed_len;
+	if (len <= fd->len.count_offset)
+		return -ENODATA;
+	return fd->len.count_offset + 1 + pdu[fd->len.count_offset];
+}
+
+/* Exception responses are the function code with its top bit set, followed by
+ * the exception code. Returns whether pdu starts like one expected in the
+ * conn's role. */
+static bool pdu_is_exception(const struct osmo_modbus_conn *conn, const uint8_t *pdu)
+{
+	uint8_t code = pdu[0] & ~OSMO_MODBUS_FUNC_EXCEPTION_BIT;
+
+	return (pdu[0] & OSMO_MODBUS_FUNC_EXCEPTION_BIT) &&
+	       (pdu_forms_for_conn(conn) & X(PDU_FORM_RESPONSE)) &&
+	       pdu_func_descs[code].name;
+}
+#define PDU_EXCEPTION_LEN 2
+
+/* Predict the PDU length from the bytes received so far.
+ * Returns -ENODATA if more bytes are needed to tell, -EINVAL if the function
+ * code is unknown or the forms expected in the conn's role disagree. */
+int pdu_expected_len(const struct osmo_modbus_conn *conn, const uint8_t *pdu, size_t len)
+{
+	const struct pdu_func_desc *desc;
+	uint32_t forms = pdu_forms_for_conn(conn);
+	int exp_len = -EINVAL;
+	int form_len;
+	int i;
+
+	if (len < 1)
+		return -ENODATA;
+	if (pdu_is_exception(conn, pdu))
+		return PDU_EXCEPTION_LEN;
+	desc = &pdu_func_descs[pdu[0]];
+	if (!desc->name)
+		return -EINVAL;
+
+	for (i = 0; i < _NUM_PDU_FORM; i++) {
+		if (!(forms & X(i)) || !desc->form[i].decode)
+			continue;
+		form_len = pdu_form_len(&desc->form[i], pdu, len);
+		if (form_len < 0)
+			return form_len;
+		if (exp_len >= 0 && exp_len != form_len)
+			return -EINVAL;
+		exp_len = form_len;
+	}
+	return exp_len;
+}
+
+/* Fill lens with the PDU length of each form expected in the conn's role which
+ * can already be told from the bytes received so far, for when
+ * pdu_expected_len() can't pick one (eg. requests and responses in monitor mode).
+ * Returns the number of lengths filled in. */
+int pdu_candidate_lens(const struct osmo_modbus_conn *conn, const uint8_t *pdu, size_t len,
+		       int lens[_NUM_PDU_FORM])
+{
+	const struct pdu_func_desc *desc;
+	uint32_t forms = pdu_forms_for_conn(conn);
+	int num = 0;
+	int form_len;
+	int i;
+
+	if (len < 1)
+		return 0;
+	if (pdu_is_exception(conn, pdu)) {
+		lens[0] = PDU_EXCEPTION_LEN;
+		return 1;
+	}
+	desc = &pdu_func_descs[pdu[0]];
+	if (!desc->name)
+		return 0;
+
+	for (i = 0; i < _NUM_PDU_FORM; i++) {
+		if (!(forms & X(i)) || !desc->form[i].decode)
+			continue;
+		form_len = pdu_form_len(&desc->form[i], pdu, len);
+		if (form_len >= 0)
+			lens[num++] = form_len;
+	}
+	return num;
+}
+
+/* Decode a complete PDU into a primitive, using only the forms expected in
+ * the conn's role. Returns -ENODATA if its length matches no form, -EINVAL on
+ * unknown function code or malformed content. */
+int pdu_decode(const struct osmo_modbus_conn *conn, uint16_t address,
+	       const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim)
+{
+	const struct pdu_func_desc *desc;
+	uint32_t forms = pdu_forms_for_conn(conn);
+	int rc = -ENODATA;
+	int i;
+
+	if (len < 1)
+		return -ENODATA;
+	if (pdu_is_exception(conn, pdu)) {
+		if (len != PDU_EXCEPTION_LEN)
+			return -ENODATA;
+		desc = &pdu_func_descs[pdu[0] & ~OSMO_MODBUS_FUNC_EXCEPTION_BIT];
+		LOGP(DLMODBUS, LOGL_DEBUG, "Decoded %s exception 0x%02x\n", desc->name, pdu[1]);
+		*prim = modbus_makeprim_exception_resp(conn->prim_pool, address,
+						       pdu[0] & ~OSMO_MODBUS_FUNC_EXCEPTION_BIT, pdu[1]);
+		return 0;
+	}
+	desc = &pdu_func_descs[pdu[0]];
+	if (!desc->name) {
+		LOGP(DLMODBUS, LOGL_NOTICE, "Unsupported function code 0x%02x\n", pdu[0]);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < _NUM_PDU_FORM; i++) {
+		if (!(forms & X(i)) || !desc->form[i].decode)
+			continue;
+		if (pdu_form_len(&desc->form[i], pdu, len) != len)
+			continue;
+		rc = desc->form[i].decode(conn->prim_pool, address, pdu, len, prim);
+		if (rc == 0) {
+			LOGP(DLMODBUS, LOGL_DEBUG, "Decoded %s %s\n", desc->name,
+			     i == PDU_FORM_REQUEST ? "request" : "response");
+			return 0;
+		}
+	}
+	return rc;
+}
+
+/* Whether prim is a request which may be broadcast (ie. a write) */
+bool pdu_prim_broadcast_allowed(const struct osmo_modbus_prim *prim)
+{
+	uint8_t code;
+
+	if (prim->oph.operation != PRIM_OP_REQUEST ||
+	    prim->oph.primitive >= ARRAY_SIZE(prim_func_code) ||
+	    !(code = prim_func_code[prim->oph.primitive]))
+		return false;
+	return pdu_func_descs[code].broadcast;
+}
+
+/* Function code of the PDU carrying a request or response prim, 0 if none */
+uint8_t pdu_prim_func_code(const struct osmo_modbus_prim *prim)
+{
+	if (prim->oph.primitive >= ARRAY_SIZE(prim_func_code))
+		return 0;
+	return prim_func_code[prim->oph.primitive];
+}
+
+/* Append the PDU of prim to msg */
+int pdu_encode(const struct osmo_modbus_prim *prim, struct msgb *msg)
+{
+	const struct pdu_func_desc *desc;
+	enum pdu_form form;
+	uint8_t code;
+
+	if (OSMO_PRIM_HDR(&prim->oph) == OSMO_PRIM(OSMO_MODBUS_PRIM_N_EXCEPTION, PRIM_OP_RESPONSE)) {
+		code = prim->u.exception_resp.function_code;
+		if (!pdu_func_descs[code].name)
+			return -EINVAL;
+		msgb_put_u8(msg, code | OSMO_MODBUS_FUNC_EXCEPTION_BIT);
+		msgb_put_u8(msg, prim->u.exception_resp.exception_code);
+		return 0;
+	}
+	if (prim->oph.primitive >= ARRAY_SIZE(prim_func_code) ||
+	    !(code = prim_func_code[prim->oph.primitive]))
+		return -EINVAL;
+	switch (prim->oph.operation) {
+	case PRIM_OP_REQUEST:
+		form = PDU_FORM_REQUEST;
+		break;
+	case PRIM_OP_RESPONSE:
+		form = PDU_FORM_RESPONSE;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	desc = &pdu_func_descs[code];
+	if (!desc->form[form].encode)
+		return -EINVAL;
+	msgb_put_u8(msg, code);
+	desc->form[form].encode(prim, msg);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/* Modbus PDU: Function Code (1Byte) + Data, common to all transmission modes */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <osmocom/core/msgb.h>
+
+#include <osmocom/modbus/modbus.h>
+
+#include "msgb_pool.h"
+
+enum pdu_form {
+	PDU_FORM_REQUEST,
+	PDU_FORM_RESPONSE,
+	_NUM_PDU_FORM
+};
+
+/* Length of a PDU form, either fixed or given by a byte count field */
+struct pdu_len_rule {
+	uint8_t fixed_len;	/* Total PDU length, 0 if it has a byte count field */
+	uint8_t count_offset;	/* Offset of the byte count field */
+};
+#define PDU_LEN_FIXED(len)		{ .fixed_len = (len) }
+#define PDU_LEN_BYTE_COUNT(offset)	{ .count_offset = (offset) }
+
+struct pdu_form_desc {
+	struct pdu_len_rule len;
+	/* Decode a PDU whose length already matched the rule above */
+	int (*decode)(struct modbus_msgb_pool *pool, uint16_t address, const uint8_t *pdu, size_t len,
+		      struct osmo_modbus_prim **prim);
+	/* Append the PDU for prim to msg */
+	void (*encode)(const struct osmo_modbus_prim *prim, struct msgb *msg);
+};
+
+struct pdu_func_desc {
+	const char *name;
+	bool broadcast; /* Request may be sent to OSMO_MODBUS_ADDR_BROADCAST */
+	struct pdu_form_desc form[_NUM_PDU_FORM];
+};
+
+/* Indexed by function code; entries with no name are not supported */
+extern const struct pdu_func_desc pdu_func_descs[256];
+
+uint32_t pdu_forms_for_conn(const struct osmo_modbus_conn *conn);
+int pdu_expected_len(const struct osmo_modbus_conn *conn, const uint8_t *pdu, size_t len);
+int pdu_candidate_lens(const struct osmo_modbus_conn *conn, const uint8_t *pdu, size_t len,
+		       int lens[_NUM_PDU_FORM]);
+int pdu_decode(const struct osmo_modbus_conn *conn, uint16_t address,
+	       const uint8_t *pdu, size_t len, struct osmo_modbus_prim **prim);
+int pdu_encode(const struct osmo_modbus_prim *prim, struct msgb *msg);
+bool pdu_prim_broadcast_allowed(const struct osmo_modbus_prim *prim);
+uint8_t pdu_prim_func_code(const struct osmo_modbus_prim *prim);
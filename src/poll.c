@@ -0,0 +1,324 @@
+/*! \file poll.c
+ * Master poll plan, coalescing subscribed register ranges into few requests */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <errno.h>
+#include <inttypes.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/linuxlist.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_poll.h>
+
+#include "modbus_internal.h"
+
+#define POLL_DEFAULT_MAX_GAP 8
+
+struct osmo_modbus_poll_plan {
+	struct osmo_modbus_conn *conn;
+	uint16_t max_gap; /* Max unused registers read to merge two ranges */
+	enum osmo_modbus_prio prio;
+	bool running;
+	struct llist_head groups; /* struct poll_group */
+};
+
+struct poll_block {
+	uint16_t first_reg;
+	uint16_t num_reg;
+};
+
+/* Entries of a slave polled with the same period, polled together */
+struct poll_group {
+	struct llist_head list; /* item in plan->groups */
+	struct osmo_modbus_poll_plan *plan; /* backpointer */
+	uint16_t address;
+	unsigned long period_ms;
+	struct llist_head entries; /* struct osmo_modbus_poll_entry, sorted by first_reg */
+	struct poll_block *blocks; /* requests sent each period */
+	unsigned int num_blocks;
+	bool dirty; /* entries changed, blocks need to be recomputed */
+	unsigned int num_pending; /* requests of the last period not answered yet */
+	struct osmo_timer_list timer;
+};
+
+struct osmo_modbus_poll_entry {
+	struct llist_head list; /* item in group->entries */
+	struct poll_group *group; /* backpointer */
+	uint16_t first_reg;
+	uint16_t num_reg;
+	osmo_modbus_poll_cb cb;
+	void *ctx;
+};
+
+/* Merge the sorted entries into the minimum amount of blocks */
+static void poll_group_build(struct poll_group *group)
+{
+	struct osmo_modbus_poll_entry *entry;
+	struct poll_block *blk = NULL;
+	uint32_t blk_end = 0, entry_end, new_end;
+	unsigned int num_entries = llist_count(&group->entries);
+
+	talloc_free(group->blocks);
+	group->blocks = talloc_zero_array(group, struct poll_block, num_entries);
+	group->num_blocks = 0;
+
+	llist_for_each_entry(entry, &group->entries, list) {
+		entry_end = (uint32_t)entry->first_reg + entry->num_reg;
+		if (blk) {
+			new_end = OSMO_MAX(blk_end, entry_end);
+			if (entry->first_reg <= blk_end + group->plan->max_gap &&
+			    new_end - blk->first_reg <= OSMO_MODBUS_POLL_MAX_REG) {
+				blk_end = new_end;
+				blk->num_reg = blk_end - blk->first_reg;
+				continue;
+			}
+		}
+		blk = &group->blocks[group->num_blocks++];
+		blk->first_reg = entry->first_reg;
+		blk->num_reg = entry->num_reg;
+		blk_end = entry_end;
+	}
+	group->dirty = false;
+
+	LOGP(DLMODBUS, LOGL_DEBUG, "poll(addr=%" PRIu16 ",period=%lums): %u entries in %u requests\n",
+	     group->address, group->period_ms, num_entries, group->num_blocks);
+}
+
+/* Reply (or timeout) to one of the group requests: split it to the entries */
+static void poll_req_cb(struct osmo_modbus_conn *conn, const struct osmo_modbus_prim *req,
+			struct osmo_modbus_prim *resp, void *data)
+{
+	struct poll_group *group = (struct poll_group *)data;
+	const struct osmo_modbus_read_mult_hold_reg_req_param *req_param = &req->u.read_mult_hold_reg_req;
+	const uint16_t *registers = NULL;
+	struct osmo_modbus_poll_entry *entry;
+
+	if (group->num_pending > 0)
+		group->num_pending--;
+
+	if (resp->oph.primitive == OSMO_MODBUS_PRIM_N_MULT_HOLD_REG &&
+	    resp->u.read_mult_hold_reg_resp.num_reg == req_param->num_reg)
+		registers = resp->u.read_mult_hold_reg_resp.registers;
+	else
+		LOGP(DLMODBUS, LOGL_NOTICE, "poll(addr=%" PRIu16 "): no valid reply to registers %" PRIu16 "+%" PRIu16 "\n",
+		     group->address, req_param->first_reg, req_param->num_reg);
+
+	/* The request may have been built before entries changed: only
+	 * deliver to entries fully covered by it */
+	llist_for_each_entry(entry, &group->entries, list) {
+		if (entry->first_reg < req_param->first_reg ||
+		    entry->first_reg + entry->num_reg > req_param->first_reg + req_param->num_reg)
+			continue;
+		entry->cb(group->address, entry->first_reg, entry->num_reg,
+			  registers ? &registers[entry->first_reg - req_param->first_reg] : NULL,
+			  entry->ctx);
+	}
+
+	modbus_msgb_pool_put(conn->prim_pool, resp->oph.msg);
+}
+
+static void poll_group_timer_cb(void *data)
+{
+	struct poll_group *group = (struct poll_group *)data;
+	struct osmo_modbus_poll_plan *plan = group->plan;
+	struct osmo_modbus_prim *prim;
+	unsigned int i;
+
+	osmo_timer_schedule(&group->timer, group->period_ms / 1000, (group->period_ms % 1000) * 1000);
+
+	/* Don't pile up requests if the bus can't keep up with the period */
+	if (group->num_pending > 0) {
+		LOGP(DLMODBUS, LOGL_NOTICE, "poll(addr=%" PRIu16 ",period=%lums): %u requests still pending, skipping period\n",
+		     group->address, group->period_ms, group->num_pending);
+		return;
+	}
+
+	if (group->dirty)
+		poll_group_build(group);
+
+	for (i = 0; i < group->num_blocks; i++) {
+		prim = modbus_makeprim_mult_hold_reg_req(plan->conn->prim_pool, group->address,
+							 group->blocks[i].first_reg,
+							 group->blocks[i].num_reg);
+		if (conn_master_submit_cb(plan->conn, prim, plan->prio, poll_req_cb, group) == 0)
+			group->num_pending++;
+	}
+}
+
+static void poll_group_free(struct poll_group *group)
+{
+	osmo_timer_del(&group->timer);
+	conn_master_cancel_cb(group->plan->conn, group);
+	llist_del(&group->list);
+	talloc_free(group);
+}
+
+static struct poll_group *poll_group_get(struct osmo_modbus_poll_plan *plan, uint16_t address, unsigned long period_ms)
+{
+	struct poll_group *group;
+
+	llist_for_each_entry(group, &plan->groups, list) {
+		if (group->address == address && group->period_ms == period_ms)
+			return group;
+	}
+
+	group = talloc_zero(plan, struct poll_group);
+	group->plan = plan;
+	group->address = address;
+	group->period_ms = period_ms;
+	INIT_LLIST_HEAD(&group->entries);
+	osmo_timer_setup(&group->timer, poll_group_timer_cb, group);
+	llist_add_tail(&group->list, &plan->groups);
+	if (plan->running)
+		osmo_timer_schedule(&group->timer, 0, 0);
+	return group;
+}
+
+/* Also run when the parent conn is freed */
+static int poll_plan_talloc_destructor(struct osmo_modbus_poll_plan *plan)
+{
+	struct poll_group *group, *group2;
+
+	llist_for_each_entry_safe(group, group2, &plan->groups, list)
+		poll_group_free(group);
+	return 0;
+}
+
+struct osmo_modbus_poll_plan *osmo_modbus_poll_plan_alloc(struct osmo_modbus_conn *conn)
+{
+	struct osmo_modbus_poll_plan *plan;
+
+	if (conn->role != OSMO_MODBUS_ROLE_MASTER)
+		return NULL;
+
+	plan = talloc_zero(conn, struct osmo_modbus_poll_plan);
+	plan->conn = conn;
+	plan->max_gap = POLL_DEFAULT_MAX_GAP;
+	plan->prio = OSMO_MODBUS_PRIO_LOW;
+	INIT_LLIST_HEAD(&plan->groups);
+	talloc_set_destructor(plan, poll_plan_talloc_destructor);
+	return plan;
+}
+
+void osmo_modbus_poll_plan_free(struct osmo_modbus_poll_plan *plan)
+{
+	talloc_free(plan);
+}
+
+int osmo_modbus_poll_plan_set_max_gap(struct osmo_modbus_poll_plan *plan, uint16_t max_gap)
+{
+	struct poll_group *group;
+
+	if (max_gap > OSMO_MODBUS_POLL_MAX_REG)
+		return -EINVAL;
+	plan->max_gap = max_gap;
+	llist_for_each_entry(group, &plan->groups, list)
+		group->dirty = true;
+	return 0;
+}
+
+int osmo_modbus_poll_plan_set_prio(struct osmo_modbus_poll_plan *plan, enum osmo_modbus_prio prio)
+{
+	if (prio < 0 || prio >= _NUM_OSMO_MODBUS_PRIO)
+		return -EINVAL;
+	plan->prio = prio;
+	return 0;
+}
+
+int osmo_modbus_poll_plan_start(struct osmo_modbus_poll_plan *plan)
+{
+	struct poll_group *group;
+
+	if (plan->running)
+		return -EALREADY;
+	plan->running = true;
+	llist_for_each_entry(group, &plan->groups, list)
+		osmo_timer_schedule(&group->timer, 0, 0);
+	return 0;
+}
+
+void osmo_modbus_poll_plan_stop(struct osmo_modbus_poll_plan *plan)
+{
+	struct poll_group *group;
+
+	plan->running = false;
+	llist_for_each_entry(group, &plan->groups, list)
+		osmo_timer_del(&group->timer);
+}
+
+unsigned int osmo_modbus_poll_plan_get_num_requests(struct osmo_modbus_poll_plan *plan)
+{
+	struct poll_group *group;
+	unsigned int num = 0;
+
+	llist_for_each_entry(group, &plan->groups, list) {
+		if (group->dirty)
+			poll_group_build(group);
+		num += group->num_blocks;
+	}
+	return num;
+}
+
+struct osmo_modbus_poll_entry *osmo_modbus_poll_plan_add(struct osmo_modbus_poll_plan *plan,
+							 uint16_t address, uint16_t first_reg,
+							 uint16_t num_reg, unsigned long period_ms,
+							 osmo_modbus_poll_cb cb, void *ctx)
+{
+	struct poll_group *group;
+	struct osmo_modbus_poll_entry *entry, *pos;
+
+	if (num_reg == 0 || num_reg > OSMO_MODBUS_POLL_MAX_REG ||
+	    (uint32_t)first_reg + num_reg > 0x10000 || period_ms == 0 || !cb)
+		return NULL;
+
+	group = poll_group_get(plan, address, period_ms);
+	entry = talloc_zero(group, struct osmo_modbus_poll_entry);
+	entry->group = group;
+	entry->first_reg = first_reg;
+	entry->num_reg = num_reg;
+	entry->cb = cb;
+	entry->ctx = ctx;
+
+	/* Keep entries sorted by first_reg */
+	llist_for_each_entry(pos, &group->entries, list) {
+		if (pos->first_reg > first_reg)
+			break;
+	}
+	llist_add_tail(&entry->list, &pos->list);
+	group->dirty = true;
+	return entry;
+}
+
+void osmo_modbus_poll_plan_del(struct osmo_modbus_poll_entry *entry)
+{
+	struct poll_group *group = entry->group;
+
+	llist_del(&entry->list);
+	talloc_free(entry);
+	group->dirty = true;
+	if (llist_empty(&group->entries))
+		poll_group_free(group);
+}
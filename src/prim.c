@@ -23,69 +23,431 @@
  */
 
 #include <unistd.h>
+#include <stddef.h>
 #include <inttypes.h>
 
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/context.h>
+#include <osmocom/core/bits.h>
 
 #include <osmocom/modbus/modbus_prim.h>
 #include <osmocom/modbus/modbus.h>
 
+#include "modbus_internal.h"
+
 #define MODBUS_SAP 0
 
-static struct msgb *modbus_prim_msgb_alloc(const char* desc)
+/* Size of a prim carrying param_len bytes of parameters */
+#define MODBUS_PRIM_LEN(param_len) (offsetof(struct osmo_modbus_prim, u) + (param_len))
+
+/* Prims always get room for the whole struct, so that apps may keep copying
+ * them by value. Only the bytes in use (header and actual parameters) are put
+ * in the msgb, see osmo_modbus_prim_compact(). Pooled msgbs have that size. */
+static struct msgb *modbus_prim_msgb_alloc(struct modbus_msgb_pool *pool, const char* desc)
+{
+	if (pool)
+		return modbus_msgb_pool_get(pool);
+	return msgb_alloc_c(OTC_GLOBAL, sizeof(struct osmo_modbus_prim), desc);
+}
+
+static struct osmo_modbus_prim *modbus_prim_alloc(struct modbus_msgb_pool *pool, const char *desc,
+						  unsigned int primitive, enum osmo_prim_operation operation,
+						  uint16_t address, size_t param_len)
 {
-	return msgb_alloc(sizeof(struct osmo_modbus_prim), desc);
+	size_t len = MODBUS_PRIM_LEN(param_len);
+	struct msgb *msg = modbus_prim_msgb_alloc(pool, desc);
+	struct osmo_modbus_prim *prim;
+
+	prim = (struct osmo_modbus_prim *) msgb_put(msg, len);
+	memset(prim, 0, sizeof(*prim));
+	osmo_prim_init(&prim->oph, MODBUS_SAP, primitive, operation, msg);
+	prim->address = address;
+	return prim;
 }
 
 const struct value_string osmo_modbus_prim_type_names[] = {
 	{ OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT, 	"Response Timeout" },
 	{ OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,	"N Multiple Holding Registers" },
+	{ OSMO_MODBUS_PRIM_N_WRITE_MULT_REG,	"N Write Multiple Registers" },
+	{ OSMO_MODBUS_PRIM_N_RW_MULT_REG,	"N Read/Write Multiple Registers" },
+	{ OSMO_MODBUS_PRIM_N_READ_COILS,	"N Read Coils" },
+	{ OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, "N Read Discrete Inputs" },
+	{ OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS,	"N Write Multiple Coils" },
+	{ OSMO_MODBUS_PRIM_N_EXCEPTION,		"N Exception" },
 	{ 0, NULL }
 };
 
-struct osmo_modbus_prim *osmo_modbus_makeprim_timeout_resp(uint16_t address)
+struct osmo_modbus_prim *modbus_makeprim_timeout_resp(struct modbus_msgb_pool *pool, uint16_t address)
 {
-	struct msgb *msg = modbus_prim_msgb_alloc(__func__);
-	struct osmo_modbus_prim *prim;
+	return modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT,
+				 PRIM_OP_INDICATION, address, 0);
+}
 
-	prim = (struct osmo_modbus_prim *) msgb_put(msg, sizeof(*prim));
-	osmo_prim_init(&prim->oph, MODBUS_SAP,
-			OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT,
-			PRIM_OP_INDICATION, msg);
-	prim->address = address;
-	return prim;
+struct osmo_modbus_prim *osmo_modbus_makeprim_timeout_resp(uint16_t address)
+{
+	return modbus_makeprim_timeout_resp(NULL, address);
 }
 
-struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_req(uint16_t address, uint16_t first_reg, uint16_t num_reg)
+struct osmo_modbus_prim *modbus_makeprim_mult_hold_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							   uint16_t first_reg, uint16_t num_reg)
 {
-	struct msgb *msg = modbus_prim_msgb_alloc(__func__);
 	struct osmo_modbus_prim *prim;
 	struct osmo_modbus_read_mult_hold_reg_req_param *param;
 
-	prim = (struct osmo_modbus_prim *) msgb_put(msg, sizeof(*prim));
-	osmo_prim_init(&prim->oph, MODBUS_SAP,
-			OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,
-			PRIM_OP_REQUEST, msg);
-	prim->address = address;
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,
+				 PRIM_OP_REQUEST, address,
+				 sizeof(*param));
 	param = &prim->u.read_mult_hold_reg_req;
 	param->first_reg = first_reg;
 	param->num_reg = num_reg;
 	return prim;
 }
 
-struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_resp(uint16_t address, uint8_t num_reg, uint16_t *registers)
+struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_req(uint16_t address, uint16_t first_reg, uint16_t num_reg)
+{
+	return modbus_makeprim_mult_hold_reg_req(NULL, address, first_reg, num_reg);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_mult_hold_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							    uint8_t num_reg, const uint8_t *registers)
 {
-	struct msgb *msg = modbus_prim_msgb_alloc(__func__);
 	struct osmo_modbus_prim *prim;
 	struct osmo_modbus_read_mult_hold_reg_resp_param *param;
 
-	prim = (struct osmo_modbus_prim *) msgb_put(msg, sizeof(*prim));
-	osmo_prim_init(&prim->oph, MODBUS_SAP,
-			OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,
-			PRIM_OP_RESPONSE, msg);
-	prim->address = address;
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_MULT_HOLD_REG,
+				 PRIM_OP_RESPONSE, address,
+				 offsetof(struct osmo_modbus_read_mult_hold_reg_resp_param, registers) +
+				 num_reg * sizeof(uint16_t));
 	param = &prim->u.read_mult_hold_reg_resp;
 	param->num_reg = num_reg;
 	memcpy(param->registers, registers, num_reg * sizeof(uint16_t));
 	return prim;
 }
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_mult_hold_reg_resp(uint16_t address, uint8_t num_reg, uint16_t *registers)
+{
+	return modbus_makeprim_mult_hold_reg_resp(NULL, address, num_reg, (const uint8_t *)registers);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_write_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							    uint16_t first_reg, uint16_t num_reg,
+							    const uint8_t *registers)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_write_mult_reg_req_param *param;
+
+	OSMO_ASSERT(num_reg <= OSMO_MODBUS_WRITE_MULT_REG_MAX);
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_WRITE_MULT_REG,
+				 PRIM_OP_REQUEST, address,
+				 offsetof(struct osmo_modbus_write_mult_reg_req_param, registers) +
+				 num_reg * sizeof(uint16_t));
+	param = &prim->u.write_mult_reg_req;
+	param->first_reg = first_reg;
+	param->num_reg = num_reg;
+	memcpy(param->registers, registers, num_reg * sizeof(uint16_t));
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_reg_req(uint16_t address, uint16_t first_reg, uint16_t num_reg,
+								 const uint16_t *registers)
+{
+	return modbus_makeprim_write_mult_reg_req(NULL, address, first_reg, num_reg, (const uint8_t *)registers);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_write_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							     uint16_t first_reg, uint16_t num_reg)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_write_mult_reg_resp_param *param;
+
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_WRITE_MULT_REG,
+				 PRIM_OP_RESPONSE, address,
+				 sizeof(*param));
+	param = &prim->u.write_mult_reg_resp;
+	param->first_reg = first_reg;
+	param->num_reg = num_reg;
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_reg_resp(uint16_t address, uint16_t first_reg, uint16_t num_reg)
+{
+	return modbus_makeprim_write_mult_reg_resp(NULL, address, first_reg, num_reg);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_rw_mult_reg_req(struct modbus_msgb_pool *pool, uint16_t address,
+							 uint16_t read_first_reg, uint16_t read_num_reg,
+							 uint16_t write_first_reg, uint16_t write_num_reg,
+							 const uint8_t *registers)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_rw_mult_reg_req_param *param;
+
+	OSMO_ASSERT(write_num_reg <= OSMO_MODBUS_RW_MULT_REG_WRITE_MAX);
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_RW_MULT_REG,
+				 PRIM_OP_REQUEST, address,
+				 offsetof(struct osmo_modbus_rw_mult_reg_req_param, registers) +
+				 write_num_reg * sizeof(uint16_t));
+	param = &prim->u.rw_mult_reg_req;
+	param->read_first_reg = read_first_reg;
+	param->read_num_reg = read_num_reg;
+	param->write_first_reg = write_first_reg;
+	param->write_num_reg = write_num_reg;
+	memcpy(param->registers, registers, write_num_reg * sizeof(uint16_t));
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_rw_mult_reg_req(uint16_t address,
+							      uint16_t read_first_reg, uint16_t read_num_reg,
+							      uint16_t write_first_reg, uint16_t write_num_reg,
+							      const uint16_t *registers)
+{
+	return modbus_makeprim_rw_mult_reg_req(NULL, address, read_first_reg, read_num_reg,
+					       write_first_reg, write_num_reg, (const uint8_t *)registers);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_rw_mult_reg_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							  uint8_t num_reg, const uint8_t *registers)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_rw_mult_reg_resp_param *param;
+
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_RW_MULT_REG,
+				 PRIM_OP_RESPONSE, address,
+				 offsetof(struct osmo_modbus_rw_mult_reg_resp_param, registers) +
+				 num_reg * sizeof(uint16_t));
+	param = &prim->u.rw_mult_reg_resp;
+	param->num_reg = num_reg;
+	memcpy(param->registers, registers, num_reg * sizeof(uint16_t));
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_rw_mult_reg_resp(uint16_t address, uint8_t num_reg, const uint16_t *registers)
+{
+	return modbus_makeprim_rw_mult_reg_resp(NULL, address, num_reg, (const uint8_t *)registers);
+}
+
+/* primitive: OSMO_MODBUS_PRIM_N_READ_COILS or OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS */
+struct osmo_modbus_prim *modbus_makeprim_read_bits_req(struct modbus_msgb_pool *pool, unsigned int primitive,
+						       uint16_t address, uint16_t first_bit, uint16_t num_bits)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_read_bits_req_param *param;
+
+	prim = modbus_prim_alloc(pool, __func__, primitive,
+				 PRIM_OP_REQUEST, address,
+				 sizeof(*param));
+	param = &prim->u.read_coils_req;
+	param->first_bit = first_bit;
+	param->num_bits = num_bits;
+	return prim;
+}
+
+struct osmo_modbus_prim *modbus_makeprim_read_bits_resp(struct modbus_msgb_pool *pool, unsigned int primitive,
+							uint16_t address, uint8_t byte_count, const uint8_t *bits)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_read_bits_resp_param *param;
+
+	OSMO_ASSERT(byte_count <= OSMO_MODBUS_BITS_BYTES(OSMO_MODBUS_READ_BITS_MAX));
+	prim = modbus_prim_alloc(pool, __func__, primitive,
+				 PRIM_OP_RESPONSE, address,
+				 offsetof(struct osmo_modbus_read_bits_resp_param, bits) + byte_count);
+	param = &prim->u.read_coils_resp;
+	param->byte_count = byte_count;
+	memcpy(param->bits, bits, byte_count);
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_coils_req(uint16_t address, uint16_t first_coil, uint16_t num_coils)
+{
+	return modbus_makeprim_read_bits_req(NULL, OSMO_MODBUS_PRIM_N_READ_COILS, address, first_coil, num_coils);
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_coils_resp(uint16_t address, uint8_t byte_count, const uint8_t *bits)
+{
+	return modbus_makeprim_read_bits_resp(NULL, OSMO_MODBUS_PRIM_N_READ_COILS, address, byte_count, bits);
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_discrete_inputs_req(uint16_t address, uint16_t first_input,
+									uint16_t num_inputs)
+{
+	return modbus_makeprim_read_bits_req(NULL, OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, address,
+					     first_input, num_inputs);
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_read_discrete_inputs_resp(uint16_t address, uint8_t byte_count,
+									 const uint8_t *bits)
+{
+	return modbus_makeprim_read_bits_resp(NULL, OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, address,
+					      byte_count, bits);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_write_mult_coils_req(struct modbus_msgb_pool *pool, uint16_t address,
+							      uint16_t first_coil, uint16_t num_coils,
+							      const uint8_t *bits)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_write_mult_coils_req_param *param;
+	size_t byte_count = OSMO_MODBUS_BITS_BYTES(num_coils);
+
+	OSMO_ASSERT(num_coils <= OSMO_MODBUS_WRITE_MULT_COILS_MAX);
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS,
+				 PRIM_OP_REQUEST, address,
+				 offsetof(struct osmo_modbus_write_mult_coils_req_param, bits) + byte_count);
+	param = &prim->u.write_mult_coils_req;
+	param->first_coil = first_coil;
+	param->num_coils = num_coils;
+	memcpy(param->bits, bits, byte_count);
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_coils_req(uint16_t address, uint16_t first_coil,
+								   uint16_t num_coils, const uint8_t *bits)
+{
+	return modbus_makeprim_write_mult_coils_req(NULL, address, first_coil, num_coils, bits);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_write_mult_coils_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							       uint16_t first_coil, uint16_t num_coils)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_write_mult_coils_resp_param *param;
+
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS,
+				 PRIM_OP_RESPONSE, address,
+				 sizeof(*param));
+	param = &prim->u.write_mult_coils_resp;
+	param->first_coil = first_coil;
+	param->num_coils = num_coils;
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_write_mult_coils_resp(uint16_t address, uint16_t first_coil,
+								    uint16_t num_coils)
+{
+	return modbus_makeprim_write_mult_coils_resp(NULL, address, first_coil, num_coils);
+}
+
+struct osmo_modbus_prim *modbus_makeprim_exception_resp(struct modbus_msgb_pool *pool, uint16_t address,
+							 uint8_t function_code, uint8_t exception_code)
+{
+	struct osmo_modbus_prim *prim;
+	struct osmo_modbus_exception_resp_param *param;
+
+	prim = modbus_prim_alloc(pool, __func__, OSMO_MODBUS_PRIM_N_EXCEPTION,
+				 PRIM_OP_RESPONSE, address,
+				 sizeof(*param));
+	param = &prim->u.exception_resp;
+	param->function_code = function_code;
+	param->exception_code = exception_code;
+	return prim;
+}
+
+struct osmo_modbus_prim *osmo_modbus_makeprim_exception_resp(uint16_t address, uint8_t function_code,
+							     uint8_t exception_code)
+{
+	return modbus_makeprim_exception_resp(NULL, address, function_code, exception_code);
+}
+
+/* Bytes of prim in use: header and actual parameters */
+size_t osmo_modbus_prim_len(const struct osmo_modbus_prim *prim)
+{
+	return msgb_length(prim->oph.msg);
+}
+
+/* Move prim to a msgb sized to the bytes in use, freeing the original one */
+struct osmo_modbus_prim *osmo_modbus_prim_compact(struct osmo_modbus_prim *prim)
+{
+	size_t len = osmo_modbus_prim_len(prim);
+	struct msgb *msg = msgb_alloc_c(OTC_GLOBAL, len, "modbus_prim_compact");
+	struct osmo_modbus_prim *compact;
+
+	compact = (struct osmo_modbus_prim *) msgb_put(msg, len);
+	memcpy(compact, prim, len);
+	compact->oph.msg = msg;
+	memcpy(msg->cb, prim->oph.msg->cb, sizeof(msg->cb));
+	msgb_free(prim->oph.msg);
+	return compact;
+}
+
+/* Number of registers requested or carried by prim, 0 if not applicable.
+ * For Read/Write requests, the number of registers to write. */
+uint16_t osmo_modbus_prim_num_reg(const struct osmo_modbus_prim *prim)
+{
+	switch (OSMO_PRIM_HDR(&prim->oph)) {
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_REQUEST):
+		return prim->u.read_mult_hold_reg_req.num_reg;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_RESPONSE):
+		return prim->u.read_mult_hold_reg_resp.num_reg;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_REG, PRIM_OP_REQUEST):
+		return prim->u.write_mult_reg_req.num_reg;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_REG, PRIM_OP_RESPONSE):
+		return prim->u.write_mult_reg_resp.num_reg;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_REQUEST):
+		return prim->u.rw_mult_reg_req.write_num_reg;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_RESPONSE):
+		return prim->u.rw_mult_reg_resp.num_reg;
+	default:
+		return 0;
+	}
+}
+
+/* Raw (big endian) register values carried by prim, NULL if none */
+const uint16_t *osmo_modbus_prim_registers(const struct osmo_modbus_prim *prim)
+{
+	switch (OSMO_PRIM_HDR(&prim->oph)) {
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_RESPONSE):
+		return prim->u.read_mult_hold_reg_resp.registers;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_REG, PRIM_OP_REQUEST):
+		return prim->u.write_mult_reg_req.registers;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_REQUEST):
+		return prim->u.rw_mult_reg_req.registers;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_RESPONSE):
+		return prim->u.rw_mult_reg_resp.registers;
+	default:
+		return NULL;
+	}
+}
+
+/* Value of the idx-th register carried by prim, in host byte order */
+uint16_t osmo_modbus_prim_get_reg(const struct osmo_modbus_prim *prim, unsigned int idx)
+{
+	const uint16_t *registers = osmo_modbus_prim_registers(prim);
+
+	OSMO_ASSERT(registers && idx < osmo_modbus_prim_num_reg(prim));
+	return osmo_load16be(&registers[idx]);
+}
+
+/* Number of bits requested or carried by prim, 0 if not applicable. Read
+ * responses only know their byte count: the last byte may be padding. */
+uint16_t osmo_modbus_prim_num_bits(const struct osmo_modbus_prim *prim)
+{
+	switch (OSMO_PRIM_HDR(&prim->oph)) {
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_COILS, PRIM_OP_REQUEST):
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, PRIM_OP_REQUEST):
+		return prim->u.read_coils_req.num_bits;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_COILS, PRIM_OP_RESPONSE):
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, PRIM_OP_RESPONSE):
+		return prim->u.read_coils_resp.byte_count * 8;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS, PRIM_OP_REQUEST):
+		return prim->u.write_mult_coils_req.num_coils;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS, PRIM_OP_RESPONSE):
+		return prim->u.write_mult_coils_resp.num_coils;
+	default:
+		return 0;
+	}
+}
+
+/* Packed bit values carried by prim, NULL if none */
+const uint8_t *osmo_modbus_prim_bits(const struct osmo_modbus_prim *prim)
+{
+	switch (OSMO_PRIM_HDR(&prim->oph)) {
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_COILS, PRIM_OP_RESPONSE):
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, PRIM_OP_RESPONSE):
+		return prim->u.read_coils_resp.bits;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS, PRIM_OP_REQUEST):
+		return prim->u.write_mult_coils_req.bits;
+	default:
+		return NULL;
+	}
+}
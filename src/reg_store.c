@@ -0,0 +1,287 @@
+/*! \file reg_store.c
+ * Slave register store */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/utils.h>
+#include <osmocom/core/bits.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/linuxrbtree.h>
+
+#include <osmocom/modbus/modbus.h>
+#include <osmocom/modbus/modbus_reg_store.h>
+
+#include "modbus_internal.h"
+
+/* Dense range of registers, values stored raw (big endian) as in the PDU */
+struct reg_range {
+	struct llist_head list; /* item in store->ranges, sorted by first_reg */
+	uint16_t first_reg;
+	unsigned int num_reg;
+	uint16_t *regs;
+};
+
+/* Register set outside of any range */
+struct reg_sparse {
+	struct rb_node node; /* item in store->sparse */
+	uint16_t reg;
+	uint16_t val; /* raw (big endian) */
+};
+
+struct osmo_modbus_reg_store {
+	struct osmo_modbus_conn *conn; /* backpointer */
+	struct llist_head ranges; /* struct reg_range */
+	struct rb_root sparse; /* struct reg_sparse */
+};
+
+static struct reg_range *reg_range_find(const struct osmo_modbus_reg_store *store, uint32_t reg)
+{
+	struct reg_range *range;
+
+	llist_for_each_entry(range, &store->ranges, list) {
+		if (reg < range->first_reg)
+			break;
+		if (reg < range->first_reg + range->num_reg)
+			return range;
+	}
+	return NULL;
+}
+
+static struct reg_sparse *reg_sparse_find(const struct osmo_modbus_reg_store *store, uint16_t reg)
+{
+	struct rb_node *node = store->sparse.rb_node;
+	struct reg_sparse *sp;
+
+	while (node) {
+		sp = rb_entry(node, struct reg_sparse, node);
+		if (reg < sp->reg)
+			node = node->rb_left;
+		else if (reg > sp->reg)
+			node = node->rb_right;
+		else
+			return sp;
+	}
+	return NULL;
+}
+
+static struct reg_sparse *reg_sparse_get(struct osmo_modbus_reg_store *store, uint16_t reg)
+{
+	struct rb_node **n = &store->sparse.rb_node;
+	struct rb_node *parent = NULL;
+	struct reg_sparse *sp;
+
+	while (*n) {
+		sp = rb_entry(*n, struct reg_sparse, node);
+		parent = *n;
+		if (reg < sp->reg)
+			n = &((*n)->rb_left);
+		else if (reg > sp->reg)
+			n = &((*n)->rb_right);
+		else
+			return sp;
+	}
+
+	sp = talloc_zero(store, struct reg_sparse);
+	sp->reg = reg;
+	rb_link_node(&sp->node, parent, n);
+	rb_insert_color(&sp->node, &store->sparse);
+	return sp;
+}
+
+static int reg_store_talloc_destructor(struct osmo_modbus_reg_store *store)
+{
+	if (store->conn->slave.reg_store == store)
+		store->conn->slave.reg_store = NULL;
+	return 0;
+}
+
+struct osmo_modbus_reg_store *osmo_modbus_reg_store_alloc(struct osmo_modbus_conn *conn)
+{
+	struct osmo_modbus_reg_store *store;
+
+	if (conn->role != OSMO_MODBUS_ROLE_SLAVE || conn->slave.reg_store)
+		return NULL;
+
+	store = talloc_zero(conn, struct osmo_modbus_reg_store);
+	store->conn = conn;
+	INIT_LLIST_HEAD(&store->ranges);
+	store->sparse = RB_ROOT;
+	talloc_set_destructor(store, reg_store_talloc_destructor);
+	conn->slave.reg_store = store;
+	return store;
+}
+
+void osmo_modbus_reg_store_free(struct osmo_modbus_reg_store *store)
+{
+	talloc_free(store);
+}
+
+/* Registers in the new range are initialized to 0, or to the value they
+ * already had in the sparse index */
+int osmo_modbus_reg_store_add_range(struct osmo_modbus_reg_store *store, uint16_t first_reg, unsigned int num_reg)
+{
+	struct reg_range *range, *pos;
+	struct reg_sparse *sp;
+	uint32_t end = (uint32_t)first_reg + num_reg;
+	uint32_t reg;
+
+	if (num_reg == 0 || end > 0x10000)
+		return -EINVAL;
+
+	llist_for_each_entry(pos, &store->ranges, list) {
+		if (pos->first_reg >= end)
+			break;
+		if (pos->first_reg + pos->num_reg > first_reg)
+			return -EEXIST;
+	}
+
+	range = talloc_zero(store, struct reg_range);
+	range->first_reg = first_reg;
+	range->num_reg = num_reg;
+	range->regs = talloc_zero_array(range, uint16_t, num_reg);
+	llist_add_tail(&range->list, &pos->list);
+
+	for (reg = first_reg; reg < end; reg++) {
+		sp = reg_sparse_find(store, reg);
+		if (!sp)
+			continue;
+		range->regs[reg - first_reg] = sp->val;
+		rb_erase(&sp->node, &store->sparse);
+		talloc_free(sp);
+	}
+	return 0;
+}
+
+int osmo_modbus_reg_store_set(struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			      unsigned int num_reg, const uint16_t *values)
+{
+	uint32_t reg = first_reg, end = (uint32_t)first_reg + num_reg;
+	struct reg_range *range;
+	unsigned int i, n;
+
+	if (end > 0x10000)
+		return -EINVAL;
+
+	while (reg < end) {
+		range = reg_range_find(store, reg);
+		if (!range) {
+			osmo_store16be(*values++, &reg_sparse_get(store, reg)->val);
+			reg++;
+			continue;
+		}
+		n = OSMO_MIN(end, range->first_reg + range->num_reg) - reg;
+		for (i = 0; i < n; i++)
+			osmo_store16be(values[i], &range->regs[reg - range->first_reg + i]);
+		values += n;
+		reg += n;
+	}
+	return 0;
+}
+
+/* Copy raw (big endian) register values, as carried by the prims.
+ * Returns -ENOENT if any of the registers is not in the store. */
+int reg_store_read_raw(const struct osmo_modbus_reg_store *store, uint16_t first_reg,
+		       unsigned int num_reg, uint16_t *registers)
+{
+	uint32_t reg = first_reg, end = (uint32_t)first_reg + num_reg;
+	struct reg_range *range;
+	struct reg_sparse *sp;
+	unsigned int n;
+
+	if (end > 0x10000)
+		return -EINVAL;
+
+	while (reg < end) {
+		range = reg_range_find(store, reg);
+		if (!range) {
+			if (!(sp = reg_sparse_find(store, reg)))
+				return -ENOENT;
+			*registers++ = sp->val;
+			reg++;
+			continue;
+		}
+		n = OSMO_MIN(end, range->first_reg + range->num_reg) - reg;
+		memcpy(registers, &range->regs[reg - range->first_reg], n * sizeof(uint16_t));
+		registers += n;
+		reg += n;
+	}
+	return 0;
+}
+
+/* Write raw (big endian) values, only if the store holds all of the registers.
+ * Returns -ENOENT without writing anything otherwise. */
+int reg_store_write_raw(struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			unsigned int num_reg, const uint16_t *registers)
+{
+	uint32_t reg = first_reg, end = (uint32_t)first_reg + num_reg;
+	struct reg_range *range;
+	struct reg_sparse *sp;
+	unsigned int n;
+
+	if (end > 0x10000)
+		return -EINVAL;
+
+	/* Check first, so that the write is all or nothing */
+	while (reg < end) {
+		range = reg_range_find(store, reg);
+		if (!range) {
+			if (!reg_sparse_find(store, reg))
+				return -ENOENT;
+			reg++;
+			continue;
+		}
+		reg = OSMO_MIN(end, range->first_reg + range->num_reg);
+	}
+
+	reg = first_reg;
+	while (reg < end) {
+		range = reg_range_find(store, reg);
+		if (!range) {
+			sp = reg_sparse_find(store, reg);
+			sp->val = *registers++;
+			reg++;
+			continue;
+		}
+		n = OSMO_MIN(end, range->first_reg + range->num_reg) - reg;
+		memcpy(&range->regs[reg - range->first_reg], registers, n * sizeof(uint16_t));
+		registers += n;
+		reg += n;
+	}
+	return 0;
+}
+
+int osmo_modbus_reg_store_get(const struct osmo_modbus_reg_store *store, uint16_t first_reg,
+			      unsigned int num_reg, uint16_t *values)
+{
+	unsigned int i;
+	int rc;
+
+	rc = reg_store_read_raw(store, first_reg, num_reg, values);
+	if (rc < 0)
+		return rc;
+	for (i = 0; i < num_reg; i++)
+		values[i] = osmo_load16be(&values[i]);
+	return 0;
+}
@@ -1,28 +1,76 @@
 #pragma once
 
+#include <time.h>
+
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/timer.h>
 
 #include <osmocom/modbus/modbus_rtu.h>
 #include <osmocom/modbus/modbus_prim.h>
+#include <osmocom/modbus/modbus_crc16.h>
+
+#include "timer_wheel.h"
 
 struct osmo_modbus_conn_rtu {
 	struct osmo_modbus_conn* conn; /* backpointer */
 	char *dev_path;
 	unsigned baudrate;
 	struct osmo_fd ofd;
+	/* Rx stream buffer: data points to the start of the frame being
+	 * received, and may be followed by (parts of) the next frames */
 	struct msgb *rx_msg;
 	bool rx_msg_ok; /* OK (true) or NOK (false) */ /* TODO: use msg->cb instead to store the OK/NOK */
+	uint16_t rx_crc; /* CRC register over the first rx_crc_len bytes, 0 when they hold a full valid frame */
+	uint16_t rx_crc_len; /* Bytes of the current frame fed to rx_crc */
+	uint16_t rx_frame_len; /* Length of the frame being decoded, set in CTRL_WAIT */
+	bool early_delivery; /* Deliver rx frames as soon as they are complete */
+	bool rx_early; /* rx_msg was found complete before T1.5 expired */
+	bool lazy_silence; /* Check T1.5 against rx_last_ts instead of rearming it on each read */
+	struct timespec rx_last_ts; /* CLOCK_MONOTONIC time of last read(), if lazy_silence */
+	bool use_timerfd; /* Run T1.5/T3.5 on timer_ofd instead of the FSM timer */
+	struct osmo_fd timer_ofd; /* timerfd, fd -1 if not in use */
+	int timer_T; /* T running on timer_ofd or wheel_timer */
+	struct modbus_twheel_timer wheel_timer; /* Used instead of timer_ofd if the conn is in a bus group */
+	bool resync; /* Look for the next frame start after a corrupted frame */
+	struct osmo_modbus_rtu_resync_stats resync_stats;
+	struct osmo_modbus_rtu_rs485 rs485;
+	bool echo_suppress; /* Discard the echo of emitted frames */
+	struct msgb *echo_msg; /* Last emitted frame, while its echo is awaited */
+	struct osmo_modbus_rtu_echo_stats echo_stats;
 	struct msgb *tx_msg;
 	struct osmo_tdef *T_defs;
 	struct osmo_fsm_inst *fi;
 };
 
-struct msgb* prim2rtu(struct osmo_modbus_prim *prim);
-int rtu2prim(struct osmo_modbus_conn_rtu* rtu, struct msgb* msg, struct osmo_modbus_prim **prim);
+struct msgb* prim2rtu(struct osmo_modbus_conn_rtu* rtu, struct osmo_modbus_prim *prim);
+int rtu2prim(struct osmo_modbus_conn_rtu* rtu, const uint8_t *data, size_t len, struct osmo_modbus_prim **prim);
+int rtu_rx_expected_len(const struct osmo_modbus_conn_rtu* rtu);
+int rtu_rx_frame_len(const struct osmo_modbus_conn_rtu* rtu);
+int rtu_rx_cur_frame_len(const struct osmo_modbus_conn_rtu* rtu);
+bool rtu_rx_frame_complete(const struct osmo_modbus_conn_rtu* rtu);
+void rtu_rx_update_crc(struct osmo_modbus_conn_rtu* rtu);
+void rtu_rx_consume(struct osmo_modbus_conn_rtu* rtu, unsigned int len);
+int rtu_rx_resync(struct osmo_modbus_conn_rtu* rtu);
+
+/* Drop everything in the rx buffer */
+static inline void rtu_rx_reset(struct osmo_modbus_conn_rtu *rtu)
+{
+	msgb_reset(rtu->rx_msg);
+	rtu->rx_crc = OSMO_MODBUS_CRC16_INIT;
+	rtu->rx_crc_len = 0;
+}
+
+/* Silence on the line since the last received chars, in microseconds */
+static inline long rtu_rx_silence_us(const struct osmo_modbus_conn_rtu *rtu)
+{
+	struct timespec now, diff;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &rtu->rx_last_ts, &diff);
+	return diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
 
 /* 1 RTU char: start bit, 8 data bits, stop bit, and parity bit (or 2nd stop bit if no parity) */
 static inline unsigned long rtu_chars2bits(unsigned long num_chars) {
 	return num_chars*11;
 }
-
-uint16_t crc16(uint8_t *buffer, uint16_t buffer_length);
@@ -0,0 +1,49 @@
+/*! \file rtu_serial.c
+ * Serial line setup not covered by osmo_serial_*() */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "rtu_serial.h"
+
+/* Set a baudrate without a standard speed_t (Bnnn) value, such as 250000 or
+ * 1000000, through termios2 BOTHER. Returns 0 on success, negative errno otherwise. */
+int rtu_serial_set_custom_baudrate(int fd, unsigned int baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -errno;
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+
+	if (ioctl(fd, TCSETS2, &tio) < 0)
+		return -errno;
+	return 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/* Kept apart from rtu_internal.h: the kernel termios2 definitions used to
+ * implement it clash with glibc's <termios.h> */
+int rtu_serial_set_custom_baudrate(int fd, unsigned int baudrate);
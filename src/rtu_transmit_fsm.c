@@ -23,6 +23,9 @@
  */
 #include <errno.h>
 
+#include <unistd.h>
+#include <time.h>
+
 #include <osmocom/core/fsm.h>
 #include <osmocom/core/utils.h>
 #include <osmocom/core/timer.h>
@@ -54,21 +57,26 @@ static const struct osmo_tdef_state_timeout rtu_transmit_fsm_timeouts[32] = {
 	[RTU_TRANSMIT_ST_CTRL_WAIT] = { /* dynamic */ },
 };
 
-/* Transition to a state, using the T timer defined in assignment_fsm_timeouts.
- * The actual timeout value is in turn obtained from rtu->T_defs.
- * Assumes local variable fi exists. */
-#define rtu_transmit_fsm_state_chg(fi, state) \
-	osmo_tdef_fsm_inst_state_chg(fi, state, \
-				     rtu_transmit_fsm_timeouts, \
-				     ((struct osmo_modbus_conn_rtu*)(fi->priv))->T_defs, \
-				     -1)
-
 static void rearm_timer_with_factor(struct osmo_fsm_inst *fi, int T, long factor_us) {
 	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
 	unsigned long timeout_us = osmo_tdef_get(rtu->T_defs, T, OSMO_TDEF_US, -1);
+	struct timespec ts;
 	timeout_us += factor_us;
-	fi->T = T;
 	LOGPFSML(fi, LOGL_DEBUG, "Rearm T%d {%ld, %ld} (%ld)\n", T, timeout_us / 1000000, timeout_us % 1000000, factor_us);
+	if (rtu->wheel_timer.wheel) {
+		rtu->timer_T = T;
+		modbus_twheel_timer_schedule(&rtu->wheel_timer, timeout_us);
+		return;
+	}
+	if (rtu->timer_ofd.fd >= 0) {
+		/* An all-zero it_value would disarm the timerfd instead */
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000 ? : 1;
+		rtu->timer_T = T;
+		osmo_timerfd_schedule(&rtu->timer_ofd, &ts, NULL);
+		return;
+	}
+	fi->T = T;
 	osmo_timer_schedule(&fi->timer, timeout_us / 1000000, timeout_us % 1000000);
 }
 
@@ -76,18 +84,44 @@ static void rearm_timer(struct osmo_fsm_inst *fi, int T) {
 	rearm_timer_with_factor(fi, T, 0);
 }
 
+/* Transition to a state, using the T timer defined in rtu_transmit_fsm_timeouts.
+ * The actual timeout value is in turn obtained from rtu->T_defs. */
+static void rtu_transmit_fsm_state_chg(struct osmo_fsm_inst *fi, uint32_t state)
+{
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
+	int T = rtu_transmit_fsm_timeouts[state].T;
+
+	if (!rtu->wheel_timer.wheel && rtu->timer_ofd.fd < 0) {
+		osmo_tdef_fsm_inst_state_chg(fi, state, rtu_transmit_fsm_timeouts, rtu->T_defs, -1);
+		return;
+	}
+
+	/* Framing timers run on the group wheel or the timerfd, which the FSM
+	 * doesn't know about. Arm them before the state change so that onenter
+	 * can override it. */
+	if (T)
+		rearm_timer(fi, T);
+	else if (rtu->wheel_timer.wheel)
+		modbus_twheel_timer_del(&rtu->wheel_timer);
+	else
+		osmo_timerfd_disable(&rtu->timer_ofd);
+	osmo_fsm_inst_state_chg(fi, state, 0, 0);
+}
+
 static void rtu_transmit_fsm_st_initial_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
 }
 
 static void rtu_transmit_fsm_st_initial(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
-	//struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
 	switch (event) {
 	case RTU_TRANSMIT_EV_START:
 		rearm_timer(fi, 35);
 		break;
 	case RTU_TRANSMIT_EV_CHAR_RECEIVED:
+		/* Tail of a frame started before us, not to be parsed */
+		rtu_rx_reset(rtu);
 		rearm_timer(fi, 35);
 		break;
 	case RTU_TRANSMIT_EV_T35_TIMEOUT:
@@ -144,84 +178,175 @@ static void rtu_transmit_fsm_st_emission(struct osmo_fsm_inst *fi, uint32_t even
 
 static void rtu_transmit_fsm_st_reception_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
+
+	/* The whole frame may have arrived in the first read() */
+	if (rtu->early_delivery && rtu_rx_frame_complete(rtu)) {
+		rtu->rx_early = true;
+		rtu_transmit_fsm_state_chg(fi, RTU_TRANSMIT_ST_CTRL_WAIT);
+	}
 }
 
 static void rtu_transmit_fsm_st_reception(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
+	long silence_us;
+
 	switch (event) {
 	case RTU_TRANSMIT_EV_CHAR_RECEIVED:
-		rearm_timer(fi, 15);
+		if (rtu->early_delivery && rtu_rx_frame_complete(rtu)) {
+			rtu->rx_early = true;
+			rtu_transmit_fsm_state_chg(fi, RTU_TRANSMIT_ST_CTRL_WAIT);
+			break;
+		}
+		/* With lazy_silence, T1.5 is checked against rx_last_ts on expiry */
+		if (!rtu->lazy_silence)
+			rearm_timer(fi, 15);
 		break;
 	case RTU_TRANSMIT_EV_T15_TIMEOUT:
+		if (rtu->lazy_silence) {
+			silence_us = rtu_rx_silence_us(rtu);
+			if (silence_us < osmo_tdef_get(rtu->T_defs, 15, OSMO_TDEF_US, -1)) {
+				/* More chars arrived meanwhile, wait for the rest of T1.5 */
+				rearm_timer_with_factor(fi, 15, -silence_us);
+				break;
+			}
+		}
 		rtu_transmit_fsm_state_chg(fi, RTU_TRANSMIT_ST_CTRL_WAIT);
 		break;
+	case RTU_TRANSMIT_EV_DEMAND_OF_EMISSION:
+		/* rtu->tx_msg is kept and sent once the bus is idle again */
+		LOGPFSML(fi, LOGL_DEBUG, "Deferring emission until end of frame reception\n");
+		break;
 	default:
 		OSMO_ASSERT(0);
 	}
 }
 
+/* Decode the frame at the start of rx_msg and consume it. Returns prim to be delivered, if any. */
+static struct osmo_modbus_prim *rtu_rx_decode(struct osmo_fsm_inst *fi)
+{
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
+	struct osmo_modbus_prim *prim = NULL;
+	int rc;
+
+	if (rtu->rx_msg_ok) {
+		rc = rtu2prim(rtu, msgb_data(rtu->rx_msg), rtu->rx_frame_len, &prim);
+		if (rc == -ENODATA) { /* Not enough data yet, simply wait until more data is received */
+			LOGP(DLMODBUS_RTU, LOGL_DEBUG, "Not enough rx data yet\n");
+			rtu->rx_msg_ok = false;
+		}
+		if (rc < 0) {
+			LOGP(DLMODBUS_RTU, LOGL_ERROR, "Rx Error!\n");
+			rtu->rx_msg_ok = false;
+		}
+	} else if (rtu->resync) {
+		LOGP(DLMODBUS_RTU, LOGL_ERROR, "NOK message, resyncing\n");
+		rtu_rx_resync(rtu);
+		return NULL;
+	} else {
+		LOGP(DLMODBUS_RTU, LOGL_ERROR, "Dropping NOK message\n");
+	}
+	rtu_rx_consume(rtu, rtu->rx_frame_len);
+	return rtu->rx_msg_ok ? prim : NULL;
+}
+
 static void rtu_transmit_fsm_st_ctrlwait_onenter(struct osmo_fsm_inst *fi, uint32_t prev_state)
 {
 	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
-	uint16_t exp_crc, got_crc;
+	struct osmo_modbus_prim *prim;
 	long time_factor_us;
-	uint8_t *data;
 	unsigned int len;
 
-	/* T1.5 already triggered, which means to reach T3.5 we have to wait for
-	 * "T2" aka 2 character timers */
-	time_factor_us = -1 * (rtu_chars2bits(1500000) / rtu->baudrate);
-	rearm_timer_with_factor(fi, 35, time_factor_us);
+	if (rtu->rx_early) {
+		/* Last char was just received, the whole T3.5 is still ahead */
+		rearm_timer(fi, 35);
+	} else if (rtu->lazy_silence) {
+		/* Silence since the last char counts towards T3.5 */
+		time_factor_us = OSMO_MIN(rtu_rx_silence_us(rtu),
+					  (long)osmo_tdef_get(rtu->T_defs, 35, OSMO_TDEF_US, -1));
+		rearm_timer_with_factor(fi, 35, -time_factor_us);
+	} else {
+		/* T1.5 already triggered, which means to reach T3.5 we have to wait for
+		 * "T2" aka 2 character timers */
+		time_factor_us = -1 * (rtu_chars2bits(1500000) / rtu->baudrate);
+		rearm_timer_with_factor(fi, 35, time_factor_us);
+	}
 
 	OSMO_ASSERT(rtu->rx_msg);
-	data = msgb_data(rtu->rx_msg);
-	len = msgb_length(rtu->rx_msg);
-
-	if (len < sizeof(uint16_t)) {
-		LOGPFSML(fi, LOGL_INFO, "Cannot generate CRC, rx msg len: %d\n", len);
-		rtu->rx_msg_ok = false;
-		return;
+	len = rtu_rx_frame_len(rtu);
+	if (len > 0) {
+		/* Full frame with valid CRC, any bytes past it start the next one */
+		rtu->rx_frame_len = len;
+		rtu->rx_msg_ok = true;
+	} else {
+		len = rtu_rx_cur_frame_len(rtu);
+		rtu->rx_frame_len = len;
+		if (len < sizeof(uint16_t)) {
+			LOGPFSML(fi, LOGL_INFO, "Cannot generate CRC, rx msg len: %d\n", len);
+			rtu->rx_msg_ok = false;
+			return;
+		}
+		/* Mark NOK if CRC fails. The CRC register was fed while receiving
+		 * (rtu_read()), and reaches 0 once a frame and its CRC are complete */
+		rtu->rx_msg_ok = rtu->rx_crc == 0;
 	}
-
-	/* Mark NOK if CRC fails */
-	memcpy(&got_crc, &data[len - sizeof(uint16_t)], sizeof(uint16_t));
-	exp_crc = crc16(data, len - sizeof(uint16_t));
-	osmo_store16be(exp_crc, &exp_crc);
-	rtu->rx_msg_ok = got_crc == exp_crc;
-	LOGPFSML(fi, LOGL_DEBUG, "CRC: got=0x08%x vs exp=0x08%x: %s\n", got_crc, exp_crc,
+	LOGPFSML(fi, LOGL_DEBUG, "CRC: residue=0x%04x, frame len %u: %s\n", rtu->rx_crc, len,
 		 rtu->rx_msg_ok ? "OK" : "NOK");
+
+	if (rtu->rx_early) {
+		/* Early delivery: submit to upper layers now, any emission
+		 * they request is deferred until T3.5 expires */
+		LOGPFSML(fi, LOGL_DEBUG, "Frame complete, delivering before T3.5\n");
+		prim = rtu_rx_decode(fi);
+		if (prim)
+			osmo_modbus_conn_rx_prim(rtu->conn, prim);
+	}
 }
 
 static void rtu_transmit_fsm_st_ctrlwait(struct osmo_fsm_inst *fi, uint32_t event, void *data)
 {
 	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)fi->priv;
 	struct osmo_modbus_prim *prim = NULL;
-	int rc;
+	int len;
 
 	switch (event) {
 	case RTU_TRANSMIT_EV_CHAR_RECEIVED:
+		if (rtu->rx_early || rtu_rx_frame_len(rtu) > 0 || rtu_rx_expected_len(rtu) > 0) {
+			/* Frame is delimited by its length, chars are kept for the next one */
+			LOGPFSML(fi, LOGL_DEBUG, "Char received while in state CTRL WAIT, buffering as next frame\n");
+			break;
+		}
 		LOGP(DLMODBUS_RTU, LOGL_ERROR, "Char received while in state CTRL WAIT, marking rx msg as NOK\n");
 		rtu->rx_msg_ok = false;
+		rtu->rx_frame_len = msgb_length(rtu->rx_msg);
+		break;
+	case RTU_TRANSMIT_EV_DEMAND_OF_EMISSION:
+		/* rtu->tx_msg is kept and sent once T3.5 expires */
+		LOGPFSML(fi, LOGL_DEBUG, "Deferring emission until T3.5 expires\n");
 		break;
 	case RTU_TRANSMIT_EV_T35_TIMEOUT:
-		/* TODO: submit OK rx_msg to upper layers */
-		if (rtu->rx_msg_ok) {
-			rc = rtu2prim(rtu, rtu->rx_msg, &prim);
-			if (rc == -ENODATA) { /* Not enough data yet, simply wait until more data is received */
-				LOGP(DLMODBUS_RTU, LOGL_DEBUG, "Not enough rx data yet\n");
-				rtu->rx_msg_ok = false;
-			}
-			if (rc < 0) {
-				LOGP(DLMODBUS_RTU, LOGL_ERROR, "Rx Error!\n");
-				rtu->rx_msg_ok = false;
-			}
+		if (rtu->rx_early) {
+			/* Already delivered */
+			rtu->rx_early = false;
 		} else {
-			LOGP(DLMODBUS_RTU, LOGL_ERROR, "Dropping NOK message\n");
+			prim = rtu_rx_decode(fi);
+			if (prim)
+				osmo_modbus_conn_rx_prim(rtu->conn, prim);
 		}
-		msgb_trim(rtu->rx_msg, 0);
-		rtu_transmit_fsm_state_chg(fi, RTU_TRANSMIT_ST_IDLE);
-		if (rtu->rx_msg_ok)
-			osmo_modbus_conn_rx_prim(rtu->conn, prim);
+		/* Further frames read back-to-back with it are parsed in place.
+		 * Emissions requested meanwhile are deferred as usual. */
+		while ((len = rtu_rx_frame_len(rtu)) > 0) {
+			rtu->rx_frame_len = len;
+			rtu->rx_msg_ok = true;
+			prim = rtu_rx_decode(fi);
+			if (prim)
+				osmo_modbus_conn_rx_prim(rtu->conn, prim);
+		}
+		if (msgb_length(rtu->rx_msg) > 0)
+			rtu_transmit_fsm_state_chg(fi, RTU_TRANSMIT_ST_RECEPTION);
+		else
+			rtu_transmit_fsm_state_chg(fi, rtu->tx_msg ? RTU_TRANSMIT_ST_EMISSION : RTU_TRANSMIT_ST_IDLE);
 		break;
 	default:
 		OSMO_ASSERT(0);
@@ -256,7 +381,8 @@ static const struct osmo_fsm_state rtu_transmit_states[] = {
 	},
 	[RTU_TRANSMIT_ST_RECEPTION] = {
 		.in_event_mask = X(RTU_TRANSMIT_EV_CHAR_RECEIVED) |
-				 X(RTU_TRANSMIT_EV_T15_TIMEOUT),
+				 X(RTU_TRANSMIT_EV_T15_TIMEOUT) |
+				 X(RTU_TRANSMIT_EV_DEMAND_OF_EMISSION),
 		.out_state_mask = X(RTU_TRANSMIT_ST_CTRL_WAIT),
 		.name = "RECEPTION",
 		.action = rtu_transmit_fsm_st_reception,
@@ -264,17 +390,20 @@ static const struct osmo_fsm_state rtu_transmit_states[] = {
 	},
 	[RTU_TRANSMIT_ST_CTRL_WAIT] = {
 		.in_event_mask = X(RTU_TRANSMIT_EV_CHAR_RECEIVED) |
+				 X(RTU_TRANSMIT_EV_DEMAND_OF_EMISSION) |
 				 X(RTU_TRANSMIT_EV_T35_TIMEOUT),
-		.out_state_mask = X(RTU_TRANSMIT_ST_IDLE),
+		.out_state_mask = X(RTU_TRANSMIT_ST_IDLE) |
+				  X(RTU_TRANSMIT_ST_EMISSION) |
+				  X(RTU_TRANSMIT_ST_RECEPTION),
 		.name = "CTRL_WAIT",
 		.action = rtu_transmit_fsm_st_ctrlwait,
 		.onenter = rtu_transmit_fsm_st_ctrlwait_onenter,
 	},
 };
 
-static int rtu_transmit_fsm_timer_cb(struct osmo_fsm_inst *fi)
+static void rtu_transmit_fsm_timer_expired(struct osmo_fsm_inst *fi, int T)
 {
-	switch (fi->T) {
+	switch (T) {
 	case 15:
 		osmo_fsm_inst_dispatch(fi, RTU_TRANSMIT_EV_T15_TIMEOUT, NULL);
 		break;
@@ -282,9 +411,34 @@ static int rtu_transmit_fsm_timer_cb(struct osmo_fsm_inst *fi)
 		osmo_fsm_inst_dispatch(fi, RTU_TRANSMIT_EV_T35_TIMEOUT, NULL);
 		break;
 	}
+}
+
+static int rtu_transmit_fsm_timer_cb(struct osmo_fsm_inst *fi)
+{
+	rtu_transmit_fsm_timer_expired(fi, fi->T);
 	return 0;
 }
 
+/* rtu->timer_ofd expired, see osmo_modbus_conn_rtu_set_timerfd() */
+int rtu_transmit_fsm_timerfd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)ofd->data;
+	uint64_t expire_count;
+
+	if (read(ofd->fd, &expire_count, sizeof(expire_count)) != sizeof(expire_count))
+		return 0;
+	rtu_transmit_fsm_timer_expired(rtu->fi, rtu->timer_T);
+	return 0;
+}
+
+/* rtu->wheel_timer expired, see osmo_modbus_bus_group_add() */
+void rtu_transmit_fsm_wheel_cb(void *data)
+{
+	struct osmo_modbus_conn_rtu *rtu = (struct osmo_modbus_conn_rtu *)data;
+
+	rtu_transmit_fsm_timer_expired(rtu->fi, rtu->timer_T);
+}
+
 struct osmo_fsm rtu_transmit_fsm = {
 	.name = "RTU_TRANSMIT",
 	.states = rtu_transmit_states,
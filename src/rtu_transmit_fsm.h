@@ -19,3 +19,7 @@ enum rtu_transmit_event {
 };
 
 extern struct osmo_fsm rtu_transmit_fsm;
+
+struct osmo_fd;
+int rtu_transmit_fsm_timerfd_cb(struct osmo_fd *ofd, unsigned int what);
+void rtu_transmit_fsm_wheel_cb(void *data);
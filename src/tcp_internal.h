@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/linuxlist.h>
+
+#include <osmocom/modbus/modbus_tcp.h>
+#include <osmocom/modbus/modbus_prim.h>
+
+/* MBAP header: Transaction Id (2B) + Protocol Id (2B) + Length (2B) + Unit Id (1B) */
+#define MBAP_HDR_LEN 7
+/* MBAP header + max PDU (253B) */
+#define MBAP_MAX_ADU_LEN 260
+
+/* A TCP connection messages are exchanged on */
+struct tcp_peer {
+	struct llist_head list; /* slave: item in tcp->clients */
+	struct osmo_modbus_conn_tcp *tcp; /* backpointer */
+	struct osmo_fd ofd;
+	struct msgb *rx_msg; /* partial ADU(s) read from the stream */
+	struct llist_head tx_queue; /* ADUs waiting for the socket to be writable */
+};
+
+struct osmo_modbus_conn_tcp {
+	struct osmo_modbus_conn* conn; /* backpointer */
+	char *host;
+	uint16_t port;
+	unsigned int max_inflight; /* master: requests pipelined on the connection */
+	unsigned int max_clients; /* slave: masters served at once */
+	struct osmo_fd ofd; /* slave: listen socket */
+	struct tcp_peer server; /* master: connection to the slave */
+	struct llist_head clients; /* slave: struct tcp_peer, connections accepted from masters */
+	unsigned int num_clients;
+	struct tcp_peer *req_peer; /* slave: where the request being answered came from, NULL if gone */
+	struct llist_head rx_queue; /* slave: requests waiting for the conn to be IDLE */
+	struct osmo_timer_list rx_timer; /* slave: hand rx_queue over to the conn */
+};
+
+/* slave: client a queued request came from, stored in the control buffer of its msgb */
+#define TCP_RX_PEER(msg) (*(struct tcp_peer **)&(msg)->cb[0])
+
+struct msgb* prim2mbap(struct osmo_modbus_conn_tcp* tcp, struct osmo_modbus_prim *prim);
+int mbap2prim(struct osmo_modbus_conn_tcp* tcp, const uint8_t *data, size_t len, struct osmo_modbus_prim **prim);
@@ -0,0 +1,271 @@
+/*! \file timer_wheel.c
+ * Hierarchical timing wheel driven by a single timerfd */
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <osmocom/core/timer.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK	(MODBUS_TWHEEL_SLOTS - 1)
+/* Ticks covered by levels 0..level */
+#define LEVEL_SPAN(level) (1ULL << (MODBUS_TWHEEL_BITS * ((level) + 1)))
+
+/* Microseconds elapsed since tick 0 */
+static uint64_t twheel_elapsed_us(const struct modbus_twheel *wheel)
+{
+	struct timespec now, diff;
+
+	osmo_clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &wheel->base, &diff);
+	return (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+/* File timer in the slot where it belongs relative to wheel->now: level 0 if
+ * it expires within SLOTS ticks, else the level whose slot gets cascaded
+ * right before it expires. */
+static void twheel_insert(struct modbus_twheel *wheel, struct modbus_twheel_timer *timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	uint64_t tick = timer->expires;
+	unsigned int level;
+
+	for (level = 0; level < MODBUS_TWHEEL_LEVELS - 1; level++) {
+		if (delta < LEVEL_SPAN(level))
+			break;
+	}
+	/* Beyond the wheel range (minutes): park it at the far end, it is filed
+	 * again from there once cascaded */
+	if (delta >= LEVEL_SPAN(level))
+		tick = wheel->now + LEVEL_SPAN(level) - 1;
+
+	timer->level = level;
+	timer->slot = (tick >> (MODBUS_TWHEEL_BITS * level)) & SLOT_MASK;
+	llist_add_tail(&timer->list, &wheel->slots[level][timer->slot]);
+	wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+static void twheel_unlink(struct modbus_twheel *wheel, struct modbus_twheel_timer *timer)
+{
+	llist_del_init(&timer->list);
+	if (llist_empty(&wheel->slots[timer->level][timer->slot]))
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+/* Next tick with work to do: a level 0 slot to expire, or a slot of an upper
+ * level to cascade. UINT64_MAX if no timer is pending. */
+static uint64_t twheel_next_tick(const struct modbus_twheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+	unsigned int level;
+
+	for (level = 0; level < MODBUS_TWHEEL_LEVELS; level++) {
+		unsigned int shift = MODBUS_TWHEEL_BITS * level;
+		uint64_t occupied = wheel->occupied[level];
+		unsigned int rot, dist;
+		uint64_t tick;
+
+		if (!occupied)
+			continue;
+		/* Current slot has already been processed: search from the
+		 * next one on, wrapping around up to the current one */
+		rot = (((wheel->now >> shift) + 1) & SLOT_MASK);
+		if (rot)
+			occupied = (occupied >> rot) | (occupied << (MODBUS_TWHEEL_SLOTS - rot));
+		dist = __builtin_ctzll(occupied) + 1;
+		tick = ((wheel->now >> shift) + dist) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/* Move down the timers of the upper level slots starting at tick wheel->now.
+ * Higher levels go first, so that their timers can still be cascaded further
+ * during the same tick. */
+static void twheel_cascade(struct modbus_twheel *wheel)
+{
+	int level, top = 0;
+
+	while (top < MODBUS_TWHEEL_LEVELS - 1 &&
+	       !(wheel->now & ((1ULL << (MODBUS_TWHEEL_BITS * (top + 1))) - 1)))
+		top++;
+
+	for (level = top; level > 0; level--) {
+		unsigned int slot = (wheel->now >> (MODBUS_TWHEEL_BITS * level)) & SLOT_MASK;
+		struct modbus_twheel_timer *timer, *tmp;
+		LLIST_HEAD(list);
+
+		if (!(wheel->occupied[level] & (1ULL << slot)))
+			continue;
+		llist_splice_init(&wheel->slots[level][slot], &list);
+		wheel->occupied[level] &= ~(1ULL << slot);
+		llist_for_each_entry_safe(timer, tmp, &list, list) {
+			llist_del(&timer->list);
+			twheel_insert(wheel, timer);
+			wheel->cascaded++;
+		}
+	}
+}
+
+static void twheel_expire(struct modbus_twheel *wheel)
+{
+	unsigned int slot = wheel->now & SLOT_MASK;
+	struct modbus_twheel_timer *timer;
+	LLIST_HEAD(list);
+
+	if (!(wheel->occupied[0] & (1ULL << slot)))
+		return;
+	llist_splice_init(&wheel->slots[0][slot], &list);
+	wheel->occupied[0] &= ~(1ULL << slot);
+
+	/* Callbacks may delete or rearm any timer, including the ones still
+	 * in list: take them one by one */
+	while (!llist_empty(&list)) {
+		timer = llist_first_entry(&list, struct modbus_twheel_timer, list);
+		llist_del_init(&timer->list);
+		/* Never expire early */
+		if (timer->expires > wheel->now) {
+			twheel_insert(wheel, timer);
+			continue;
+		}
+		wheel->num_pending--;
+		wheel->expired++;
+		timer->cb(timer->data);
+	}
+}
+
+/* Arm the timerfd for the next tick with work to do, if it changed */
+static void twheel_rearm(struct modbus_twheel *wheel)
+{
+	uint64_t next = twheel_next_tick(wheel);
+	uint64_t elapsed_us, next_us;
+	struct timespec ts;
+
+	if (next == wheel->armed)
+		return;
+	wheel->armed = next;
+	if (next == UINT64_MAX) {
+		osmo_timerfd_disable(&wheel->ofd);
+		return;
+	}
+
+	elapsed_us = twheel_elapsed_us(wheel);
+	next_us = next * MODBUS_TWHEEL_TICK_US;
+	next_us = next_us > elapsed_us ? next_us - elapsed_us : 0;
+	/* An all-zero it_value would disarm the timerfd instead */
+	ts.tv_sec = next_us / 1000000;
+	ts.tv_nsec = (next_us % 1000000) * 1000 ? : 1;
+	osmo_timerfd_schedule(&wheel->ofd, &ts, NULL);
+}
+
+static int twheel_timerfd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct modbus_twheel *wheel = (struct modbus_twheel *)ofd->data;
+	uint64_t target = twheel_elapsed_us(wheel) / MODBUS_TWHEEL_TICK_US;
+	uint64_t expire_count;
+	uint64_t next;
+
+	if (read(ofd->fd, &expire_count, sizeof(expire_count)) != sizeof(expire_count))
+		return 0;
+	wheel->wakeups++;
+	wheel->armed = UINT64_MAX;
+
+	while ((next = twheel_next_tick(wheel)) <= target) {
+		wheel->now = next;
+		twheel_cascade(wheel);
+		twheel_expire(wheel);
+	}
+	if (target > wheel->now)
+		wheel->now = target;
+
+	twheel_rearm(wheel);
+	return 0;
+}
+
+int modbus_twheel_init(struct modbus_twheel *wheel)
+{
+	unsigned int level, slot;
+	int rc;
+
+	for (level = 0; level < MODBUS_TWHEEL_LEVELS; level++) {
+		for (slot = 0; slot < MODBUS_TWHEEL_SLOTS; slot++)
+			INIT_LLIST_HEAD(&wheel->slots[level][slot]);
+	}
+	osmo_clock_gettime(CLOCK_MONOTONIC, &wheel->base);
+	wheel->armed = UINT64_MAX;
+	wheel->ofd.fd = -1;
+	rc = osmo_timerfd_setup(&wheel->ofd, twheel_timerfd_cb, wheel);
+	if (rc < 0)
+		wheel->ofd.fd = -1;
+	return rc;
+}
+
+/* Pending timers are left pending forever */
+void modbus_twheel_cleanup(struct modbus_twheel *wheel)
+{
+	if (wheel->ofd.fd < 0)
+		return;
+	osmo_fd_unregister(&wheel->ofd);
+	close(wheel->ofd.fd);
+	wheel->ofd.fd = -1;
+}
+
+void modbus_twheel_timer_setup(struct modbus_twheel_timer *timer, struct modbus_twheel *wheel,
+			       void (*cb)(void *data), void *data)
+{
+	INIT_LLIST_HEAD(&timer->list);
+	timer->wheel = wheel;
+	timer->cb = cb;
+	timer->data = data;
+}
+
+void modbus_twheel_timer_schedule(struct modbus_twheel_timer *timer, unsigned long timeout_us)
+{
+	struct modbus_twheel *wheel = timer->wheel;
+	uint64_t expires_us = twheel_elapsed_us(wheel) + timeout_us;
+
+	modbus_twheel_timer_del(timer);
+	/* Round up: the tick must not start before timeout_us elapsed. wheel->now
+	 * may lag behind the current tick, but is never ahead of it. */
+	timer->expires = (expires_us + MODBUS_TWHEEL_TICK_US - 1) / MODBUS_TWHEEL_TICK_US;
+	if (timer->expires <= wheel->now)
+		timer->expires = wheel->now + 1;
+	twheel_insert(wheel, timer);
+	wheel->num_pending++;
+	wheel->scheduled++;
+	if (timer->expires < wheel->armed)
+		twheel_rearm(wheel);
+}
+
+void modbus_twheel_timer_del(struct modbus_twheel_timer *timer)
+{
+	if (!modbus_twheel_timer_pending(timer))
+		return;
+	twheel_unlink(timer->wheel, timer);
+	timer->wheel->num_pending--;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+
+/* Hierarchical timing wheel: MODBUS_TWHEEL_LEVELS levels of
+ * MODBUS_TWHEEL_SLOTS slots, a slot of level L spanning SLOTS^L ticks. Timers
+ * are filed in O(1) and moved down a level at most LEVELS-1 times before
+ * expiring, whatever their number. A single timerfd is armed for the next tick
+ * with work to do. */
+#define MODBUS_TWHEEL_TICK_US	50
+#define MODBUS_TWHEEL_BITS	6
+#define MODBUS_TWHEEL_SLOTS	(1 << MODBUS_TWHEEL_BITS)
+#define MODBUS_TWHEEL_LEVELS	4
+
+struct modbus_twheel;
+
+struct modbus_twheel_timer {
+	struct llist_head list; /* item in a wheel slot, empty if not pending */
+	struct modbus_twheel *wheel; /* NULL if not set up */
+	uint64_t expires; /* tick */
+	uint8_t level;
+	uint8_t slot;
+	void (*cb)(void *data);
+	void *data;
+};
+
+struct modbus_twheel {
+	struct osmo_fd ofd; /* timerfd */
+	struct timespec base; /* CLOCK_MONOTONIC time of tick 0 */
+	uint64_t now; /* Last tick processed */
+	uint64_t armed; /* Tick ofd is armed for, UINT64_MAX if disarmed */
+	uint64_t occupied[MODBUS_TWHEEL_LEVELS]; /* bit s set if slot s is non-empty */
+	struct llist_head slots[MODBUS_TWHEEL_LEVELS][MODBUS_TWHEEL_SLOTS];
+	unsigned int num_pending;
+	unsigned long scheduled;
+	unsigned long expired;
+	unsigned long cascaded;
+	unsigned long wakeups;
+};
+
+int modbus_twheel_init(struct modbus_twheel *wheel);
+void modbus_twheel_cleanup(struct modbus_twheel *wheel);
+
+void modbus_twheel_timer_setup(struct modbus_twheel_timer *timer, struct modbus_twheel *wheel,
+			       void (*cb)(void *data), void *data);
+/* (Re)arm timer to expire in timeout_us, never earlier */
+void modbus_twheel_timer_schedule(struct modbus_twheel_timer *timer, unsigned long timeout_us);
+void modbus_twheel_timer_del(struct modbus_twheel_timer *timer);
+
+static inline bool modbus_twheel_timer_pending(const struct modbus_twheel_timer *timer)
+{
+	return timer->wheel && !llist_empty(&timer->list);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Throughput benchmark of the CRC-16/MODBUS engines against the legacy
+ * byte-at-a-time two-table loop. */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <osmocom/core/utils.h>
+
+#include <osmocom/modbus/modbus_crc16.h>
+
+#define BENCH_BUF_LEN (1024 * 1024)
+
+static unsigned long iterations = 50;
+static const size_t frame_sizes[] = { 8, 64, 256, BENCH_BUF_LEN };
+
+static uint8_t table_crc_hi[256];
+static uint8_t table_crc_lo[256];
+
+static void legacy_tables_init(void)
+{
+	unsigned int i, k;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		table_crc_hi[i] = crc & 0xff;
+		table_crc_lo[i] = crc >> 8;
+	}
+}
+
+/* The CRC function used before the crc16 module was introduced */
+static uint16_t legacy_crc16(const uint8_t *data, size_t data_len)
+{
+	uint8_t crc_hi = 0xFF;
+	uint8_t crc_lo = 0xFF;
+	unsigned int idx;
+
+	while (data_len--) {
+		idx = crc_hi ^ *data++;
+		crc_hi = crc_lo ^ table_crc_hi[idx];
+		crc_lo = table_crc_lo[idx];
+	}
+
+	return (crc_hi << 8 | crc_lo);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns MB/s, compute CRC over the whole buffer in chunks of frame_len */
+static double bench(int engine, const uint8_t *buf, size_t frame_len, uint16_t *acc)
+{
+	unsigned long it;
+	size_t off;
+	double t0, t1;
+
+	t0 = now_sec();
+	for (it = 0; it < iterations; it++) {
+		for (off = 0; off + frame_len <= BENCH_BUF_LEN; off += frame_len) {
+			if (engine < 0)
+				*acc += legacy_crc16(buf + off, frame_len);
+			else
+				*acc += osmo_modbus_crc16(buf + off, frame_len);
+		}
+	}
+	t1 = now_sec();
+	return (double)iterations * BENCH_BUF_LEN / (t1 - t0) / 1e6;
+}
+
+static int verify(const uint8_t *buf)
+{
+	size_t len;
+
+	for (len = 0; len <= 1024; len++) {
+		if (legacy_crc16(buf, len) != osmo_modbus_crc16(buf, len)) {
+			fprintf(stderr, "Mismatch for engine %s at len %zu\n",
+				get_value_string(osmo_modbus_crc16_engine_names, osmo_modbus_crc16_get_engine()),
+				len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void print_help(void)
+{
+	printf("  -h --help			This text.\n");
+	printf("  -n --iterations N		Passes over the 1 MiB test buffer (default %lu)\n", iterations);
+}
+
+static void handle_options(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0, c;
+		static const struct option long_options[] = {
+			{ "help", 0, 0, 'h' },
+			{ "iterations", 1, 0, 'n' },
+			{ NULL, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "hn:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Error in command line options. Exiting\n");
+			exit(1);
+			break;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const int engines[] = { OSMO_MODBUS_CRC16_ENGINE_SLICE8, OSMO_MODBUS_CRC16_ENGINE_CLMUL };
+	uint8_t *buf;
+	uint16_t acc = 0;
+	unsigned int i, j;
+	double legacy_mbs, mbs;
+
+	handle_options(argc, argv);
+
+	legacy_tables_init();
+	buf = malloc(BENCH_BUF_LEN);
+	srandom(0x5eed);
+	for (i = 0; i < BENCH_BUF_LEN; i++)
+		buf[i] = random();
+
+	printf("%-8s %-10s %12s %10s\n", "engine", "frame_len", "MB/s", "speedup");
+	for (i = 0; i < ARRAY_SIZE(frame_sizes); i++) {
+		legacy_mbs = bench(-1, buf, frame_sizes[i], &acc);
+		printf("%-8s %-10zu %12.1f %10s\n", "legacy", frame_sizes[i], legacy_mbs, "1.00x");
+		for (j = 0; j < ARRAY_SIZE(engines); j++) {
+			if (osmo_modbus_crc16_set_engine(engines[j]) < 0)
+				continue;
+			if (verify(buf) < 0)
+				exit(1);
+			mbs = bench(engines[j], buf, frame_sizes[i], &acc);
+			printf("%-8s %-10zu %12.1f %9.2fx\n",
+			       get_value_string(osmo_modbus_crc16_engine_names, engines[j]),
+			       frame_sizes[i], mbs, mbs / legacy_mbs);
+		}
+	}
+	/* Print the accumulator so the compiler can't drop the work */
+	printf("(checksum 0x%04x)\n", acc);
+
+	osmo_modbus_crc16_set_engine(OSMO_MODBUS_CRC16_ENGINE_AUTO);
+	free(buf);
+	return 0;
+}
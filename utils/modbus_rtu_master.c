@@ -49,6 +49,17 @@ static struct osmo_modbus_conn *conn;
 static uint16_t slave_address = 0x01;
 static char device_path[256] = "/dev/ttyUSB0";
 static size_t timeout_response = 0;
+static unsigned baudrate = 0;
+static bool early_delivery;
+static bool lazy_silence;
+static bool use_timerfd;
+static bool use_rs485;
+static bool echo_suppress;
+static bool use_bus_group;
+static bool adaptive_timeout;
+static unsigned int retries;
+static unsigned int quarantine;
+static struct osmo_modbus_bus_group *bus_group;
 
 static void print_help(void)
 {
@@ -57,7 +68,17 @@ static void print_help(void)
 	printf("  -T --timestamp		Print a timestamp in the debug output.\n");
 	printf("  -s  --serial-device PATH	Set serial device (RTU connection)\n");
 	printf("  -a  --slave-addess ADDRESS	Set slave address to talk to\n");
+	printf("  -b --baudrate BAUD		Serial line baudrate, any value (eg. 921600)\n");
 	printf("  -t --timeout-response		Response tmeout, in milliseconds.\n");
+	printf("  -e --early-delivery		Deliver responses as soon as they are complete\n");
+	printf("  -l --lazy-silence		Check inter-char silence lazily from rx timestamps\n");
+	printf("  -f --timerfd			Run the T1.5/T3.5 timers on a timerfd\n");
+	printf("  -r --rs485			Let the kernel drive RTS for RS-485 direction control\n");
+	printf("  -E --echo-suppress		Discard the echo of emitted frames (half-duplex adapters)\n");
+	printf("  -g --bus-group		Run the timers on a bus group wheel (stats on SIGUSR2)\n");
+	printf("  -A --adaptive-timeout		Derive the response timeout from the slave RTT (stats on SIGUSR2)\n");
+	printf("  -R --retries NUM		Resend requests timing out up to NUM times\n");
+	printf("  -Q --quarantine NUM		Quarantine the slave after NUM timeouts in a row (stats on SIGUSR2)\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -71,10 +92,20 @@ static void handle_options(int argc, char **argv)
 			{"serial-device", 1, 0, 's'},
 			{"slave-address", 1, 0, 'a'},
 			{"timeout-response", 1, 0, 'a'},
+			{"baudrate", 1, 0, 'b'},
+			{"early-delivery", 0, 0, 'e'},
+			{"lazy-silence", 0, 0, 'l'},
+			{"timerfd", 0, 0, 'f'},
+			{"rs485", 0, 0, 'r'},
+			{"echo-suppress", 0, 0, 'E'},
+			{"bus-group", 0, 0, 'g'},
+			{"adaptive-timeout", 0, 0, 'A'},
+			{"retries", 1, 0, 'R'},
+			{"quarantine", 1, 0, 'Q'},
 			{ NULL, 0, 0, 0 }
 		};
 
-		c = getopt_long(argc, argv, "hVTs:a:t:", long_options, &option_index);
+		c = getopt_long(argc, argv, "hVTs:a:t:b:elfrEgAR:Q:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -100,6 +131,36 @@ static void handle_options(int argc, char **argv)
 		case 't':
 			timeout_response = atoi(optarg);
 			break;
+		case 'b':
+			baudrate = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			early_delivery = true;
+			break;
+		case 'l':
+			lazy_silence = true;
+			break;
+		case 'f':
+			use_timerfd = true;
+			break;
+		case 'r':
+			use_rs485 = true;
+			break;
+		case 'E':
+			echo_suppress = true;
+			break;
+		case 'g':
+			use_bus_group = true;
+			break;
+		case 'A':
+			adaptive_timeout = true;
+			break;
+		case 'R':
+			retries = atoi(optarg);
+			break;
+		case 'Q':
+			quarantine = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "Error in command line options. Exiting\n");
 			exit(1);
@@ -113,6 +174,39 @@ static void handle_options(int argc, char **argv)
 	}
 }
 
+static void print_bus_group_stats(void)
+{
+	struct osmo_modbus_bus_group_stats stats;
+
+	osmo_modbus_bus_group_get_stats(bus_group, &stats);
+	fprintf(stderr, "bus group: %u/%u conns connected, %u queued, %u in flight\n",
+		stats.num_connected, stats.num_conns, stats.num_queued, stats.num_inflight);
+	fprintf(stderr, "timer wheel: %u pending, %lu scheduled, %lu expired, %lu cascaded, %lu wakeups\n",
+		stats.timers_pending, stats.timers_scheduled, stats.timers_expired,
+		stats.timers_cascaded, stats.timer_wakeups);
+}
+
+static void print_rtt_stats(void)
+{
+	struct osmo_modbus_conn_rtt_stats stats;
+
+	if (osmo_modbus_conn_get_rtt_stats(conn, slave_address, &stats) < 0 || !stats.valid)
+		return;
+	fprintf(stderr, "slave %u: srtt %luus, rttvar %luus, next timeout %luus (%lu samples, %lu timeouts)\n",
+		slave_address, stats.srtt_us, stats.rttvar_us, stats.timeout_us, stats.samples, stats.timeouts);
+}
+
+static void print_health_stats(void)
+{
+	struct osmo_modbus_conn_health_stats stats;
+
+	if (osmo_modbus_conn_get_health_stats(conn, slave_address, &stats) < 0)
+		return;
+	fprintf(stderr, "slave %u: %s, %u timeouts in a row (%lu retries, %lu failed fast, %lu probes, %lu quarantines)\n",
+		slave_address, stats.quarantined ? "quarantined" : "alive", stats.consecutive_timeouts,
+		stats.retries, stats.failed_fast, stats.probes, stats.quarantines);
+}
+
 static void signal_handler(int signal)
 {
 	fprintf(stdout, "signal %u received\n", signal);
@@ -130,6 +224,12 @@ static void signal_handler(int signal)
 		talloc_report_full(tall_ctx, stderr);
 		break;
 	case SIGUSR2:
+		if (bus_group)
+			print_bus_group_stats();
+		if (adaptive_timeout)
+			print_rtt_stats();
+		if (quarantine)
+			print_health_stats();
 		break;
 	default:
 		break;
@@ -201,9 +301,11 @@ int prim_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim, void *
 	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_MULT_HOLD_REG, PRIM_OP_RESPONSE):
 		LOGP(DMAIN, LOGL_INFO, "Received OSMO_MODBUS_PRIM_N_MULT_HOLD_REG RESPONSE!\n");
 		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Read %u registers: %s\n", prim->address,
-		     prim->u.read_mult_hold_reg_resp.num_reg,
-		     osmo_hexdump((uint8_t*)prim->u.read_mult_hold_reg_resp.registers, prim->u.read_mult_hold_reg_resp.num_reg*2));
-		uint16_t voltage_dV = osmo_load16be(prim->u.read_mult_hold_reg_resp.registers);
+		     osmo_modbus_prim_num_reg(prim),
+		     osmo_hexdump((uint8_t*)osmo_modbus_prim_registers(prim), osmo_modbus_prim_num_reg(prim)*2));
+		if (osmo_modbus_prim_num_reg(prim) < 1)
+			break;
+		uint16_t voltage_dV = osmo_modbus_prim_get_reg(prim, 0);
 		double voltage = voltage_dV / 10.0f;
 		LOGP(DMAIN, LOGL_INFO, "Received voltage: %fV\n", voltage);
 		break;
@@ -240,8 +342,27 @@ int main(int argc, char **argv)
 				      OSMO_MODBUS_ROLE_MASTER,
 				      OSMO_MODBUS_PROTO_RTU);
 	osmo_modbus_conn_set_prim_cb(conn, prim_cb, NULL);
+	if (use_bus_group) {
+		bus_group = osmo_modbus_bus_group_alloc(tall_ctx);
+		if (!bus_group || osmo_modbus_bus_group_add(bus_group, conn) < 0) {
+			LOGP(DMAIN, LOGL_ERROR, "Failed setting up the bus group\n");
+			exit(1);
+		}
+	}
 	rtu = osmo_modbus_conn_get_rtu(conn);
 	osmo_modbus_conn_rtu_set_device(rtu, device_path);
+	if (baudrate && osmo_modbus_conn_rtu_set_baudrate(rtu, baudrate) < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Invalid baudrate %u\n", baudrate);
+		exit(1);
+	}
+	osmo_modbus_conn_rtu_set_early_delivery(rtu, early_delivery);
+	osmo_modbus_conn_rtu_set_lazy_silence(rtu, lazy_silence);
+	osmo_modbus_conn_rtu_set_timerfd(rtu, use_timerfd);
+	osmo_modbus_conn_rtu_set_echo_suppress(rtu, echo_suppress);
+	if (use_rs485) {
+		struct osmo_modbus_rtu_rs485 rs485 = { .enabled = true, .rts_on_send = true };
+		osmo_modbus_conn_rtu_set_rs485(rtu, &rs485);
+	}
 
 	if (timeout_response) {
 		if ((rc = osmo_modbus_conn_set_timeout(conn,
@@ -252,7 +373,17 @@ int main(int argc, char **argv)
 						      OSMO_MODBUS_TO_NORESPONSE,
 						      timeout_response)) < 0)
 			LOGP(DMAIN, LOGL_INFO, "Failed setting Response timeout to %zu\n", timeout_response);
+		if ((rc = osmo_modbus_conn_set_timeout(conn,
+						      OSMO_MODBUS_TO_NORESPONSE_MAX,
+						      timeout_response)) < 0)
+			LOGP(DMAIN, LOGL_INFO, "Failed setting max Response timeout to %zu\n", timeout_response);
+	}
+	osmo_modbus_conn_set_adaptive_timeout(conn, adaptive_timeout);
+	if (osmo_modbus_conn_set_retries(conn, retries) < 0) {
+		LOGP(DMAIN, LOGL_ERROR, "Invalid number of retries %u\n", retries);
+		exit(1);
 	}
+	osmo_modbus_conn_set_quarantine(conn, quarantine);
 
 	if ((rc = osmo_modbus_conn_connect(conn)) < 0) {
 		LOGP(DMAIN, LOGL_INFO, "Connect to modbus serial device %s failed! %d\n", device_path, rc);
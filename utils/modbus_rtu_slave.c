@@ -48,6 +48,9 @@ static struct osmo_modbus_conn *conn;
 static uint16_t slave_address = 0x01;
 static char device_path[256] = "/dev/ttyUSB0";
 bool monitor;
+bool resync;
+/* Coil values, written by the master. Discrete inputs read as 0101... */
+static bool coils[0x10000 + OSMO_MODBUS_READ_BITS_MAX];
 
 static void print_help(void)
 {
@@ -57,6 +60,7 @@ static void print_help(void)
 	printf("  -s  --serial-device PATH	Set serial device (RTU connection)\n");
 	printf("  -a  --slave-addess ADDRESS	Set slave address to listen to\n");
 	printf("  -m  --monitor			Enable monitor mode\n");
+	printf("  -r  --resync			Scan for the next frame after a corrupted one\n");
 }
 
 static void handle_options(int argc, char **argv)
@@ -70,10 +74,11 @@ static void handle_options(int argc, char **argv)
 			{"serial-device", 1, 0, 's'},
 			{"slave-address", 1, 0, 'a'},
 			{"monitor", 0, 0, 'm'},
+			{"resync", 0, 0, 'r'},
 			{ NULL, 0, 0, 0 }
 		};
 
-		c = getopt_long(argc, argv, "hVTs:a:m", long_options, &option_index);
+		c = getopt_long(argc, argv, "hVTs:a:mr", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -99,6 +104,9 @@ static void handle_options(int argc, char **argv)
 		case 'm':
 			monitor = true;
 			break;
+		case 'r':
+			resync = true;
+			break;
 		default:
 			fprintf(stderr, "Error in command line options. Exiting\n");
 			exit(1);
@@ -176,12 +184,46 @@ void _log_init(void *tall_ctx)
 	osmo_fsm_log_addr(false);
 }
 
-int prim_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim, void *ctx)
+static void submit_resp(struct osmo_modbus_prim *resp)
 {
-	struct osmo_modbus_prim *resp;
-	uint16_t *buf;
-	int rc;
+	int rc = osmo_modbus_conn_submit_prim(conn, resp);
+	if (rc < 0) {
+		LOGP(DMAIN, LOGL_INFO, "Failed submitting primitive: %d\n", rc);
+		exit(1);
+	}
+}
+
+static void answer_read_bits(const struct osmo_modbus_prim *prim)
+{
+	const struct osmo_modbus_read_bits_req_param *req = &prim->u.read_coils_req;
+	uint8_t bits[OSMO_MODBUS_BITS_BYTES(OSMO_MODBUS_READ_BITS_MAX)];
+	uint8_t byte_count = OSMO_MODBUS_BITS_BYTES(req->num_bits);
+	bool inputs[OSMO_MODBUS_READ_BITS_MAX];
+	unsigned int i;
+
+	if (prim->oph.primitive == OSMO_MODBUS_PRIM_N_READ_COILS) {
+		osmo_modbus_bits_pack_bool(bits, &coils[req->first_bit], req->num_bits);
+		submit_resp(osmo_modbus_makeprim_read_coils_resp(slave_address, byte_count, bits));
+		return;
+	}
+	for (i = 0; i < req->num_bits; i++)
+		inputs[i] = (req->first_bit + i) & 1;
+	osmo_modbus_bits_pack_bool(bits, inputs, req->num_bits);
+	submit_resp(osmo_modbus_makeprim_read_discrete_inputs_resp(slave_address, byte_count, bits));
+}
+
+/* Register requests aimed at us only get here if the register store doesn't
+ * cover them (eg. reaching past register 0xffff), we still have to answer */
+static void answer_reg_fallback(const struct osmo_modbus_prim *prim, uint8_t function_code)
+{
+	if (prim->address != slave_address)
+		return;
+	submit_resp(osmo_modbus_makeprim_exception_resp(slave_address, function_code,
+							OSMO_MODBUS_EXC_ILLEGAL_DATA_ADDRESS));
+}
 
+int prim_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim, void *ctx)
+{
 	LOGP(DMAIN, LOGL_INFO, "prim_cb()!\n");
 	switch (OSMO_PRIM_HDR(&prim->oph)) {
 	case OSMO_PRIM(OSMO_MODBUS_PRIM_RESPONSE_TIMEOUT, PRIM_OP_INDICATION):
@@ -192,21 +234,44 @@ int prim_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim, void *
 		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Read %u registers: start from 0x%04x\n", prim->address,
 		     prim->u.read_mult_hold_reg_req.num_reg,
 		     prim->u.read_mult_hold_reg_req.first_reg);
-
+		answer_reg_fallback(prim, OSMO_MODBUS_FUNC_READ_MULT_HOLD_REG);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_REG, PRIM_OP_REQUEST):
+		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Write %u registers: start from 0x%04x\n", prim->address,
+		     prim->u.write_mult_reg_req.num_reg,
+		     prim->u.write_mult_reg_req.first_reg);
+		answer_reg_fallback(prim, OSMO_MODBUS_FUNC_WRITE_MULT_REG);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_RW_MULT_REG, PRIM_OP_REQUEST):
+		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Write %u registers from 0x%04x, read %u registers from 0x%04x\n",
+		     prim->address,
+		     prim->u.rw_mult_reg_req.write_num_reg, prim->u.rw_mult_reg_req.write_first_reg,
+		     prim->u.rw_mult_reg_req.read_num_reg, prim->u.rw_mult_reg_req.read_first_reg);
+		answer_reg_fallback(prim, OSMO_MODBUS_FUNC_RW_MULT_REG);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_COILS, PRIM_OP_REQUEST):
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_READ_DISCRETE_INPUTS, PRIM_OP_REQUEST):
+		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Read %u %s: start from 0x%04x\n", prim->address,
+		     prim->u.read_coils_req.num_bits,
+		     prim->oph.primitive == OSMO_MODBUS_PRIM_N_READ_COILS ? "coils" : "discrete inputs",
+		     prim->u.read_coils_req.first_bit);
 		/* Avoid answering for requests not aimed at us if we enabled monitor mode */
-		if (!monitor || prim->address == slave_address) {
-			buf = calloc(prim->u.read_mult_hold_reg_req.num_reg, sizeof(uint16_t));
-			memset(buf, 0x2b, prim->u.read_mult_hold_reg_req.num_reg * sizeof(uint16_t));
-			resp = osmo_modbus_makeprim_mult_hold_reg_resp(slave_address,
-								       prim->u.read_mult_hold_reg_req.num_reg,
-								       buf);
-			free(buf);
-			rc = osmo_modbus_conn_submit_prim(conn, resp);
-			if (rc < 0) {
-			     LOGP(DMAIN, LOGL_INFO, "Failed submitting primitive: %d\n", rc);
-			     exit(1);
-			}
-		}
+		if (prim->address == slave_address)
+			answer_read_bits(prim);
+		break;
+	case OSMO_PRIM(OSMO_MODBUS_PRIM_N_WRITE_MULT_COILS, PRIM_OP_REQUEST):
+		LOGP(DMAIN, LOGL_INFO, "[addr=%u] Write %u coils: start from 0x%04x\n", prim->address,
+		     prim->u.write_mult_coils_req.num_coils,
+		     prim->u.write_mult_coils_req.first_coil);
+		if (prim->address != slave_address && prim->address != OSMO_MODBUS_ADDR_BROADCAST)
+			break;
+		osmo_modbus_bits_unpack_bool(&coils[prim->u.write_mult_coils_req.first_coil],
+					     prim->u.write_mult_coils_req.bits,
+					     prim->u.write_mult_coils_req.num_coils);
+		if (prim->address == slave_address)
+			submit_resp(osmo_modbus_makeprim_write_mult_coils_resp(slave_address,
+									      prim->u.write_mult_coils_req.first_coil,
+									      prim->u.write_mult_coils_req.num_coils));
 		break;
 	default:
 		LOGP(DMAIN, LOGL_INFO, "Unhandled primitive operation %s on primitive %s\n",
@@ -218,6 +283,21 @@ int prim_cb(struct osmo_modbus_conn *conn, struct osmo_modbus_prim *prim, void *
 }
 
 
+/* Answer reads and writes of any register, initially 0x2b2b */
+static void reg_store_init(void)
+{
+	struct osmo_modbus_reg_store *store;
+	uint16_t *values;
+
+	store = osmo_modbus_reg_store_alloc(conn);
+	OSMO_ASSERT(store);
+	OSMO_ASSERT(osmo_modbus_reg_store_add_range(store, 0, 0x10000) == 0);
+	values = talloc_array(tall_ctx, uint16_t, 0x10000);
+	memset(values, 0x2b, 0x10000 * sizeof(uint16_t));
+	osmo_modbus_reg_store_set(store, 0, 0x10000, values);
+	talloc_free(values);
+}
+
 int main(int argc, char **argv)
 {
 	struct osmo_modbus_conn_rtu *rtu;
@@ -243,8 +323,10 @@ int main(int argc, char **argv)
 	osmo_modbus_conn_set_prim_cb(conn, prim_cb, NULL);
 	osmo_modbus_conn_set_address(conn, slave_address);
 	osmo_modbus_conn_set_monitor_mode(conn, monitor);
+	reg_store_init();
 	rtu = osmo_modbus_conn_get_rtu(conn);
 	osmo_modbus_conn_rtu_set_device(rtu, device_path);
+	osmo_modbus_conn_rtu_set_resync(rtu, resync);
 	if ((rc = osmo_modbus_conn_connect(conn)) < 0) {
 		LOGP(DMAIN, LOGL_INFO, "Connect to modbus serial device %s failed! %d\n", device_path, rc);
 		exit(1);
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2020  Pau Espin Pedrol <pespin@espeweb.net>
+ *
+ * All Rights Reserved
+ *
+ * SPDX-License-Identifier: GPL-2.0+
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+/* Measures how late the RTU framing timers (T1.5/T3.5) expire, comparing
+ * osmo_timer (serviced by the select loop timeout) against a timerfd, as
+ * enabled with osmo_modbus_conn_rtu_set_timerfd(). */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/select.h>
+
+static unsigned long iterations = 2000;
+/* T1.5 and T3.5 used above 19200 baud, plus T3.5 at 9600 baud */
+static const unsigned long gaps_us[] = { 750, 1750, 4010 };
+
+static struct timespec t_start;
+static bool fired;
+static struct osmo_timer_list timer;
+static struct osmo_fd tfd = { .fd = -1 };
+
+static long elapsed_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t_start.tv_sec) * 1000000 + (now.tv_nsec - t_start.tv_nsec) / 1000;
+}
+
+static void timer_cb(void *data)
+{
+	fired = true;
+}
+
+static int timerfd_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	uint64_t expire_count;
+	if (read(ofd->fd, &expire_count, sizeof(expire_count)) == sizeof(expire_count))
+		fired = true;
+	return 0;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+	return (la > lb) - (la < lb);
+}
+
+/* Fill late_us with how late each of the iterations expired */
+static void measure(bool use_timerfd, unsigned long gap_us, long *late_us)
+{
+	struct timespec ts = { .tv_sec = gap_us / 1000000, .tv_nsec = (gap_us % 1000000) * 1000 };
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++) {
+		fired = false;
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		if (use_timerfd)
+			osmo_timerfd_schedule(&tfd, &ts, NULL);
+		else
+			osmo_timer_schedule(&timer, ts.tv_sec, gap_us % 1000000);
+		while (!fired)
+			osmo_select_main(0);
+		late_us[i] = elapsed_us() - gap_us;
+	}
+}
+
+static void print_help(void)
+{
+	printf("  -h --help			This text.\n");
+	printf("  -n --iterations N		Timer expirations measured per gap (default %lu)\n", iterations);
+}
+
+static void handle_options(int argc, char **argv)
+{
+	while (1) {
+		int option_index = 0, c;
+		static const struct option long_options[] = {
+			{ "help", 0, 0, 'h' },
+			{ "iterations", 1, 0, 'n' },
+			{ NULL, 0, 0, 0 }
+		};
+
+		c = getopt_long(argc, argv, "hn:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Error in command line options. Exiting\n");
+			exit(1);
+			break;
+		}
+	}
+
+	if (iterations == 0) {
+		fprintf(stderr, "Iterations must be > 0\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	long *late_us;
+	unsigned int i, mode;
+	long sum;
+	unsigned long j;
+
+	handle_options(argc, argv);
+
+	osmo_timer_setup(&timer, timer_cb, NULL);
+	if (osmo_timerfd_setup(&tfd, timerfd_cb, NULL) < 0) {
+		fprintf(stderr, "Failed to set up timerfd\n");
+		exit(1);
+	}
+	late_us = calloc(iterations, sizeof(*late_us));
+
+	printf("%-9s %8s %10s %10s %10s %10s\n", "timer", "gap_us", "mean_late", "p50_late", "p99_late", "max_late");
+	for (i = 0; i < ARRAY_SIZE(gaps_us); i++) {
+		for (mode = 0; mode < 2; mode++) {
+			measure(mode == 1, gaps_us[i], late_us);
+			qsort(late_us, iterations, sizeof(*late_us), cmp_long);
+			for (sum = 0, j = 0; j < iterations; j++)
+				sum += late_us[j];
+			printf("%-9s %8lu %10ld %10ld %10ld %10ld\n", mode ? "timerfd" : "osmo_timer",
+			       gaps_us[i], sum / (long)iterations, late_us[iterations / 2],
+			       late_us[iterations * 99 / 100], late_us[iterations - 1]);
+		}
+	}
+
+	free(late_us);
+	return 0;
+}